@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lex.h"
+#include "prog.h"
+#include "table.h"
+#include "cfg.h"
+#include "alias.h"
+
+/**
+ * Alias classes.
+ *
+ * A store to a segment can only change words of its region: local and
+ * argument are on the stack, static between the registers and the stack,
+ * temp and pointer in registers. this and that are the exception, as
+ * THIS and THAT may hold any address. Jack only sets them from
+ * references though, which come from calls like constructors and
+ * Memory.alloc, plus offsets into them. Where a function's pointer only
+ * ever holds a reference, this or that only reaches the heap and the
+ * memory mapped above it.
+ *
+ * Each value is taken as a reference, a raw number, or not known yet,
+ * and followed into every slot it is stored in: the statics of each
+ * file, and the locals, arguments, temp and pointer of each function,
+ * arguments through every call, and what each function returns. A call
+ * gives what its callee returns, which is raw for functions the program
+ * doesn't define. Words stored through this and that are followed into
+ * one slot for all of them, which is what any word read through them
+ * holds. A reference plus anything is a reference. Constants below the
+ * heap are raw, and so is anything else worked out.
+ * A slot holds a reference if everything stored in it does, iterated
+ * over the whole program until nothing changes. A slot read before
+ * anything is stored in it is taken to hold what is stored later, except
+ * that one nothing is stored in at all holds whatever RAM started with,
+ * so is raw. Memory's own `let ram = 0;` makes ram raw this way.
+ *
+ * A function's pointer is raw anyway where it may be read before the
+ * function sets it, since it is then whatever the caller left there.
+ *
+ * Values on the stack are only followed from one label to the next.
+ *
+ */
+
+#define HEAP_BASE  2048
+
+// Values on the stack followed at once, deeper ones are raw
+#define ALIAS_STACK  64
+
+typedef enum {
+    CLASS_UNSET,    // Nothing known yet
+    CLASS_REF,
+    CLASS_RAW,
+} Class;
+
+typedef struct Slots {
+    Table *names;       // "File.n" for statics, "fn segment n" otherwise,
+                        // "fn return" for what fn returns, "heap" for
+                        // words through this and that
+    Class *cls;         // By id in names
+    char *stored;       // Anything is stored in it
+    int cap;
+    int counting;       // First walk, interning slots and finding stores
+} Slots;
+
+static int walk(Slots *s, Func *f);
+static int slot(Slots *s, Func *f, const char *fn, Memory mem, int num);
+static int returned(Slots *s, const char *fn);
+static int heap(Slots *s);
+static int intern(Slots *s, const char *key);
+static int store(Slots *s, int id, Class v);
+static int read_first(Func *f, int k);
+
+
+Aliases *plan_aliases(FileList *fl) {
+
+    int nfunc;
+    Func *func = cfg_split(fl, &nfunc);
+
+    Aliases *r = malloc(sizeof(Aliases));
+    if (!r) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    r->names = new_table();
+    r->refs = calloc(nfunc + 1, sizeof(int));
+
+    if (!r->refs) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    Slots s = { new_table(), NULL, NULL, 0, 1 };
+
+    for (int i = 0; i < nfunc; ++i)
+        walk(&s, &func[i]);
+
+    for (int id = 0; id < s.names->size; ++id)
+        if (!s.stored[id])
+            s.cls[id] = CLASS_RAW;
+
+    s.counting = 0;
+
+    int changed;
+    do {
+        changed = 0;
+        for (int i = 0; i < nfunc; ++i)
+            changed |= walk(&s, &func[i]);
+    } while (changed);
+
+    for (int i = 0; i < nfunc; ++i) {
+        if (!func[i].name)
+            continue;
+
+        int known = r->names->size;
+        int id = table_intern(r->names, func[i].name);
+        if (r->names->size == known)
+            continue;
+
+        cfg_build(&func[i]);
+
+        for (int k = 0; k < 2; ++k) {
+            int p = slot(&s, &func[i], func[i].name, POINTER, k);
+
+            if (s.cls[p] == CLASS_REF && !read_first(&func[i], k))
+                r->refs[id] |= k ? ALIAS_THAT : ALIAS_THIS;
+        }
+    }
+
+    free_table(s.names);
+    free(s.cls);
+    free(s.stored);
+    free_funcs(func, nfunc);
+
+    return r;
+}
+
+// Follow values through f once. Returns whether any slot changed.
+int walk(Slots *s, Func *f) {
+
+    Class stack[ALIAS_STACK];
+    int depth = 0;
+    int changed = 0;
+
+    for (int i = 0; i < f->ninst; ++i) {
+        TokenList *inst = &f->inst[i];
+        Memory mem = inst->argc > 0 ? inst->argv[0].mem : CONSTANT;
+        int num = inst->argc > 1 ? inst->argv[1].num : 0;
+        Class v = CLASS_RAW, x;
+        int id;
+
+        switch (inst->cmd) {
+            case PUSH:
+                if (mem == CONSTANT)
+                    v = num >= HEAP_BASE ? CLASS_REF : CLASS_RAW;
+                else if (mem == THIS || mem == THAT) {
+                    id = heap(s);
+                    v = s->cls[id];
+                } else {
+                    id = slot(s, f, f->name, mem, num);
+                    v = s->cls[id];
+                }
+                break;
+
+            case POP:
+                v = depth ? stack[--depth] : CLASS_RAW;
+
+                if (mem == THIS || mem == THAT)
+                    changed |= store(s, heap(s), v);
+                else if (mem != CONSTANT)
+                    changed |= store(s, slot(s, f, f->name, mem, num), v);
+                continue;
+
+            case ARITHMETIC:
+                x = depth ? stack[--depth] : CLASS_RAW;
+
+                if (inst->argv[0].op == NEG || inst->argv[0].op == NOT)
+                    break;
+
+                v = depth ? stack[--depth] : CLASS_RAW;
+
+                // A reference plus an offset, either way round
+                if (inst->argv[0].op != ADD)
+                    v = CLASS_RAW;
+                else if (v == CLASS_UNSET || x == CLASS_UNSET)
+                    v = CLASS_UNSET;
+                else if (v == CLASS_REF || x == CLASS_REF)
+                    v = CLASS_REF;
+                break;
+
+            case CALL:
+                for (int j = inst->argv[1].num - 1; j >= 0; --j) {
+                    x = depth ? stack[--depth] : CLASS_RAW;
+                    changed |= store(s, slot(s, f, inst->argv[0].name, ARGUMENT, j), x);
+                }
+
+                id = returned(s, inst->argv[0].name);
+                v = s->cls[id];
+                break;
+
+            case RETURN:
+                v = depth ? stack[depth - 1] : CLASS_RAW;
+                changed |= store(s, returned(s, f->name), v);
+                depth = 0;
+                continue;
+
+            case IF:
+                if (depth)
+                    --depth;
+                continue;
+
+            default:
+                depth = 0;
+                continue;
+        }
+
+        if (depth == ALIAS_STACK) {
+            memmove(stack, stack + 1, (ALIAS_STACK - 1) * sizeof(Class));
+            --depth;
+        }
+
+        stack[depth++] = v;
+    }
+
+    return changed;
+}
+
+// Id of a slot of fn, or of f's file for statics
+int slot(Slots *s, Func *f, const char *fn, Memory mem, int num) {
+
+    char key[256];
+    if (mem == STATIC)
+        snprintf(key, sizeof(key), "%s.%d", f->fname, num);
+    else
+        snprintf(key, sizeof(key), "%s %s %d", fn ? fn : "", mem_name[mem], num);
+
+    return intern(s, key);
+}
+
+// Id of what fn returns
+int returned(Slots *s, const char *fn) {
+
+    char key[256];
+    snprintf(key, sizeof(key), "%s return", fn ? fn : "");
+
+    return intern(s, key);
+}
+
+// Id of the words stored through this and that
+int heap(Slots *s) {
+    return intern(s, "heap");
+}
+
+int intern(Slots *s, const char *key) {
+
+    int known = s->names->size;
+    int id = table_intern(s->names, key);
+
+    if (s->names->size == known)
+        return id;
+
+    if (id == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 256;
+        s->cls = realloc(s->cls, s->cap * sizeof(Class));
+        s->stored = realloc(s->stored, s->cap);
+
+        if (!s->cls || !s->stored) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+    }
+
+    s->cls[id] = CLASS_UNSET;
+    s->stored[id] = 0;
+
+    return id;
+}
+
+// Take v being stored in id into account. Returns whether its class
+// changed.
+int store(Slots *s, int id, Class v) {
+
+    if (s->counting)
+        s->stored[id] = 1;
+
+    if (v <= s->cls[id])
+        return 0;
+
+    s->cls[id] = v;
+    return 1;
+}
+
+// Whether f may read through pointer k, or read it, before setting it
+int read_first(Func *f, int k) {
+
+    Memory seg = k ? THAT : THIS;
+
+    int *seen = calloc(f->nblock + 1, sizeof(int));
+    int *work = malloc((f->nblock + 1) * sizeof(int));
+
+    if (!seen || !work) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    int nwork = 0;
+    int r = 0;
+
+    if (f->nblock) {
+        work[nwork++] = 0;
+        seen[0] = 1;
+    }
+
+    while (nwork && !r) {
+        Block *b = &f->block[work[--nwork]];
+        int set = 0;
+
+        for (int i = b->first; i < b->end && !set && !r; ++i) {
+            TokenList *inst = &f->inst[i];
+            if (inst->cmd != PUSH && inst->cmd != POP)
+                continue;
+
+            Memory mem = inst->argv[0].mem;
+            int num = inst->argv[1].num;
+
+            if (mem == POINTER && num == k)
+                set = inst->cmd == POP;
+
+            r = mem == seg || (mem == POINTER && num == k && !set);
+        }
+
+        for (int j = 0; j < b->nsucc && !set; ++j) {
+            int n = b->succ[j];
+
+            if (n >= 0 && !seen[n]) {
+                seen[n] = 1;
+                work[nwork++] = n;
+            }
+        }
+    }
+
+    free(seen);
+    free(work);
+
+    return r;
+}
+
+// Pointers the function only reads through while they hold references
+int alias_refs(const Aliases *a, const char *fn) {
+
+    if (!a || !fn)
+        return 0;
+
+    int id = table_find(a->names, fn);
+
+    return id < 0 ? 0 : a->refs[id];
+}
+
+Region alias_region(int refs, Memory mem) {
+    switch (mem) {
+        case CONSTANT:  return REGION_NONE;
+        case POINTER:   return REGION_BASE;
+        case TEMP:      return REGION_TEMP;
+        case STATIC:    return REGION_STATIC;
+        case LOCAL:
+        case ARGUMENT:  return REGION_FRAME;
+        case THIS:      return refs & ALIAS_THIS ? REGION_HEAP : REGION_ANY;
+        case THAT:      return refs & ALIAS_THAT ? REGION_HEAP : REGION_ANY;
+        default:        return REGION_ANY;
+    }
+}
+
+// Whether words of x and y may be the same
+int alias_may(Region x, Region y) {
+
+    if (x == REGION_NONE || y == REGION_NONE)
+        return 0;
+
+    return x == y || x == REGION_ANY || y == REGION_ANY;
+}
+
+void free_aliases(Aliases *a) {
+    if (a) {
+        free_table(a->names);
+        free(a->refs);
+        free(a);
+    }
+}
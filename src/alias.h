@@ -0,0 +1,26 @@
+// Pointers a function only ever reads through holding references
+#define ALIAS_THIS  1
+#define ALIAS_THAT  2
+
+// Words a segment reaches. Two regions only overlap if they are the
+// same, or one is REGION_ANY.
+typedef enum {
+    REGION_NONE,    // constant, which is no word
+    REGION_BASE,    // pointer, and the other registers segments start at
+    REGION_TEMP,
+    REGION_STATIC,
+    REGION_FRAME,   // local and argument, on the stack
+    REGION_HEAP,    // this and that through references
+    REGION_ANY,     // this and that through any other address
+} Region;
+
+typedef struct Aliases {
+    struct Table *names;    // Functions defined, first definition first
+    int *refs;              // By id in names, ALIAS_THIS and ALIAS_THAT
+} Aliases;
+
+Aliases *plan_aliases(FileList *fl);
+int alias_refs(const Aliases *a, const char *fn);
+Region alias_region(int refs, Memory mem);
+int alias_may(Region x, Region y);
+void free_aliases(Aliases *a);
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lex.h"
+#include "prog.h"
+#include "table.h"
+#include "prof.h"
+#include "write.h"
+#include "analyze.h"
+
+/**
+ * Opcode n-gram analysis.
+ *
+ * Counts every run of up to maxn instructions within a function, with
+ * operands abstracted the way a superinstruction would see them:
+ * segment indexes, labels and function names become X, L and F, while
+ * constants, pointer indexes and argument counts are kept. Each n-gram
+ * is weighted by the words its current translation takes.
+ *
+ * Savings assume the n-gram becomes a shared routine: each use costs
+ * SUPERINST_WORDS to jump there and back, and one copy of the body is
+ * kept.
+ *
+ */
+
+#define SUPERINST_WORDS 4
+
+typedef struct Gram {
+    int n;
+    long count;
+    int words;
+    long saved;
+} Gram;
+
+static int abstract(char *buf, TokenList *inst);
+static Gram *gram_sort;
+static int by_saved(const void *a, const void *b);
+
+
+void analyze_file_list(FILE *fp, FileList *fl, int maxn) {
+
+    Table *keys = new_table();
+    Gram *gram = NULL;
+    int cap = 0;
+
+    long ninst = 0;
+    int nfile = 0;
+
+    char *buf = malloc(maxn * 256);
+    TokenList **win = malloc(maxn * sizeof(TokenList*));
+
+    FileList *it;
+    for (it = fl; it; it = it->next) {
+        ++nfile;
+
+        int nwin = 0;
+
+        TokenList *inst;
+        for (inst = it->tl; inst; inst = inst->next) {
+            ++ninst;
+
+            // N-grams don't span functions
+            if (inst->cmd == FUNCTION)
+                nwin = 0;
+
+            if (nwin == maxn) {
+                memmove(win, win + 1, (maxn - 1) * sizeof(TokenList*));
+                --nwin;
+            }
+            win[nwin++] = inst;
+
+            // Every n-gram ending at inst
+            for (int n = 1; n <= nwin; ++n) {
+                int len = 0;
+
+                for (int i = nwin - n; i < nwin; ++i) {
+                    if (len)
+                        len += sprintf(buf + len, "; ");
+                    len += abstract(buf + len, win[i]);
+                }
+
+                int known = keys->size;
+                int id = table_intern(keys, buf);
+
+                if (id >= cap) {
+                    cap = cap ? cap * 2 : 1024;
+                    gram = realloc(gram, cap * sizeof(Gram));
+
+                    if (!gram) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        exit(1);
+                    }
+                }
+
+                if (keys->size > known) {
+                    gram[id].n = n;
+                    gram[id].count = 0;
+                    gram[id].words = write_cost(win[nwin - n], n, it->name, NULL);
+                }
+
+                ++gram[id].count;
+            }
+        }
+    }
+
+    int *order = malloc(keys->size * sizeof(int));
+    for (int i = 0; i < keys->size; ++i) {
+        Gram *g = &gram[i];
+        g->saved = g->count * (g->words - SUPERINST_WORDS) - g->words;
+        order[i] = i;
+    }
+
+    gram_sort = gram;
+    qsort(order, keys->size, sizeof(int), by_saved);
+
+    fprintf(fp, "# %ld instructions in %d files, n-grams up to %d\n",
+            ninst, nfile, maxn);
+    fprintf(fp, "# %10s %6s %10s %10s  %s\n",
+            "count", "words", "weight", "saved", "n-gram");
+
+    for (int i = 0; i < keys->size; ++i) {
+        Gram *g = &gram[order[i]];
+
+        fprintf(fp, "  %10ld %6d %10ld %10ld  %s\n",
+                g->count, g->words, g->count * g->words, g->saved,
+                table_key(keys, order[i]));
+    }
+
+    free(order);
+    free(win);
+    free(buf);
+    free(gram);
+    free_table(keys);
+}
+
+
+int abstract(char *buf, TokenList *inst) {
+
+    const CmdArg *argv = inst->argv;
+    switch (inst->cmd) {
+        case PUSH:
+        case POP:
+            if (argv[0].mem == CONSTANT || argv[0].mem == POINTER)
+                return sprintf(buf, "%s %s %d",
+                               inst->cmd == PUSH ? "push" : "pop",
+                               mem_name[argv[0].mem], argv[1].num);
+
+            return sprintf(buf, "%s %s X",
+                           inst->cmd == PUSH ? "push" : "pop",
+                           mem_name[argv[0].mem]);
+
+        case ARITHMETIC: return sprintf(buf, "%s", op_name[argv[0].op]);
+        case LABEL:      return sprintf(buf, "label L");
+        case GOTO:       return sprintf(buf, "goto L");
+        case IF:         return sprintf(buf, "if-goto L");
+        case FUNCTION:   return sprintf(buf, "function F %d", argv[1].num);
+        case CALL:       return sprintf(buf, "call F %d", argv[1].num);
+        case RETURN:     return sprintf(buf, "return");
+
+        default:         return sprintf(buf, "?");
+    }
+}
+
+int by_saved(const void *a, const void *b) {
+    long x = gram_sort[*(const int*) a].saved;
+    long y = gram_sort[*(const int*) b].saved;
+
+    return (x < y) - (x > y);
+}
@@ -0,0 +1 @@
+void analyze_file_list(FILE *fp, FileList *fl, int maxn);
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+/**
+ * Bump allocator.
+ *
+ * Hands out memory from a chain of blocks that is only ever freed all
+ * at once. Resetting keeps the blocks, so an arena reused for similar
+ * work stops calling malloc after the first time.
+ *
+ */
+
+#define ARENA_BLOCK  (1 << 20)
+#define ARENA_ALIGN  8
+
+
+Arena *new_arena() {
+    Arena *r = malloc(sizeof(Arena));
+
+    if (!r) {
+        fprintf(stderr, "Failed to allocate Arena\n");
+        exit(1);
+    }
+
+    r->head = NULL;
+    r->curr = NULL;
+
+    return r;
+}
+
+void free_arena(Arena *a) {
+    if (a) {
+        ArenaBlock *b, *next;
+        for (b = a->head; b; b = next) {
+            next = b->next;
+            free(b);
+        }
+
+        free(a);
+    }
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    // Blocks past curr are left over from before a reset
+    while (a->curr && a->curr->used + size > a->curr->size) {
+        if (!a->curr->next)
+            break;
+
+        a->curr = a->curr->next;
+        a->curr->used = 0;
+    }
+
+    if (!a->curr || a->curr->used + size > a->curr->size) {
+        size_t n = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        ArenaBlock *b = malloc(sizeof(ArenaBlock) + n);
+
+        if (!b) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+
+        b->size = n;
+        b->used = 0;
+        b->next = NULL;
+
+        if (a->curr)
+            a->curr->next = b;
+        else
+            a->head = b;
+
+        a->curr = b;
+    }
+
+    void *r = a->curr->data + a->curr->used;
+    a->curr->used += size;
+
+    return r;
+}
+
+// Forget everything allocated, keeping the blocks for reuse
+void arena_reset(Arena *a) {
+    a->curr = a->head;
+
+    if (a->curr)
+        a->curr->used = 0;
+}
@@ -0,0 +1,16 @@
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *head;
+    ArenaBlock *curr;
+} Arena;
+
+Arena *new_arena();
+void free_arena(Arena *a);
+void *arena_alloc(Arena *a, size_t size);
+void arena_reset(Arena *a);
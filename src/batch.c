@@ -0,0 +1,358 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lex.h"
+#include "prog.h"
+#include "table.h"
+#include "prof.h"
+#include "write.h"
+#include "pool.h"
+#include "load.h"
+#include "batch.h"
+
+/**
+ * Batch translation.
+ *
+ * Translates every program in a manifest, one per line as
+ *
+ *     OUTPUT INPUT.vm ...
+ *
+ * in a single process, with the programs shared out over the thread
+ * pool. Each input is lexed once however many programs list it, and
+ * the tokens are only read from then on.
+ *
+ * Programs are written one input file at a time through a WriteStream.
+ * The output for a file depends only on the file and where the stream
+ * is when it starts, so it is kept and reused when another program
+ * reaches the same file in the same place. Listing shared files, like
+ * the Jack OS, first in every program makes them hit.
+ *
+ */
+
+// A translated file, and where the stream was before and after
+typedef struct Piece {
+    WriteMark from;
+    WriteMark to;
+    char *out;
+    size_t len;
+    double secs;        // CPU time taken to translate
+    struct Piece *next;
+} Piece;
+
+typedef struct Program {
+    char *out;
+    int *in;            // Input ids, in order
+    int nin;
+} Program;
+
+typedef struct Manifest {
+    const WriteOptions *opt;
+    Program *prog;
+    int nprog;
+    FileList **file;    // Lexed inputs by id
+    long *tokens;       // Tokens in each input
+    Piece **cache;      // Translations of each input
+    pthread_mutex_t lock;
+    long reused;
+    long translated;
+    double secs;        // CPU time translating, what reuse saved included
+} Manifest;
+
+static void read_manifest(Manifest *m, Table *inputs, char *fname);
+static void translate_program(void *ctx, int i);
+static Piece *find_piece(Piece *p, const WriteMark *at);
+static int same_mark(const WriteMark *a, const WriteMark *b);
+static char *copy_name(const char *s);
+static double now(clockid_t clock);
+
+
+void batch_translate(FILE *report, char *manifest, const WriteOptions *opt) {
+
+    double start = now(CLOCK_MONOTONIC);
+    double cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+
+    Manifest m;
+    Table *inputs = new_table();
+
+    m.opt = opt;
+    m.reused = 0;
+    m.translated = 0;
+    m.secs = 0;
+    pthread_mutex_init(&m.lock, NULL);
+
+    read_manifest(&m, inputs, manifest);
+
+    int n = inputs->size;
+
+    // Lex every input once, in the order first seen
+    FileList *fl = new_file_list();
+    load_files(fl, inputs->key, n, opt->jobs);
+
+    double lexed = now(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+    m.file   = malloc(n * sizeof(FileList*));
+    m.tokens = calloc(n, sizeof(long));
+    m.cache  = calloc(n, sizeof(Piece*));
+
+    if (!m.file || !m.tokens || !m.cache) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    FileList *it = fl;
+    for (int i = 0; i < n; ++i, it = it->next) {
+        m.file[i] = it;
+
+        TokenList *inst;
+        for (inst = it->tl; inst; inst = inst->next)
+            ++m.tokens[i];
+    }
+
+    pool_run(opt->jobs, m.nprog, translate_program, &m);
+
+    double end = now(CLOCK_MONOTONIC);
+
+    // A process per program would lex all of its inputs and translate
+    // every one of them itself
+    long total = 0, listed = 0, lexes = 0;
+    for (int i = 0; i < n; ++i)
+        total += m.tokens[i];
+
+    for (int i = 0; i < m.nprog; ++i) {
+        lexes += m.prog[i].nin;
+        for (int j = 0; j < m.prog[i].nin; ++j)
+            listed += m.tokens[m.prog[i].in[j]];
+    }
+
+    double alone = m.secs + (total ? lexed * listed / total : 0);
+
+    fprintf(report,
+            "Batch: %d programs, %ld inputs lexed as %d files, "
+            "%ld translated and %ld reused\n",
+            m.nprog, lexes, n, m.translated, m.reused);
+    fprintf(report,
+            "Batch: %.3f s in one process, about %.3f s CPU lexing and translating "
+            "as separate runs\n",
+            end - start, alone);
+
+    for (int i = 0; i < n; ++i) {
+        Piece *p, *next;
+        for (p = m.cache[i]; p; p = next) {
+            next = p->next;
+
+            free((char*) p->from.fn);
+            free((char*) p->to.fn);
+            free(p->out);
+            free(p);
+        }
+    }
+
+    for (int i = 0; i < m.nprog; ++i) {
+        free(m.prog[i].out);
+        free(m.prog[i].in);
+    }
+
+    pthread_mutex_destroy(&m.lock);
+
+    free(m.prog);
+    free(m.file);
+    free(m.tokens);
+    free(m.cache);
+    free_file_list(fl);
+    free_table(inputs);
+}
+
+
+void read_manifest(Manifest *m, Table *inputs, char *fname) {
+
+    FILE *fp = fopen(fname, "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to load file '%s'\n", fname);
+        exit(1);
+    }
+
+    int cap = 0;
+    m->prog = NULL;
+    m->nprog = 0;
+
+    char *line = NULL;
+    size_t size = 0;
+    int lineno = 0;
+
+    while (getline(&line, &size, fp) != -1) {
+        ++lineno;
+
+        char *save;
+        char *word = strtok_r(line, " \t\r\n", &save);
+
+        if (!word || word[0] == '#')
+            continue;
+
+        if (m->nprog == cap) {
+            cap = cap ? cap * 2 : 64;
+            m->prog = realloc(m->prog, cap * sizeof(Program));
+
+            if (!m->prog) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                exit(1);
+            }
+        }
+
+        Program *p = &m->prog[m->nprog++];
+        p->out = copy_name(word);
+        p->in  = NULL;
+        p->nin = 0;
+
+        int incap = 0;
+        while ((word = strtok_r(NULL, " \t\r\n", &save))) {
+            if (p->nin == incap) {
+                incap = incap ? incap * 2 : 16;
+                p->in = realloc(p->in, incap * sizeof(int));
+
+                if (!p->in) {
+                    fprintf(stderr, "Failed to allocate memory\n");
+                    exit(1);
+                }
+            }
+
+            p->in[p->nin++] = table_intern(inputs, word);
+        }
+
+        if (!p->nin) {
+            fprintf(stderr,
+                    "%s:%d: No input files given for '%s'\n",
+                    fname, lineno, p->out);
+            exit(1);
+        }
+    }
+
+    free(line);
+    fclose(fp);
+}
+
+void translate_program(void *ctx, int i) {
+
+    Manifest *m = ctx;
+    Program *p = &m->prog[i];
+
+    FILE *fo = fopen(p->out, "w");
+    if (!fo) {
+        fprintf(stderr,
+                "Failed to open file '%s' for writing\n",
+                p->out);
+        exit(1);
+    }
+
+    WriteStream *s = write_begin(fo, m->opt);
+
+    for (int j = 0; j < p->nin; ++j) {
+        int id = p->in[j];
+        FileList *f = m->file[id];
+        WriteMark at = write_mark(s);
+
+        pthread_mutex_lock(&m->lock);
+        Piece *hit = find_piece(m->cache[id], &at);
+        if (hit) {
+            ++m->reused;
+            m->secs += hit->secs;
+        }
+        pthread_mutex_unlock(&m->lock);
+
+        if (hit) {
+            fwrite(hit->out, 1, hit->len, fo);
+            write_seek(s, &hit->to);
+            continue;
+        }
+
+        Piece *piece = malloc(sizeof(Piece));
+        FILE *fp = piece ? open_memstream(&piece->out, &piece->len) : NULL;
+
+        if (!fp) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+
+        piece->from = at;
+        piece->from.fn = copy_name(at.fn);
+
+        double t = now(CLOCK_THREAD_CPUTIME_ID);
+        write_tokens(s, fp, f->tl, f->name);
+        fclose(fp);
+        piece->secs = now(CLOCK_THREAD_CPUTIME_ID) - t;
+
+        piece->to = write_mark(s);
+        piece->to.fn = copy_name(piece->to.fn);
+
+        fwrite(piece->out, 1, piece->len, fo);
+
+        // Another program may have got here first
+        pthread_mutex_lock(&m->lock);
+        ++m->translated;
+        m->secs += piece->secs;
+
+        if (!find_piece(m->cache[id], &at)) {
+            piece->next = m->cache[id];
+            m->cache[id] = piece;
+            piece = NULL;
+        }
+        pthread_mutex_unlock(&m->lock);
+
+        if (piece) {
+            free((char*) piece->from.fn);
+            free((char*) piece->to.fn);
+            free(piece->out);
+            free(piece);
+        }
+    }
+
+    write_end(s);
+
+    if (fclose(fo) != 0) {
+        fprintf(stderr, "Failed to write output '%s'\n", p->out);
+        exit(1);
+    }
+}
+
+Piece *find_piece(Piece *p, const WriteMark *at) {
+    for (; p; p = p->next)
+        if (same_mark(&p->from, at))
+            return p;
+
+    return NULL;
+}
+
+int same_mark(const WriteMark *a, const WriteMark *b) {
+    if (a->pc != b->pc || a->jcount != b->jcount
+            || a->ccount != b->ccount || a->icount != b->icount)
+        return 0;
+
+    if (!a->fn || !b->fn)
+        return a->fn == b->fn;
+
+    return strcmp(a->fn, b->fn) == 0;
+}
+
+char *copy_name(const char *s) {
+    if (!s)
+        return NULL;
+
+    char *r = malloc(strlen(s) + 1);
+    if (!r) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    strcpy(r, s);
+
+    return r;
+}
+
+double now(clockid_t clock) {
+    struct timespec t;
+    clock_gettime(clock, &t);
+
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
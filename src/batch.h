@@ -0,0 +1 @@
+void batch_translate(FILE *report, char *manifest, const WriteOptions *opt);
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lex.h"
+#include "prog.h"
+#include "table.h"
+#include "arena.h"
+#include "cfg.h"
+
+/**
+ * Per-function control flow graphs.
+ *
+ * A Func holds a private copy of one function's instructions, so passes
+ * can rewrite it while the lexed tokens, which may be shared, are only
+ * read. Arguments still point into the originals; an instruction a pass
+ * makes up gets its arguments from the Func's arena.
+ *
+ * Blocks start at the first instruction, at every label and after every
+ * goto, if-goto and return. Labels are scoped to the function, so jumps
+ * resolve within the Func.
+ *
+ */
+
+static void fill(Func *f, TokenList *first, TokenList *end);
+
+
+// Split a program into functions, and whatever comes before the first
+// function of each file
+Func *cfg_split(FileList *fl, int *n) {
+
+    Func *r = NULL;
+    int cap = 0;
+    char *curr_fn = NULL;
+
+    *n = 0;
+
+    FileList *it;
+    for (it = fl; it; it = it->next) {
+
+        TokenList *inst, *first = it->tl;
+        char *scope = curr_fn;
+
+        for (inst = it->tl; ; inst = inst->next) {
+
+            if (inst && inst->cmd != FUNCTION)
+                continue;
+
+            if (first && first != inst) {
+                if (*n == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    r = realloc(r, cap * sizeof(Func));
+
+                    if (!r) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        exit(1);
+                    }
+                }
+
+                Func *f = cfg_func(first, inst, scope, it->name);
+                r[(*n)++] = *f;
+                free(f);
+            }
+
+            if (!inst)
+                break;
+
+            first = inst;
+            scope = curr_fn = inst->argv[0].name;
+        }
+    }
+
+    return r;
+}
+
+// A Func for the instructions from first up to end
+Func *cfg_func(TokenList *first, TokenList *end, char *scope, char *fname) {
+
+    Func *r = malloc(sizeof(Func));
+    if (!r) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    r->name    = NULL;
+    r->scope   = scope;
+    r->fname   = fname;
+    r->nlocals = 0;
+    r->block   = NULL;
+    r->nblock  = 0;
+    r->block_of    = NULL;
+    r->labels      = NULL;
+    r->label_block = NULL;
+    r->arena   = NULL;
+
+    if (first && first->cmd == FUNCTION) {
+        r->name    = first->argv[0].name;
+        r->scope   = r->name;
+        r->nlocals = first->argv[1].num;
+    }
+
+    fill(r, first, end);
+
+    return r;
+}
+
+void fill(Func *f, TokenList *first, TokenList *end) {
+
+    TokenList *inst;
+
+    f->ninst = 0;
+    for (inst = first; inst && inst != end; inst = inst->next)
+        ++f->ninst;
+
+    f->inst = malloc((f->ninst ? f->ninst : 1) * sizeof(TokenList));
+    if (!f->inst) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    int i = 0;
+    for (inst = first; inst && inst != end; inst = inst->next)
+        f->inst[i++] = *inst;
+
+    cfg_relink(f);
+}
+
+// Link the instructions in array order again, after a pass moved them
+void cfg_relink(Func *f) {
+    for (int i = 0; i < f->ninst; ++i)
+        f->inst[i].next = (i + 1 < f->ninst) ? &f->inst[i + 1] : NULL;
+}
+
+void cfg_build(Func *f) {
+
+    free(f->block);
+    free(f->block_of);
+    free(f->label_block);
+    free_table(f->labels);
+
+    f->nblock = 0;
+    f->block = malloc((f->ninst + 1) * sizeof(Block));
+    f->block_of = malloc((f->ninst + 1) * sizeof(int));
+    f->labels = new_table();
+    f->label_block = malloc((f->ninst + 1) * sizeof(int));
+
+    if (!f->block || !f->block_of || !f->label_block) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    // Leaders
+    int leader = 1;
+    for (int i = 0; i < f->ninst; ++i) {
+        TokenList *inst = &f->inst[i];
+
+        if (inst->cmd == LABEL || leader) {
+            if (f->nblock)
+                f->block[f->nblock - 1].end = i;
+
+            Block *b = &f->block[f->nblock++];
+            b->first = i;
+            b->nsucc = 0;
+            b->succ[0] = b->succ[1] = -1;
+        }
+
+        f->block_of[i] = f->nblock - 1;
+
+        if (inst->cmd == LABEL) {
+            int id = table_intern(f->labels, inst->argv[0].name);
+            f->label_block[id] = f->nblock - 1;
+        }
+
+        leader = inst->cmd == GOTO || inst->cmd == IF || inst->cmd == RETURN;
+    }
+
+    if (f->nblock)
+        f->block[f->nblock - 1].end = f->ninst;
+
+    // Edges
+    for (int i = 0; i < f->nblock; ++i) {
+        Block *b = &f->block[i];
+        TokenList *last = &f->inst[b->end - 1];
+
+        if (last->cmd != GOTO && last->cmd != RETURN && i + 1 < f->nblock)
+            b->succ[b->nsucc++] = i + 1;
+
+        if (last->cmd == GOTO || last->cmd == IF) {
+            int t = cfg_target(f, last->argv[0].name);
+            if (t >= 0)
+                b->succ[b->nsucc++] = t;
+        }
+
+        // Both ways to the same block count once
+        if (b->nsucc == 2 && b->succ[0] == b->succ[1])
+            b->nsucc = 1;
+    }
+}
+
+// Block a label starts, -1 if the function has no such label
+int cfg_target(Func *f, const char *label) {
+    int id = table_find(f->labels, label);
+    return id < 0 ? -1 : f->label_block[id];
+}
+
+void free_func(Func *f) {
+    free(f->inst);
+    free(f->block);
+    free(f->block_of);
+    free(f->label_block);
+    free_table(f->labels);
+    free_arena(f->arena);
+}
+
+void free_funcs(Func *f, int n) {
+    for (int i = 0; i < n; ++i)
+        free_func(&f[i]);
+
+    free(f);
+}
@@ -0,0 +1,29 @@
+typedef struct Block {
+    int first;          // First instruction
+    int end;            // One past the last instruction
+    int succ[2];        // Successors, fall through first; -1 if none
+    int nsucc;
+} Block;
+
+typedef struct Func {
+    char *name;         // Function defined, NULL for code before any
+    char *scope;        // Function its labels belong to, may be NULL
+    char *fname;        // File, for statics
+    int nlocals;
+    TokenList *inst;    // Copies of the instructions, linked in order
+    int ninst;
+    Block *block;       // NULL until cfg_build()
+    int nblock;
+    int *block_of;      // Block of each instruction
+    struct Table *labels;   // Label names, by block where they are
+    int *label_block;
+    struct Arena *arena;    // For instructions passes make up
+} Func;
+
+Func *cfg_split(FileList *fl, int *n);
+Func *cfg_func(TokenList *first, TokenList *end, char *scope, char *fname);
+void cfg_build(Func *f);
+int cfg_target(Func *f, const char *label);
+void cfg_relink(Func *f);
+void free_func(Func *f);
+void free_funcs(Func *f, int n);
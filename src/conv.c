@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lex.h"
+#include "prog.h"
+#include "table.h"
+#include "cfg.h"
+#include "stack.h"
+#include "conv.h"
+
+/**
+ * Calling conventions.
+ *
+ * The VM can only call a function by name, so with the whole program in
+ * hand every caller of a function is known. A function that calls
+ * nothing and takes at most CONV_ARGS arguments gets a fast convention:
+ *
+ *     caller:  arguments go in R13 and R14 instead of the stack, and the
+ *              return address is pushed where the first one was
+ *     callee:  saves THIS and THAT only if it sets them, and LCL only if
+ *              it has locals, then returns with the value in D
+ *
+ * None of ARG, the frame pointer or the copy of the value through *ARG
+ * is needed, and the caller stores D wherever the value goes next.
+ *
+ * Without locals the callee finds the return address under the value
+ * it returns, so it must reach every return with nothing else on the
+ * stack. Functions that might not keep LCL and reset the stack from it
+ * instead.
+ *
+ */
+
+static const char *reject(Func *f, Conv *c, Func *prev);
+static int exact_returns(Func *f);
+
+
+CallConv *choose_conv(FileList *fl) {
+
+    int nfunc;
+    Func *func = cfg_split(fl, &nfunc);
+
+    CallConv *r = malloc(sizeof(CallConv));
+    if (!r) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    r->names = new_table();
+    r->fn = calloc(nfunc + 1, sizeof(Conv));
+    int *def = malloc((nfunc + 1) * sizeof(int));
+
+    if (!r->fn || !def) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < nfunc; ++i) {
+        def[i] = -1;
+
+        if (!func[i].name)
+            continue;
+
+        int known = r->names->size;
+        int id = table_intern(r->names, func[i].name);
+
+        if (r->names->size > known) {
+            def[i] = id;
+            r->fn[id].argc = -1;
+        } else {
+            r->fn[id].why = "defined twice";
+        }
+    }
+
+    // Every call of a function has to pass the same arguments
+    for (int i = 0; i < nfunc; ++i) {
+        for (int j = 0; j < func[i].ninst; ++j) {
+            TokenList *inst = &func[i].inst[j];
+            if (inst->cmd != CALL)
+                continue;
+
+            int id = table_find(r->names, inst->argv[0].name);
+            if (id < 0)
+                continue;
+
+            Conv *c = &r->fn[id];
+            if (c->argc < 0)
+                c->argc = inst->argv[1].num;
+            else if (c->argc != inst->argv[1].num)
+                c->why = "argument counts differ";
+        }
+    }
+
+    for (int i = 0; i < nfunc; ++i) {
+        if (def[i] < 0)
+            continue;
+
+        Conv *c = &r->fn[def[i]];
+        if (!c->why)
+            c->why = reject(&func[i], c, i ? &func[i - 1] : NULL);
+    }
+
+    free(def);
+    free_funcs(func, nfunc);
+
+    return r;
+}
+
+// Why f can't be fast, or NULL having filled in the rest of c
+const char *reject(Func *f, Conv *c, Func *prev) {
+
+    if (strcmp(f->name, "Sys.init") == 0)
+        return "entered from the preamble";
+
+    if (c->argc < 0)
+        return "never called";
+
+    if (c->argc > CONV_ARGS)
+        return "too many arguments";
+
+    // Code running off the end of the function before gets here too
+    TokenList *last = prev && prev->ninst ? &prev->inst[prev->ninst - 1] : NULL;
+    if (last && last->cmd != RETURN && last->cmd != GOTO)
+        return "entered by falling through";
+
+    last = &f->inst[f->ninst - 1];
+    if (last->cmd != RETURN && last->cmd != GOTO)
+        return "falls through its end";
+
+    c->framed = f->nlocals > 0;
+
+    for (int i = 0; i < f->ninst; ++i) {
+        TokenList *inst = &f->inst[i];
+
+        switch (inst->cmd) {
+            case CALL:
+                if (strcmp(inst->argv[0].name, f->name) == 0)
+                    return "callee recursive";
+                return "callee makes calls";
+
+            case PUSH:
+            case POP:
+                if (inst->argv[0].mem == ARGUMENT && inst->argv[1].num >= c->argc)
+                    return "uses arguments it isn't passed";
+
+                if (inst->argv[0].mem == LOCAL)
+                    c->framed = 1;
+
+                if (inst->cmd == POP && inst->argv[0].mem == POINTER)
+                    c->saves |= inst->argv[1].num ? CONV_THAT : CONV_THIS;
+                break;
+
+            default: /* NOP */
+                break;
+        }
+    }
+
+    if (!c->framed && !exact_returns(f))
+        c->framed = 1;
+
+    return NULL;
+}
+
+// Whether every return of f leaves just the value on the stack
+int exact_returns(Func *f) {
+
+    cfg_build(f);
+
+    int max;
+    int *height = malloc((f->nblock + 1) * sizeof(int));
+    if (!height) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    int r = stack_heights(f, height, &max) == 0;
+
+    for (int b = 0; r && b < f->nblock; ++b) {
+        int h = height[b];
+        if (h < 0)
+            continue;
+
+        for (int i = f->block[b].first; i < f->block[b].end; ++i) {
+            if (f->inst[i].cmd == RETURN && h != 1)
+                r = 0;
+
+            h += stack_effect(&f->inst[i]);
+        }
+    }
+
+    free(height);
+
+    return r;
+}
+
+// How to call name, or NULL for the standard convention. Sets *why when
+// name is defined but can't be fast.
+const Conv *find_conv(const CallConv *cc, const char *name, const char **why) {
+
+    *why = NULL;
+
+    if (!cc || !name)
+        return NULL;
+
+    int id = table_find(cc->names, name);
+    if (id < 0)
+        return NULL;
+
+    *why = cc->fn[id].why;
+
+    return *why ? NULL : &cc->fn[id];
+}
+
+void free_conv(CallConv *cc) {
+    if (cc) {
+        free_table(cc->names);
+        free(cc->fn);
+        free(cc);
+    }
+}
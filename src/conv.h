@@ -0,0 +1,22 @@
+// Pointers a fast function sets, and so saves for its caller
+#define CONV_THIS  1
+#define CONV_THAT  2
+
+// At most this many arguments are passed, in R13 and R14
+#define CONV_ARGS  2
+
+typedef struct Conv {
+    const char *why;    // Why the function isn't fast, NULL if it is
+    int argc;           // Arguments every call passes, -1 if never called
+    int saves;          // CONV_THIS and CONV_THAT
+    int framed;         // Has locals, so sets LCL and saves the caller's
+} Conv;
+
+typedef struct CallConv {
+    struct Table *names;    // Functions defined, first definition first
+    Conv *fn;               // By id in names
+} CallConv;
+
+CallConv *choose_conv(FileList *fl);
+const Conv *find_conv(const CallConv *cc, const char *name, const char **why);
+void free_conv(CallConv *cc);
@@ -0,0 +1,405 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "table.h"
+#include "hack.h"
+
+/**
+ * Hack assembler and emulator.
+ *
+ * Assembles the output of jackvmc (or any Hack assembly) into ROM,
+ * keeping the annotations jackvmc leaves in its comments so tools
+ * can map every ROM address back to a VM function and VM op.
+ *
+ */
+
+static const struct {
+    char *key;
+    int val;
+} comp[] = {
+    // a c1 c2 c3 c4 c5 c6
+    {"0",   052 }, {"1",   077 }, {"-1",  072 },
+    {"D",   014 }, {"A",   060 }, {"M",   0160 },
+    {"!D",  015 }, {"!A",  061 }, {"!M",  0161 },
+    {"-D",  017 }, {"-A",  063 }, {"-M",  0163 },
+    {"D+1", 037 }, {"A+1", 067 }, {"M+1", 0167 },
+    {"D-1", 016 }, {"A-1", 062 }, {"M-1", 0162 },
+    {"D+A", 002 }, {"A+D", 002 }, {"D+M", 0102 }, {"M+D", 0102 },
+    {"D-A", 023 }, {"D-M", 0123 },
+    {"A-D", 007 }, {"M-D", 0107 },
+    {"D&A", 000 }, {"A&D", 000 }, {"D&M", 0100 }, {"M&D", 0100 },
+    {"D|A", 025 }, {"A|D", 025 }, {"D|M", 0125 }, {"M|D", 0125 },
+};
+
+static const struct {
+    char *key;
+    int val;
+} jump[] = {
+    {"JGT", 1 }, {"JEQ", 2 }, {"JGE", 3 }, {"JLT", 4 },
+    {"JNE", 5 }, {"JLE", 6 }, {"JMP", 7 },
+};
+
+static const struct {
+    char *key;
+    int val;
+} predef[] = {
+    {"SP",   0 }, {"LCL",  1 }, {"ARG",  2 }, {"THIS", 3 }, {"THAT", 4 },
+    {"R0",   0 }, {"R1",   1 }, {"R2",   2 }, {"R3",   3 },
+    {"R4",   4 }, {"R5",   5 }, {"R6",   6 }, {"R7",   7 },
+    {"R8",   8 }, {"R9",   9 }, {"R10", 10 }, {"R11", 11 },
+    {"R12", 12 }, {"R13", 13 }, {"R14", 14 }, {"R15", 15 },
+    {"SCREEN", 16384 }, {"KBD", 24576 },
+};
+
+typedef struct Stmt {
+    char *text;
+    int line;
+} Stmt;
+
+static int encode_c(char *s, int line);
+static void annotate(HackRom *rom, char *comment, int *fn, int *op);
+
+
+HackRom *hack_assemble(FILE *fp) {
+
+    HackRom *rom = malloc(sizeof(HackRom));
+
+    rom->size  = 0;
+    rom->code  = NULL;
+    rom->fn    = NULL;
+    rom->op    = NULL;
+    rom->entry = NULL;
+    rom->fns   = new_table();
+    rom->ops   = new_table();
+
+    Table *syms = new_table();
+    int *symval = NULL;
+    int symcap = 0;
+
+    Stmt *stmt = NULL;
+    int nstmt = 0, stmtcap = 0;
+
+    int cur_fn = -1, cur_op = -1;
+    int failure = 0;
+
+    char buf[1024];
+    int line = 0;
+
+    // First pass: strip, collect labels and annotations
+    while (fgets(buf, sizeof(buf), fp)) {
+        ++line;
+
+        char *cmt = strstr(buf, "//");
+        if (cmt)
+            *cmt = '\0';
+
+        // Remove all whitespace
+        int len = 0;
+        for (char *c = buf; *c; ++c)
+            if (!isspace((unsigned char) *c))
+                buf[len++] = *c;
+        buf[len] = '\0';
+
+        if (!len) {
+            if (cmt)
+                annotate(rom, cmt + 2, &cur_fn, &cur_op);
+            continue;
+        }
+
+        if (buf[0] == '(') {
+            char *end = strchr(buf, ')');
+            if (!end) {
+                fprintf(stderr, "Malformed label at line %d\n", line);
+                failure = 1;
+                continue;
+            }
+            *end = '\0';
+
+            int id = table_intern(syms, buf + 1);
+            if (id >= symcap) {
+                symcap = symcap ? symcap * 2 : 256;
+                symval = realloc(symval, symcap * sizeof(int));
+            }
+            symval[id] = nstmt;
+
+            continue;
+        }
+
+        if (nstmt == stmtcap) {
+            stmtcap = stmtcap ? stmtcap * 2 : 1024;
+            stmt = realloc(stmt, stmtcap * sizeof(Stmt));
+
+            rom->fn = realloc(rom->fn, stmtcap * sizeof(int));
+            rom->op = realloc(rom->op, stmtcap * sizeof(int));
+
+            if (!stmt || !rom->fn || !rom->op) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                exit(1);
+            }
+        }
+
+        stmt[nstmt].text = malloc(len + 1);
+        strcpy(stmt[nstmt].text, buf);
+        stmt[nstmt].line = line;
+
+        rom->fn[nstmt] = cur_fn;
+        rom->op[nstmt] = cur_op;
+        ++nstmt;
+    }
+
+    rom->size  = nstmt;
+    rom->code  = malloc((nstmt + 1) * sizeof(unsigned short));
+    rom->entry = malloc((nstmt + 1) * sizeof(int));
+
+    for (int i = 0; i <= nstmt; ++i)
+        rom->entry[i] = -1;
+
+    // Labels naming a function mark its entry point, and so does the
+    // first statement after its BEGIN FN, whatever the labels are called
+    for (int i = 0; i < syms->size; ++i) {
+        int fn = table_find(rom->fns, table_key(syms, i));
+        if (fn >= 0)
+            rom->entry[symval[i]] = fn;
+    }
+
+    for (int i = 0; i < nstmt; ++i)
+        if (rom->fn[i] >= 0 && (i == 0 || rom->fn[i - 1] != rom->fn[i]))
+            rom->entry[i] = rom->fn[i];
+
+    // Second pass: encode, allocating variables from 16
+    int nextvar = 16;
+    for (int i = 0; i < nstmt; ++i) {
+        char *s = stmt[i].text;
+
+        if (s[0] != '@') {
+            rom->code[i] = encode_c(s, stmt[i].line);
+            if (rom->code[i] == 0)
+                failure = 1;
+
+        } else if (isdigit((unsigned char) s[1])) {
+            long n = strtol(s + 1, NULL, 10);
+            if (n > 32767) {
+                fprintf(stderr, "Constant '%s' out of range at line %d\n",
+                        s, stmt[i].line);
+                failure = 1;
+            }
+            rom->code[i] = n & 0x7FFF;
+
+        } else {
+            int val = -1;
+
+            int s_len = sizeof(predef) / sizeof(predef[0]);
+            for (int j = 0; j < s_len; ++j) {
+                if (strcmp(s + 1, predef[j].key) == 0) {
+                    val = predef[j].val;
+                    break;
+                }
+            }
+
+            if (val < 0) {
+                int id = table_find(syms, s + 1);
+                if (id < 0) {
+                    id = table_intern(syms, s + 1);
+                    if (id >= symcap) {
+                        symcap = symcap ? symcap * 2 : 256;
+                        symval = realloc(symval, symcap * sizeof(int));
+                    }
+                    symval[id] = nextvar++;
+                }
+                val = symval[id];
+            }
+
+            rom->code[i] = val & 0x7FFF;
+        }
+
+        free(s);
+    }
+
+    free(stmt);
+    free(symval);
+    free_table(syms);
+
+    if (failure) {
+        fprintf(stderr, "Failed to assemble\n");
+        exit(1);
+    }
+
+    return rom;
+}
+
+void free_hack_rom(HackRom *rom) {
+    if (rom) {
+        free(rom->code);
+        free(rom->fn);
+        free(rom->op);
+        free(rom->entry);
+        free_table(rom->fns);
+        free_table(rom->ops);
+        free(rom);
+    }
+}
+
+HackCpu *new_hack_cpu() {
+    HackCpu *r = malloc(sizeof(HackCpu));
+
+    r->A = 0;
+    r->D = 0;
+    r->pc = 0;
+    r->ram = calloc(HACK_RAM_SIZE, sizeof(unsigned short));
+    r->cycles = 0;
+
+    if (!r->ram) {
+        fprintf(stderr, "Failed to allocate RAM\n");
+        exit(1);
+    }
+
+    return r;
+}
+
+void free_hack_cpu(HackCpu *cpu) {
+    if (cpu) {
+        free(cpu->ram);
+        free(cpu);
+    }
+}
+
+HackStep hack_step(HackCpu *cpu, HackRom *rom) {
+
+    if (cpu->pc < 0 || cpu->pc >= rom->size)
+        return HACK_HALT;
+
+    int ins = rom->code[cpu->pc];
+    ++cpu->cycles;
+
+    // A instruction
+    if (!(ins & 0x8000)) {
+        cpu->A = ins;
+        ++cpu->pc;
+        return HACK_NEXT;
+    }
+
+    int addr = cpu->A & 0x7FFF;
+    int x = cpu->D;
+    int y = (ins & 0x1000) ? cpu->ram[addr] : cpu->A;
+
+    // ALU control bits
+    if (ins & 0x0800) x = 0;
+    if (ins & 0x0400) x = ~x;
+    if (ins & 0x0200) y = 0;
+    if (ins & 0x0100) y = ~y;
+    int out = (ins & 0x0080) ? x + y : x & y;
+    if (ins & 0x0040) out = ~out;
+    out &= 0xFFFF;
+
+    if (ins & 0x0008) cpu->ram[addr] = out;
+    if (ins & 0x0020) cpu->A = out;
+    if (ins & 0x0010) cpu->D = out;
+
+    int sout = (out ^ 0x8000) - 0x8000;
+    int j = ins & 07;
+    int taken = ((j & 4) && sout < 0)
+             || ((j & 2) && sout == 0)
+             || ((j & 1) && sout > 0);
+
+    if (!taken) {
+        ++cpu->pc;
+        return HACK_NEXT;
+    }
+
+    // Jumping back onto our own @LABEL is the usual end-of-program loop
+    int always = j == 7 || (ins & 0x1FC0) == (052 << 6);
+    if (always && addr == cpu->pc - 1 && rom->code[addr] == addr)
+        return HACK_HALT;
+
+    cpu->pc = addr;
+    return HACK_JUMP;
+}
+
+
+int encode_c(char *s, int line) {
+
+    int dest = 0, jmp = 0, c = -1;
+
+    char *eq = strchr(s, '=');
+    if (eq) {
+        for (char *d = s; d < eq; ++d) {
+            switch (*d) {
+                case 'A': dest |= 4; break;
+                case 'D': dest |= 2; break;
+                case 'M': dest |= 1; break;
+                default:
+                    fprintf(stderr, "Invalid destination '%s' at line %d\n",
+                            s, line);
+                    return 0;
+            }
+        }
+        s = eq + 1;
+    }
+
+    char *semi = strchr(s, ';');
+    if (semi) {
+        *semi = '\0';
+
+        int s_len = sizeof(jump) / sizeof(jump[0]);
+        for (int j = 0; j < s_len; ++j)
+            if (strcmp(semi + 1, jump[j].key) == 0)
+                jmp = jump[j].val;
+
+        if (!jmp) {
+            fprintf(stderr, "Invalid jump '%s' at line %d\n", semi + 1, line);
+            return 0;
+        }
+    }
+
+    int s_len = sizeof(comp) / sizeof(comp[0]);
+    for (int j = 0; j < s_len; ++j) {
+        if (strcmp(s, comp[j].key) == 0) {
+            c = comp[j].val;
+            break;
+        }
+    }
+
+    if (c < 0) {
+        fprintf(stderr, "Invalid computation '%s' at line %d\n", s, line);
+        return 0;
+    }
+
+    return 0xE000 | (c << 6) | (dest << 3) | jmp;
+}
+
+void annotate(HackRom *rom, char *comment, int *fn, int *op) {
+
+    while (isspace((unsigned char) *comment))
+        ++comment;
+
+    // Trim trailing whitespace
+    char *end = comment + strlen(comment);
+    while (end > comment && isspace((unsigned char) end[-1]))
+        *(--end) = '\0';
+
+    if (strncmp(comment, "==== BEGIN FN $", 15) == 0) {
+        char *name = comment + 15;
+        char *sp = strchr(name, ' ');
+        if (sp)
+            *sp = '\0';
+
+        *fn = table_intern(rom->fns, name);
+        *op = table_intern(rom->ops, "FUNCTION");
+
+    } else if (strcmp(comment, "PREAMBLE BEGIN") == 0) {
+        *fn = -1;
+        *op = table_intern(rom->ops, "PREAMBLE");
+
+    } else if (strncmp(comment, "====", 4) != 0
+            && strcmp(comment, "PREAMBLE END") != 0) {
+
+        // "CALL $Foo.bar" profiles as CALL
+        char *name = strstr(comment, " $");
+        if (name)
+            *name = '\0';
+
+        *op = table_intern(rom->ops, comment);
+    }
+}
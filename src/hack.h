@@ -0,0 +1,31 @@
+#define HACK_RAM_SIZE 32768
+
+typedef struct HackRom {
+    int size;
+    unsigned short *code;
+    int *fn;     // Function the address was emitted for, -1 if none
+    int *op;     // VM op tag from jackvmc's comments, -1 if none
+    int *entry;  // Function id if a function label points here, else -1
+    Table *fns;
+    Table *ops;
+} HackRom;
+
+typedef struct HackCpu {
+    int A;
+    int D;
+    int pc;
+    unsigned short *ram;
+    unsigned long long cycles;
+} HackCpu;
+
+typedef enum {
+    HACK_NEXT,
+    HACK_JUMP,
+    HACK_HALT,
+} HackStep;
+
+HackRom *hack_assemble(FILE *fp);
+void free_hack_rom(HackRom *rom);
+HackCpu *new_hack_cpu();
+void free_hack_cpu(HackCpu *cpu);
+HackStep hack_step(HackCpu *cpu, HackRom *rom);
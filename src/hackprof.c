@@ -0,0 +1,438 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "table.h"
+#include "hack.h"
+
+/**
+ * Function-level cycle profiler.
+ *
+ * Runs a jackvmc program on the Hack emulator and attributes every
+ * executed instruction to the VM call stack it ran under. The stack is
+ * tracked by watching for jackvmc's call sequence jumping into a
+ * function, at its label or past it as --self-calls does, and its
+ * return sequence jumping back out.
+ *
+ * With -m it instead decodes the counters of an `--instrument` build
+ * from a RAM dump into a profile jackvmc can read with `--profile`.
+ * RAM dumps hold one word per line, either `addr value` pairs or bare
+ * values in address order starting from 0; -d writes the former.
+ *
+ */
+
+typedef struct Frames {
+    int size;
+    int cap;
+    int *fn;
+    int *parent;
+    int *child;
+    int *sibling;
+    int *recursive;  // Some ancestor is the same function
+    unsigned long long *count;
+} Frames;
+
+static int push_frame(Frames *fr, int node, int fn);
+static void read_dump(FILE *fp, unsigned short *ram);
+static void write_dump(FILE *fp, unsigned short *ram);
+static void decode(FILE *fp, char *map, unsigned short *ram);
+static void write_folded(FILE *fp, Frames *fr, HackRom *rom);
+static void write_flat(FILE *fp, Frames *fr, HackRom *rom,
+                       unsigned long long *hits, unsigned long long cycles);
+
+static unsigned long long *sort_key;
+static int by_key(const void *a, const void *b);
+
+
+int main(int argc, char **argv) {
+
+    char *fname = NULL;
+    char *folded = NULL;
+    char *dump = NULL;
+    char *map = NULL;
+    unsigned long long max_cycles = 100000000ULL;
+
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            char opt = argv[i][1];
+            char *val;
+
+            switch (opt) {
+                case 'd':
+                case 'f':
+                case 'm':
+                case 'n':
+                    if (argv[i][2] != '\0')
+                        val = &argv[i][2];
+                    else if (i + 1 < argc)
+                        val = argv[++i];
+                    else {
+                        fprintf(stderr,
+                                "Error: -%c option requires a value\n", opt);
+                        exit(1);
+                    }
+
+                    if (opt == 'd')
+                        dump = val;
+                    else if (opt == 'f')
+                        folded = val;
+                    else if (opt == 'm')
+                        map = val;
+                    else
+                        max_cycles = strtoull(val, NULL, 10);
+                    break;
+
+                case 'h':
+                    printf(
+                        "%s [OPTIONS] FILE.asm\n"
+                        "%s -m MAP RAMDUMP\n"
+                        "\n"
+                        "Options:\n"
+                        "   -h  Print this help.\n"
+                        "   -d  Write a RAM dump to file after the run.\n"
+                        "   -f  Write folded stacks for flamegraphs to file.\n"
+                        "   -m  Decode counters of an instrumented build from a RAM\n"
+                        "       dump using the counter map written by jackvmc.\n"
+                        "   -n  Maximum number of cycles to run. Default 100000000.\n"
+
+                        , argv[0], argv[0]
+                    );
+
+                    exit(1);
+                    break;
+
+                default:
+                    fprintf(stderr,
+                            "Invalid option %s, ignoring\n", argv[i]);
+                    break;
+            }
+        } else {
+            fname = argv[i];
+        }
+    }
+
+    if (!fname) {
+        fprintf(stderr,
+                "No input file given\n");
+        exit(1);
+    }
+
+    FILE *fi = fopen(fname, "r");
+    if (!fi) {
+        fprintf(stderr, "Failed to load file '%s'\n", fname);
+        exit(1);
+    }
+
+    if (map) {
+        unsigned short *ram = calloc(HACK_RAM_SIZE, sizeof(unsigned short));
+
+        read_dump(fi, ram);
+        fclose(fi);
+
+        decode(stdout, map, ram);
+        free(ram);
+
+        return 0;
+    }
+
+    HackRom *rom = hack_assemble(fi);
+    fclose(fi);
+
+    HackCpu *cpu = new_hack_cpu();
+
+    int op_call = table_find(rom->ops, "CALL");
+    int op_ret  = table_find(rom->ops, "RETURN");
+    int op_pre  = table_find(rom->ops, "PREAMBLE");
+
+    Frames fr = { 0 };
+    int node = push_frame(&fr, -1, -1);
+
+    unsigned long long *hits = calloc(rom->size + 1, sizeof(unsigned long long));
+
+    while (cpu->cycles < max_cycles) {
+        int pc = cpu->pc;
+        HackStep st = hack_step(cpu, rom);
+
+        if (pc < 0 || pc >= rom->size)
+            break;
+
+        ++fr.count[node];
+        ++hits[pc];
+
+        if (st == HACK_HALT)
+            break;
+
+        if (st == HACK_JUMP) {
+            int op = rom->op[pc];
+            int callee = rom->entry[cpu->pc];
+
+            // A call jumps nowhere but into its callee
+            if (callee < 0 && op == op_call && cpu->pc >= 0 && cpu->pc < rom->size)
+                callee = rom->fn[cpu->pc];
+
+            if (callee >= 0 && (op == op_call || op == op_pre))
+                node = push_frame(&fr, node, callee);
+            else if (op == op_ret && fr.parent[node] >= 0)
+                node = fr.parent[node];
+        }
+    }
+
+    if (cpu->cycles >= max_cycles)
+        fprintf(stderr, "Stopped after %llu cycles\n", cpu->cycles);
+
+    if (folded) {
+        FILE *fo = fopen(folded, "w");
+        if (!fo) {
+            fprintf(stderr, "Failed to open file '%s' for writing\n", folded);
+            exit(1);
+        }
+
+        write_folded(fo, &fr, rom);
+        fclose(fo);
+    }
+
+    if (dump) {
+        FILE *fo = fopen(dump, "w");
+        if (!fo) {
+            fprintf(stderr, "Failed to open file '%s' for writing\n", dump);
+            exit(1);
+        }
+
+        write_dump(fo, cpu->ram);
+        fclose(fo);
+    }
+
+    write_flat(stdout, &fr, rom, hits, cpu->cycles);
+
+    free(hits);
+    free(fr.fn);
+    free(fr.parent);
+    free(fr.child);
+    free(fr.sibling);
+    free(fr.recursive);
+    free(fr.count);
+    free_hack_cpu(cpu);
+    free_hack_rom(rom);
+
+    return 0;
+}
+
+
+int push_frame(Frames *fr, int node, int fn) {
+
+    // Reuse the child if this call path was seen before
+    if (node >= 0)
+        for (int c = fr->child[node]; c >= 0; c = fr->sibling[c])
+            if (fr->fn[c] == fn)
+                return c;
+
+    if (fr->size == fr->cap) {
+        fr->cap = fr->cap ? fr->cap * 2 : 256;
+
+        fr->fn        = realloc(fr->fn,        fr->cap * sizeof(int));
+        fr->parent    = realloc(fr->parent,    fr->cap * sizeof(int));
+        fr->child     = realloc(fr->child,     fr->cap * sizeof(int));
+        fr->sibling   = realloc(fr->sibling,   fr->cap * sizeof(int));
+        fr->recursive = realloc(fr->recursive, fr->cap * sizeof(int));
+        fr->count     = realloc(fr->count,     fr->cap * sizeof(unsigned long long));
+
+        if (!fr->fn || !fr->parent || !fr->child || !fr->sibling
+                || !fr->recursive || !fr->count) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+    }
+
+    int r = fr->size++;
+
+    fr->fn[r]        = fn;
+    fr->parent[r]    = node;
+    fr->child[r]     = -1;
+    fr->sibling[r]   = node >= 0 ? fr->child[node] : -1;
+    fr->recursive[r] = 0;
+    fr->count[r]     = 0;
+
+    if (node >= 0)
+        fr->child[node] = r;
+
+    for (int a = node; a >= 0; a = fr->parent[a])
+        if (fr->fn[a] == fn)
+            fr->recursive[r] = 1;
+
+    return r;
+}
+
+void read_dump(FILE *fp, unsigned short *ram) {
+
+    char buf[256];
+    long addr = 0;
+
+    while (fgets(buf, sizeof(buf), fp)) {
+        char *end;
+        long a = strtol(buf, &end, 10);
+
+        if (end == buf)
+            continue;
+
+        // Either "addr value", "addr: value" or a bare value
+        char *rest = end;
+        if (*rest == ':')
+            ++rest;
+
+        long v = strtol(rest, &end, 10);
+        if (end == rest)
+            v = a;
+        else
+            addr = a;
+
+        if (addr < 0 || addr >= HACK_RAM_SIZE) {
+            fprintf(stderr, "RAM address %ld out of range\n", addr);
+            exit(1);
+        }
+
+        ram[addr++] = v & 0xFFFF;
+    }
+}
+
+void write_dump(FILE *fp, unsigned short *ram) {
+    for (int i = 0; i < HACK_RAM_SIZE; ++i)
+        if (ram[i])
+            fprintf(fp, "%d %d\n", i, (ram[i] ^ 0x8000) - 0x8000);
+}
+
+void decode(FILE *fp, char *map, unsigned short *ram) {
+
+    FILE *fm = fopen(map, "r");
+    if (!fm) {
+        fprintf(stderr, "Failed to load counter map '%s'\n", map);
+        exit(1);
+    }
+
+    char buf[1024];
+    int base = -1;
+
+    while (fgets(buf, sizeof(buf), fm)) {
+        buf[strcspn(buf, "\n")] = '\0';
+
+        if (strncmp(buf, "base ", 5) == 0) {
+            base = atoi(buf + 5);
+            continue;
+        }
+
+        char *key;
+        int id = strtol(buf, &key, 10);
+        if (key == buf || base < 0)
+            continue;
+
+        int addr = base + 2 * id;
+        if (addr < 0 || addr + 1 >= HACK_RAM_SIZE) {
+            fprintf(stderr, "Counter %d out of RAM\n", id);
+            exit(1);
+        }
+
+        unsigned long count = ram[addr] | ((unsigned long) ram[addr + 1] << 16);
+        fprintf(fp, "%s %lu\n", key + 1, count);
+    }
+
+    fclose(fm);
+}
+
+void write_folded(FILE *fp, Frames *fr, HackRom *rom) {
+
+    int *path = malloc(fr->size * sizeof(int));
+
+    for (int i = 0; i < fr->size; ++i) {
+        if (!fr->count[i])
+            continue;
+
+        if (i == 0) {
+            fprintf(fp, "(preamble) %llu\n", fr->count[i]);
+            continue;
+        }
+
+        int depth = 0;
+        for (int a = i; a > 0; a = fr->parent[a])
+            path[depth++] = fr->fn[a];
+
+        while (depth--)
+            fprintf(fp, "%s%c", table_key(rom->fns, path[depth]),
+                    depth ? ';' : ' ');
+        fprintf(fp, "%llu\n", fr->count[i]);
+    }
+
+    free(path);
+}
+
+void write_flat(FILE *fp, Frames *fr, HackRom *rom,
+                unsigned long long *hits, unsigned long long cycles) {
+
+    int nfn = rom->fns->size;
+    int nop = rom->ops->size;
+
+    unsigned long long *self  = calloc(nfn + 1, sizeof(unsigned long long));
+    unsigned long long *total = calloc(nfn + 1, sizeof(unsigned long long));
+    unsigned long long *sub   = calloc(fr->size, sizeof(unsigned long long));
+    unsigned long long *ops   = calloc(nop + 1, sizeof(unsigned long long));
+    int *order = malloc((nfn + nop + 1) * sizeof(int));
+
+    // Children are always created after their parent
+    for (int i = fr->size - 1; i >= 0; --i) {
+        sub[i] += fr->count[i];
+        if (fr->parent[i] >= 0)
+            sub[fr->parent[i]] += sub[i];
+    }
+
+    for (int i = 1; i < fr->size; ++i) {
+        self[fr->fn[i]] += fr->count[i];
+        if (!fr->recursive[i])
+            total[fr->fn[i]] += sub[i];
+    }
+
+    for (int i = 0; i < rom->size; ++i)
+        if (rom->op[i] >= 0)
+            ops[rom->op[i]] += hits[i];
+
+    double pct = cycles ? 100.0 / cycles : 0;
+
+    fprintf(fp, "Flat profile by function (%llu cycles)\n\n", cycles);
+    fprintf(fp, "%8s %12s %12s  %s\n", "self%", "self", "total", "function");
+
+    for (int i = 0; i < nfn; ++i)
+        order[i] = i;
+    sort_key = self;
+    qsort(order, nfn, sizeof(int), by_key);
+
+    fprintf(fp, "%7.2f%% %12llu %12llu  %s\n",
+            fr->count[0] * pct, fr->count[0], cycles, "(preamble)");
+    for (int i = 0; i < nfn; ++i)
+        fprintf(fp, "%7.2f%% %12llu %12llu  %s\n",
+                self[order[i]] * pct, self[order[i]], total[order[i]],
+                table_key(rom->fns, order[i]));
+
+    fprintf(fp, "\nFlat profile by VM op\n\n");
+    fprintf(fp, "%8s %12s  %s\n", "cycles%", "cycles", "op");
+
+    for (int i = 0; i < nop; ++i)
+        order[i] = i;
+    sort_key = ops;
+    qsort(order, nop, sizeof(int), by_key);
+
+    for (int i = 0; i < nop; ++i)
+        if (ops[order[i]])
+            fprintf(fp, "%7.2f%% %12llu  %s\n",
+                    ops[order[i]] * pct, ops[order[i]],
+                    table_key(rom->ops, order[i]));
+
+    free(self);
+    free(total);
+    free(sub);
+    free(ops);
+    free(order);
+}
+
+int by_key(const void *a, const void *b) {
+    unsigned long long x = sort_key[*(const int*) a];
+    unsigned long long y = sort_key[*(const int*) b];
+
+    return (x < y) - (x > y);
+}
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lex.h"
+#include "prog.h"
+#include "table.h"
+#include "prof.h"
+#include "write.h"
+#include "arena.h"
+#include "jackvmc.h"
+
+/**
+ * Library entry points.
+ *
+ * Tokens go into the context's arena and names into its table, so a
+ * translation frees nothing token by token and later ones reuse the
+ * memory. Errors in the input are reported on stderr as for the
+ * command line and fail the translation; running out of memory still
+ * exits.
+ *
+ */
+
+struct Jackvmc {
+    WriteOptions opt;
+    LexStore store;
+    FileList *files;    // One per source, linked in order
+    int capfiles;
+};
+
+
+Jackvmc *jackvmc_new(void) {
+
+    Jackvmc *r = malloc(sizeof(Jackvmc));
+    if (!r) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    WriteOptions opt = { NULL, NULL, NULL, 1 };
+
+    r->opt = opt;
+    r->store.arena = new_arena();
+    r->store.names = new_table();
+    r->files = NULL;
+    r->capfiles = 0;
+
+    return r;
+}
+
+void jackvmc_free(Jackvmc *ctx) {
+    if (ctx) {
+        free_arena(ctx->store.arena);
+        free_table(ctx->store.names);
+        free(ctx->files);
+        free(ctx);
+    }
+}
+
+// Threads translating functions, 1 by default
+void jackvmc_set_jobs(Jackvmc *ctx, int jobs) {
+    ctx->opt.jobs = jobs < 1 ? 1 : jobs;
+}
+
+// Translate n sources, as if given in that order on the command line,
+// and pass the result to sink. Returns 0 on success, -1 on failure.
+int jackvmc_translate(Jackvmc *ctx, const JackvmcSource *src, int n,
+                      JackvmcSink sink, void *user) {
+
+    if (n < 1)
+        return -1;
+
+    if (n > ctx->capfiles) {
+        ctx->files = realloc(ctx->files, n * sizeof(FileList));
+        ctx->capfiles = n;
+
+        if (!ctx->files) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+    }
+
+    arena_reset(ctx->store.arena);
+
+    int failed = 0;
+
+    for (int i = 0; i < n; ++i) {
+        FileList *f = &ctx->files[i];
+
+        f->name = vm_name(src[i].name);
+        f->tl = NULL;
+        f->next = (i + 1 < n) ? &ctx->files[i + 1] : NULL;
+
+        if (!f->name) {
+            fprintf(stderr,
+                    "Invalid filename '%s' provided. Extension must be .vm\n",
+                    src[i].name);
+            failed = 1;
+            continue;
+        }
+
+        // fmemopen() rejects empty buffers
+        if (!src[i].len)
+            continue;
+
+        FILE *fp = fmemopen((void*) src[i].data, src[i].len, "r");
+        if (!fp) {
+            fprintf(stderr, "Failed to load file '%s'\n", src[i].name);
+            failed = 1;
+            continue;
+        }
+
+        int failure = 0;
+        int lineno = 1;
+        TokenList *inst, *last = NULL;
+
+        while ((inst = scan_next(fp, &lineno, &failure, &ctx->store))) {
+            if (last)
+                last->next = inst;
+            else
+                f->tl = inst;
+
+            last = inst;
+        }
+
+        fclose(fp);
+        failed |= failure;
+    }
+
+    if (!failed) {
+        char *out;
+        size_t len;
+
+        FILE *fp = open_memstream(&out, &len);
+        if (!fp) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+
+        write_file_list(fp, ctx->files, &ctx->opt);
+        fclose(fp);
+
+        failed = sink(user, out, len) != 0;
+        free(out);
+    }
+
+    for (int i = 0; i < n; ++i)
+        free(ctx->files[i].name);
+
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,32 @@
+#ifndef JACKVMC_H
+#define JACKVMC_H
+
+#include <stddef.h>
+
+/**
+ * libjackvmc: translate Jack VM code to Hack assembly in memory.
+ *
+ * A context keeps its allocations between calls, so reuse one for
+ * repeated translations. Contexts are independent: any number may be
+ * used at once from different threads, but each by one thread at a time.
+ *
+ */
+
+typedef struct Jackvmc Jackvmc;
+
+typedef struct JackvmcSource {
+    const char *name;   // File name ending in .vm, names its statics
+    const char *data;   // VM code, need not be NUL terminated
+    size_t len;
+} JackvmcSource;
+
+// Receives the translated assembly. Nonzero fails the translation.
+typedef int (*JackvmcSink)(void *user, const char *data, size_t len);
+
+Jackvmc *jackvmc_new(void);
+void jackvmc_free(Jackvmc *ctx);
+void jackvmc_set_jobs(Jackvmc *ctx, int jobs);
+int jackvmc_translate(Jackvmc *ctx, const JackvmcSource *src, int n,
+                      JackvmcSink sink, void *user);
+
+#endif
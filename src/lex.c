@@ -5,6 +5,8 @@
 #include <string.h>
 
 #include "lex.h"
+#include "table.h"
+#include "arena.h"
 
 /**
  * Conversion tables.
@@ -66,6 +68,19 @@ static const struct {
     {"not", NOT },
 };
 
+// Back from enum to VM names, for comments, remarks and reports
+const char *op_name[] = {
+    [ADD] = "add", [SUB] = "sub", [NEG] = "neg",
+    [EQ]  = "eq",  [GT]  = "gt",  [LT]  = "lt",
+    [AND] = "and", [OR]  = "or",  [NOT] = "not",
+};
+
+const char *mem_name[] = {
+    [ARGUMENT] = "argument", [LOCAL] = "local",   [STATIC] = "static",
+    [CONSTANT] = "constant", [THIS]  = "this",    [THAT]   = "that",
+    [POINTER]  = "pointer",  [TEMP]  = "temp",
+};
+
 static const struct CommandFormat {
     int nargs;
     CmdArgType arg[3];
@@ -83,8 +98,10 @@ static const struct CommandFormat {
 };
 
 
-static char *nextline(FILE*);
+static char *nextline(FILE*, int*);
+static char *readline(FILE*, int*);
 static CommandType cmdtype(char*);
+static void *lex_alloc(LexStore *st, size_t size);
 
 
 TokenList *new_token_list() {
@@ -98,6 +115,7 @@ TokenList *new_token_list() {
     r->cmd = NONE;
     r->argc = 0;
     r->argv = NULL;
+    r->line = 0;
     r->next = NULL;
 
     return r;
@@ -106,14 +124,16 @@ TokenList *new_token_list() {
 void free_token_list(TokenList *tl) {
     TokenList *n;
 
-    if (tl) {
+    for (; tl; tl = n) {
         n = tl->next;
 
+        // Names are the only argument that is allocated, always first
+        const struct CommandFormat *fmt = &cmd_fmt[tl->cmd];
+        if (fmt->nargs > 1 && fmt->arg[1] == ARG_NAME)
+            free(tl->argv[0].name);
+
         free(tl->argv);
         free(tl);
-
-        if (n)
-            free_token_list(n);
     }
 }
 
@@ -123,6 +143,34 @@ TokenList *scan_stream(FILE *fp) {
     TokenList *curr = NULL;
     TokenList *prev = NULL;
 
+    int failure = 0;
+    int lineno = 1;
+
+    while ((curr = scan_next(fp, &lineno, &failure, NULL))) {
+        if (prev)
+            prev->next = curr;
+        else
+            r = curr;
+
+        prev = curr;
+    }
+
+    if (failure) {
+        fprintf(stderr,
+                "Failed to compile\n");
+        exit(1);
+    }
+
+    return r;
+}
+
+// Lex lines until one yields a token, NULL at the end of the stream.
+// Errors are reported and set *failure, after which no more tokens are
+// returned but lexing goes on to report the rest.
+TokenList *scan_next(FILE *fp, int *lineno, int *failure, LexStore *st) {
+
+    TokenList *curr = NULL;
+
     CommandType cmdt;
     struct CommandFormat fmt;
 
@@ -130,16 +178,16 @@ TokenList *scan_stream(FILE *fp) {
     CmdArg *argv = NULL;
 
     char *tokdelim = " \t";
-    int failure = 0;
 
-    char *line, *cmd, *nword;
-    while ((line = nextline(fp))) {
+    char *line, *cmd, *nword, *save;
+    while ((line = nextline(fp, lineno))) {
 
-        cmd = strtok(line, tokdelim); // FIXME?: null return
+        cmd = strtok_r(line, tokdelim, &save); // FIXME?: null return
         cmdt = cmdtype(cmd);
 
         if (cmdt == NONE) {
             fprintf(stderr, "Unknown command '%s'\n", cmd);
+            free(line);
             continue;
         }
 
@@ -149,14 +197,14 @@ TokenList *scan_stream(FILE *fp) {
         if (fmt.arg[0] == ARG_NONE) {
 
             argn = 0;
-            argc = fmt.nargs - 1;
-            argv = malloc(argc * sizeof(CmdArg));
+            argc = fmt.nargs ? fmt.nargs - 1 : 0;
+            argv = argc ? lex_alloc(st, argc * sizeof(CmdArg)) : NULL;
 
         } else {
 
             argn = 1;
             argc = fmt.nargs;
-            argv = malloc(argc * sizeof(CmdArg));
+            argv = lex_alloc(st, argc * sizeof(CmdArg));
 
             switch (fmt.arg[0]) {
                 int s, j;
@@ -180,12 +228,12 @@ TokenList *scan_stream(FILE *fp) {
         }
 
         for (int i = 1; i < fmt.nargs; ++i, ++argn) {
-            nword = strtok(NULL, tokdelim);
+            nword = strtok_r(NULL, tokdelim, &save);
 
             if (!nword) {
                 fprintf(stderr,
                         "Missing token at line '%s'\n", line);
-                failure = 1;
+                *failure = 1;
                 continue;
             }
 
@@ -210,22 +258,23 @@ TokenList *scan_stream(FILE *fp) {
 
                     if (cmdt == POP && argv[argn].mem == CONSTANT) {
                         fprintf(stderr, "Cannot call POP on constant segment\n");
-                        failure = 1;
+                        *failure = 1;
                     }
 
                     // If no matching memory segment is found
                     if (!found) {
                         fprintf(stderr, "Invalid memory segment '%s'\n", nword);
-                        failure = 1;
+                        *failure = 1;
                     }
 
                     break;
 
                 case ARG_NUM:
+                    errno = 0;
                     num = strtoll(nword, &end, 10);
                     if (errno == ERANGE || end == nword) {
                         fprintf(stderr, "Failed to read number '%s' in line '%s'", nword, line);
-                        failure = 1;
+                        *failure = 1;
                     }
 
                     // If command type is POP or PUSH,
@@ -249,14 +298,19 @@ TokenList *scan_stream(FILE *fp) {
                         }
                     }
 
-                    failure |= num_is_invalid; // if (num_is_invalid) failure = true;
+                    *failure |= num_is_invalid; // if (num_is_invalid) failure = true;
 
                     argv[argn].num = (int) num;
                     break;
 
                 case ARG_NAME:
-                    name = malloc(strlen(nword) * sizeof(char));
-                    strcpy(name, nword);
+                    if (st) {
+                        name = (char*) table_key(st->names,
+                                                 table_intern(st->names, nword));
+                    } else {
+                        name = malloc((strlen(nword) + 1) * sizeof(char));
+                        strcpy(name, nword);
+                    }
 
                     argv[argn].name = name;
                     break;
@@ -267,35 +321,45 @@ TokenList *scan_stream(FILE *fp) {
             }
         }
 
-        if (!failure) {
-            curr = new_token_list();
+        free(line);
+
+        if (!*failure) {
+            if (st) {
+                curr = lex_alloc(st, sizeof(TokenList));
+                curr->next = NULL;
+            } else {
+                curr = new_token_list();
+            }
+
             curr->cmd  = cmdt;
             curr->argc = argc;
             curr->argv = argv;
+            curr->line = *lineno;
 
-            if (prev)
-                prev->next = curr;
+            return curr;
+        }
+    }
 
-            prev = curr;
+    return NULL;
+}
 
-            if (!r)
-                r = prev;
-        }
 
-        free(line);
-    }
+// Line numbers are tracked in *line; the newline ending a line is left
+// in the stream so the next call counts it.
+char *nextline(FILE *fp, int *line) {
 
-    if (failure) {
-        fprintf(stderr,
-                "Failed to compile\n");
-        exit(1);
-    }
+    char *r;
+
+    // Blank and comment lines yield nothing, go on to the next one
+    while (!(r = readline(fp, line)))
+        if (feof(fp))
+            return NULL;
 
     return r;
 }
 
-
-char *nextline(FILE *fp) {
+// One line without its comment, NULL if that leaves nothing
+char *readline(FILE *fp, int *line) {
 
     // Return value and size
     int rs = 0;
@@ -312,13 +376,16 @@ char *nextline(FILE *fp) {
 
     // Remove leading whitespace
     while (isspace(c = fgetc(fp)))
-        ; /* NOP */
+        if (c == '\n')
+            ++(*line);
     ungetc(c, fp);
 
     while ((c = fgetc(fp)) != EOF) {
 
-        if (c == '\n')
+        if (c == '\n') {
+            ungetc(c, fp);
             break;
+        }
 
         // Check for comments
         if (c == '/') {
@@ -326,9 +393,12 @@ char *nextline(FILE *fp) {
             int n;
             if ((n = fgetc(fp)) == '/') {
 
-                while(fgetc(fp) != '\n')
+                while ((c = fgetc(fp)) != '\n' && c != EOF)
                     ; /* NOP */
 
+                if (c == '\n')
+                    ungetc(c, fp);
+
                 break;
 
             } else {
@@ -359,12 +429,9 @@ char *nextline(FILE *fp) {
     if (r) {
         r[i] = '\0';
         r = realloc(r, i + 1);
-
-        return r;
-
-    } else {
-        return nextline(fp);
     }
+
+    return r;
 }
 
 
@@ -381,3 +448,16 @@ CommandType cmdtype(char* cmd) {
 
     return r;
 }
+
+void *lex_alloc(LexStore *st, size_t size) {
+    if (st)
+        return arena_alloc(st->arena, size);
+
+    void *r = malloc(size);
+    if (!r) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    return r;
+}
@@ -53,10 +53,22 @@ typedef struct TokenList {
     CommandType cmd;
     int argc;
     CmdArg *argv;
+    int line;
     struct TokenList *next;
 } TokenList;
 
 
+// Where lexed tokens live. Without one every token is malloc'd, to be
+// freed with free_token_list().
+typedef struct LexStore {
+    struct Arena *arena;    // Tokens and their arguments
+    struct Table *names;    // Interned label and function names
+} LexStore;
+
+extern const char *op_name[];
+extern const char *mem_name[];
+
 TokenList *new_token_list();
 void free_token_list(TokenList *tl);
 TokenList *scan_stream(FILE *fp);
+TokenList *scan_next(FILE *fp, int *lineno, int *failure, LexStore *st);
@@ -0,0 +1,408 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lex.h"
+#include "prog.h"
+#include "table.h"
+#include "cfg.h"
+#include "live.h"
+
+/**
+ * Dead stores and unreachable code.
+ *
+ * Blocks of a function that no path from its entry reaches are dropped,
+ * along with their labels, which only jumps in those blocks can name.
+ *
+ * The rest are scanned backwards for which locals, arguments and temp
+ * words are read again before being written. A pop to one that isn't
+ * only moves SP. When the instruction before it is a push, the two
+ * cancel out and are dropped, so the push no longer reads its slot, and
+ * the scan is repeated until no more pops die.
+ *
+ * Locals and arguments are gone once the function returns. temp is
+ * shared, so is live at every call and return, as is everything where
+ * control leaves the function some other way.
+ *
+ */
+
+// Slots followed, others are always live
+#define LIVE_SLOTS  64
+#define LIVE_TEMPS  8
+
+typedef struct Live {
+    unsigned long long local;
+    unsigned long long arg;
+    unsigned temp;
+} Live;
+
+static const Live all = { ~0ULL, ~0ULL, (1U << LIVE_TEMPS) - 1 };
+
+static void plan_func(Dead *d, TokenList **in, int n, char *fname, int *cap);
+static char *reached(Func *f);
+static void solve(Func *f, Live *live, const char *reach, char *removed);
+static Live live_out(Func *f, int b, const Live *in, const char *reach);
+static Live scan(Func *f, int b, Live live, char *removed, char *dead, int *ndead);
+static int slot_bit(const TokenList *inst, Live *live, int set);
+static int same(const Live *x, const Live *y);
+static void add(Dead *d, int *cap, const TokenList *inst, TokenList *last, int n);
+static int by_inst(const void *x, const void *y);
+static const DeadInst *find(const Dead *d, const TokenList *inst);
+
+
+Dead *plan_dead(FileList *fl) {
+
+    Dead *d = malloc(sizeof(Dead));
+    if (!d) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    d->at = NULL;
+    d->n = 0;
+
+    int cap = 0;
+    TokenList **in = NULL;
+    int incap = 0;
+
+    for (FileList *it = fl; it; it = it->next) {
+        TokenList *inst = it->tl;
+
+        // Code before the first function is entered however the file
+        // before it ends
+        while (inst && inst->cmd != FUNCTION)
+            inst = inst->next;
+
+        while (inst) {
+            int n = 0;
+
+            do {
+                if (n == incap) {
+                    incap = incap ? incap * 2 : 256;
+                    in = realloc(in, incap * sizeof(TokenList*));
+                    if (!in) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        exit(1);
+                    }
+                }
+
+                in[n++] = inst;
+                inst = inst->next;
+            } while (inst && inst->cmd != FUNCTION);
+
+            plan_func(d, in, n, it->name, &cap);
+        }
+    }
+
+    free(in);
+
+    if (d->n)
+        qsort(d->at, d->n, sizeof(DeadInst), by_inst);
+
+    return d;
+}
+
+// Find what the function in[0] defines, n instructions long, can drop
+void plan_func(Dead *d, TokenList **in, int n, char *fname, int *cap) {
+
+    Func *f = cfg_func(in[0], in[n - 1]->next, in[0]->argv[0].name, fname);
+    cfg_build(f);
+
+    char *reach = reached(f);
+    Live *live = calloc(f->nblock + 1, sizeof(Live));
+    char *removed = calloc(f->ninst + 1, 1);
+    char *dead = calloc(f->ninst + 1, 1);
+
+    if (!live || !removed || !dead) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    // Until no more pops die
+    int ndead;
+    do {
+        solve(f, live, reach, removed);
+
+        ndead = 0;
+        for (int b = 0; b < f->nblock; ++b)
+            if (reach[b])
+                scan(f, b, live_out(f, b, live, reach), removed, dead, &ndead);
+
+    } while (ndead);
+
+    for (int i = 0; i < f->ninst; ++i)
+        if (dead[i])
+            add(d, cap, in[i], NULL, 1);
+
+    for (int b = 0; b < f->nblock; ++b) {
+        if (reach[b])
+            continue;
+
+        int e = b;
+        while (e + 1 < f->nblock && !reach[e + 1])
+            ++e;
+
+        int first = f->block[b].first;
+        int end = f->block[e].end;
+        add(d, cap, in[first], in[end - 1], end - first);
+
+        b = e;
+    }
+
+    free(reach);
+    free(live);
+    free(removed);
+    free(dead);
+    free_func(f);
+    free(f);
+}
+
+// Whether each block of f is reached from its entry
+char *reached(Func *f) {
+
+    char *reach = calloc(f->nblock + 1, 1);
+    int *work = malloc((f->nblock + 1) * sizeof(int));
+
+    if (!reach || !work) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    int nwork = 0;
+    work[nwork++] = 0;
+    reach[0] = 1;
+
+    while (nwork) {
+        Block *b = &f->block[work[--nwork]];
+
+        for (int j = 0; j < b->nsucc; ++j) {
+            if (!reach[b->succ[j]]) {
+                reach[b->succ[j]] = 1;
+                work[nwork++] = b->succ[j];
+            }
+        }
+    }
+
+    free(work);
+
+    return reach;
+}
+
+// Live on entry to each reached block, leaving out removed instructions
+void solve(Func *f, Live *live, const char *reach, char *removed) {
+
+    memset(live, 0, f->nblock * sizeof(Live));
+
+    int changed;
+    do {
+        changed = 0;
+
+        for (int b = f->nblock - 1; b >= 0; --b) {
+            if (!reach[b])
+                continue;
+
+            Live out = live_out(f, b, live, reach);
+            Live l = scan(f, b, out, removed, NULL, NULL);
+
+            if (!same(&l, &live[b])) {
+                live[b] = l;
+                changed = 1;
+            }
+        }
+    } while (changed);
+}
+
+// Whether the slot inst pushes or pops is live on entry to each block of
+// f, which has to be built. Blocks nothing reaches count as live.
+char *live_slot(Func *f, const TokenList *inst) {
+
+    char *reach = reached(f);
+    Live *live = calloc(f->nblock + 1, sizeof(Live));
+    char *removed = calloc(f->ninst + 1, 1);
+    char *r = malloc(f->nblock + 1);
+
+    if (!live || !removed || !r) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    solve(f, live, reach, removed);
+
+    for (int b = 0; b < f->nblock; ++b)
+        r[b] = !reach[b] || slot_bit(inst, &live[b], 1);
+
+    free(reach);
+    free(live);
+    free(removed);
+
+    return r;
+}
+
+// Live on leaving block b
+Live live_out(Func *f, int b, const Live *in, const char *reach) {
+
+    Block *blk = &f->block[b];
+    TokenList *last = &f->inst[blk->end - 1];
+
+    // Off the end of the function, or to a label it lacks
+    if (blk->nsucc == 0 && last->cmd != RETURN)
+        return all;
+
+    if ((last->cmd == GOTO || last->cmd == IF)
+            && cfg_target(f, last->argv[0].name) < 0)
+        return all;
+
+    Live r = { 0, 0, 0 };
+    for (int j = 0; j < blk->nsucc; ++j) {
+        const Live *s = &in[blk->succ[j]];
+
+        if (!reach[blk->succ[j]])
+            continue;
+
+        r.local |= s->local;
+        r.arg |= s->arg;
+        r.temp |= s->temp;
+    }
+
+    return r;
+}
+
+// Live on entering block b given what is live on leaving it. With dead,
+// marks pops nothing reads there, counting new ones in *ndead.
+Live scan(Func *f, int b, Live live, char *removed, char *dead, int *ndead) {
+
+    Block *blk = &f->block[b];
+
+    for (int i = blk->end - 1; i >= blk->first; --i) {
+        TokenList *inst = &f->inst[i];
+
+        if (removed[i])
+            continue;
+
+        switch (inst->cmd) {
+            case PUSH:
+                slot_bit(inst, &live, 1);
+                break;
+
+            case POP:
+                if (!slot_bit(inst, &live, 0) && dead && !dead[i]) {
+                    dead[i] = 1;
+                    ++*ndead;
+
+                    if (i > blk->first && f->inst[i - 1].cmd == PUSH)
+                        removed[i - 1] = removed[i] = 1;
+                }
+                break;
+
+            case CALL:
+                live.temp = all.temp;
+                break;
+
+            case RETURN:
+                live.local = live.arg = 0;
+                live.temp = all.temp;
+                break;
+
+            default: /* NOP */
+                break;
+        }
+    }
+
+    return live;
+}
+
+// Whether the slot inst pushes or pops was live, setting or clearing it
+// after. Slots that aren't followed are always live.
+int slot_bit(const TokenList *inst, Live *live, int set) {
+
+    Memory mem = inst->argv[0].mem;
+    int num = inst->argv[1].num;
+
+    if (mem == TEMP && num < LIVE_TEMPS) {
+        unsigned bit = 1U << num;
+        int was = (live->temp & bit) != 0;
+        live->temp = set ? live->temp | bit : live->temp & ~bit;
+        return was;
+    }
+
+    unsigned long long *w;
+    if (mem == LOCAL)
+        w = &live->local;
+    else if (mem == ARGUMENT)
+        w = &live->arg;
+    else
+        return 1;
+
+    if (num >= LIVE_SLOTS)
+        return 1;
+
+    unsigned long long bit = 1ULL << num;
+    int was = (*w & bit) != 0;
+    *w = set ? *w | bit : *w & ~bit;
+
+    return was;
+}
+
+int same(const Live *x, const Live *y) {
+    return x->local == y->local && x->arg == y->arg && x->temp == y->temp;
+}
+
+void add(Dead *d, int *cap, const TokenList *inst, TokenList *last, int n) {
+
+    if (d->n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        d->at = realloc(d->at, *cap * sizeof(DeadInst));
+        if (!d->at) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+    }
+
+    DeadInst *e = &d->at[d->n++];
+    e->inst = inst;
+    e->last = last;
+    e->n = n;
+}
+
+int by_inst(const void *x, const void *y) {
+    uintptr_t a = (uintptr_t) ((const DeadInst*) x)->inst;
+    uintptr_t b = (uintptr_t) ((const DeadInst*) y)->inst;
+
+    return (a > b) - (a < b);
+}
+
+const DeadInst *find(const Dead *d, const TokenList *inst) {
+
+    if (!d || !d->n || !inst)
+        return NULL;
+
+    DeadInst key = { inst, NULL, 0 };
+
+    return bsearch(&key, d->at, d->n, sizeof(DeadInst), by_inst);
+}
+
+// Whether inst is a pop nothing reads
+int dead_store(const Dead *d, const TokenList *inst) {
+    const DeadInst *e = find(d, inst);
+    return e && !e->last;
+}
+
+// Last instruction of the unreachable run inst starts, setting *n to its
+// length, or NULL if it doesn't start one
+TokenList *dead_run(const Dead *d, const TokenList *inst, int *n) {
+
+    const DeadInst *e = find(d, inst);
+    if (!e || !e->last)
+        return NULL;
+
+    *n = e->n;
+    return e->last;
+}
+
+void free_dead(Dead *d) {
+    if (d) {
+        free(d->at);
+        free(d);
+    }
+}
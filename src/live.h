@@ -0,0 +1,20 @@
+// Pops nothing reads and runs of code nothing reaches, by instruction
+typedef struct DeadInst {
+    const TokenList *inst;  // The pop, or the first of the run
+    TokenList *last;        // Last of the run, NULL for a pop
+    int n;                  // Instructions in the run
+} DeadInst;
+
+typedef struct Dead {
+    DeadInst *at;           // Sorted by address of inst
+    int n;
+} Dead;
+
+// Function split into blocks, from cfg.h
+struct Func;
+
+Dead *plan_dead(FileList *fl);
+int dead_store(const Dead *d, const TokenList *inst);
+TokenList *dead_run(const Dead *d, const TokenList *inst, int *n);
+char *live_slot(struct Func *f, const TokenList *inst);
+void free_dead(Dead *d);
@@ -0,0 +1,467 @@
+#define _DEFAULT_SOURCE  // syscall()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && !defined(NO_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+
+#include "lex.h"
+#include "prog.h"
+#include "load.h"
+
+/**
+ * Batched input loading.
+ *
+ * Opens and reads every input file through io_uring, keeping up to
+ * LOAD_DEPTH files in flight at once, and hands each file to a pool of
+ * lexer threads as soon as its last read completes. Each file only ever
+ * has one request in flight: open, then reads until EOF, then close.
+ *
+ * Without io_uring (other systems, old kernels, or ops the kernel
+ * refuses) files are read with blocking open/read instead; the lexer
+ * threads are the same.
+ *
+ */
+
+#define LOAD_DEPTH  64
+#define LOAD_CHUNK  16384
+
+typedef struct Input {
+    char *path;
+    FileList *fl;
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+} Input;
+
+// Files read but not yet lexed, -1 tells a lexer to stop
+typedef struct Queue {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int *item;
+    int head;
+    int tail;
+    Input *in;
+} Queue;
+
+static void queue_push(Queue *q, int i);
+static void *lex_worker(void *arg);
+static void read_blocking(Input *in);
+static void grow(Input *in);
+
+#ifdef HAVE_IO_URING
+static int read_uring(Input *in, int n, Queue *q);
+#endif
+
+
+void load_files(FileList *fl, char **files, int n, int jobs) {
+
+    if (!n)
+        return;
+
+    Input *in = calloc(n, sizeof(Input));
+    Queue q;
+
+    q.item = malloc((n + jobs) * sizeof(int));
+    q.head = 0;
+    q.tail = 0;
+    q.in   = in;
+
+    if (!in || !q.item) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.ready, NULL);
+
+    // Keep the files in command line order
+    for (int i = 0; i < n; ++i) {
+        if (i) {
+            fl->next = new_file_list();
+            fl = fl->next;
+        }
+
+        fl->name = vm_basename(files[i]);
+
+        in[i].path = files[i];
+        in[i].fl   = fl;
+        in[i].fd   = -1;
+    }
+
+    if (jobs < 1)
+        jobs = 1;
+
+    pthread_t *th = malloc(jobs * sizeof(pthread_t));
+    for (int i = 0; i < jobs; ++i) {
+        if (pthread_create(&th[i], NULL, lex_worker, &q) != 0) {
+            fprintf(stderr, "Failed to start thread\n");
+            exit(1);
+        }
+    }
+
+    int done = 0;
+
+#ifdef HAVE_IO_URING
+    done = read_uring(in, n, &q);
+#endif
+
+    for (int i = done; i < n; ++i) {
+        read_blocking(&in[i]);
+        queue_push(&q, i);
+    }
+
+    for (int i = 0; i < jobs; ++i)
+        queue_push(&q, -1);
+
+    for (int i = 0; i < jobs; ++i)
+        pthread_join(th[i], NULL);
+
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.ready);
+
+    free(th);
+    free(q.item);
+    free(in);
+}
+
+
+void queue_push(Queue *q, int i) {
+    pthread_mutex_lock(&q->lock);
+
+    q->item[q->tail++] = i;
+
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void *lex_worker(void *arg) {
+
+    Queue *q = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+
+        while (q->head == q->tail)
+            pthread_cond_wait(&q->ready, &q->lock);
+
+        int i = q->item[q->head++];
+
+        pthread_mutex_unlock(&q->lock);
+
+        if (i < 0)
+            break;
+
+        Input *in = &q->in[i];
+
+        // fmemopen() rejects empty buffers
+        if (in->len) {
+            FILE *fp = fmemopen(in->buf, in->len, "r");
+
+            if (!fp) {
+                fprintf(stderr, "Failed to load file '%s'\n", in->path);
+                exit(1);
+            }
+
+            in->fl->tl = scan_stream(fp);
+            fclose(fp);
+        }
+
+        free(in->buf);
+        in->buf = NULL;
+    }
+
+    return NULL;
+}
+
+void read_blocking(Input *in) {
+
+    if (in->fd < 0)
+        in->fd = open(in->path, O_RDONLY);
+
+    if (in->fd < 0) {
+        fprintf(stderr, "Failed to load file '%s'\n", in->path);
+        exit(1);
+    }
+
+    for (;;) {
+        grow(in);
+
+        ssize_t r = read(in->fd, in->buf + in->len, in->cap - in->len);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+
+        if (r < 0) {
+            fprintf(stderr, "Failed to load file '%s'\n", in->path);
+            exit(1);
+        }
+
+        if (r == 0)
+            break;
+
+        in->len += r;
+    }
+
+    close(in->fd);
+    in->fd = -1;
+}
+
+void grow(Input *in) {
+    if (in->cap - in->len >= LOAD_CHUNK)
+        return;
+
+    in->cap = in->cap ? in->cap * 2 : LOAD_CHUNK;
+    in->buf = realloc(in->buf, in->cap);
+
+    if (!in->buf) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+}
+
+
+#ifdef HAVE_IO_URING
+
+typedef struct Uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_size;
+    void *cq_map;
+    size_t cq_size;
+    size_t sqe_size;
+    unsigned queued;
+} Uring;
+
+// user_data is the file index shifted over the request kind
+enum { REQ_OPEN, REQ_READ, REQ_CLOSE };
+
+static int uring_init(Uring *u, unsigned entries);
+static void uring_exit(Uring *u);
+static void uring_push(Uring *u, int op, int fd, Input *in, int i, int kind);
+
+
+// Returns how many of the files were read; the caller reads the rest
+// with blocking IO.
+int read_uring(Input *in, int n, Queue *q) {
+
+    Uring u;
+
+    if (uring_init(&u, LOAD_DEPTH) < 0)
+        return 0;
+
+    int next = 0;       // Next file to open
+    int inflight = 0;
+    int fallback = 0;   // Kernel lacks the ops, finish without io_uring
+
+    while (next < n || inflight) {
+
+        while (!fallback && next < n && inflight < LOAD_DEPTH) {
+            uring_push(&u, IORING_OP_OPENAT, AT_FDCWD, &in[next], next, REQ_OPEN);
+            ++next;
+            ++inflight;
+        }
+
+        if (!inflight)
+            break;
+
+        int r = syscall(__NR_io_uring_enter, u.fd, u.queued, 1,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+
+        if (r < 0 && errno != EINTR) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+
+        if (r >= 0)
+            u.queued -= r < (int) u.queued ? r : (int) u.queued;
+
+        unsigned head = *u.cq_head;
+
+        while (head != __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+
+            int i    = cqe->user_data >> 2;
+            int kind = cqe->user_data & 3;
+            int res  = cqe->res;
+
+            ++head;
+            __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+
+            Input *f = &in[i];
+
+            switch (kind) {
+                case REQ_OPEN:
+                    if (res == -EINVAL || res == -EOPNOTSUPP) {
+                        // No IORING_OP_OPENAT, read this one by hand
+                        fallback = 1;
+                        read_blocking(f);
+                        queue_push(q, i);
+                        --inflight;
+                        break;
+                    }
+
+                    if (res < 0) {
+                        fprintf(stderr, "Failed to load file '%s'\n", f->path);
+                        exit(1);
+                    }
+
+                    f->fd = res;
+                    grow(f);
+                    uring_push(&u, IORING_OP_READ, f->fd, f, i, REQ_READ);
+                    break;
+
+                case REQ_READ:
+                    if (res == -EINVAL || res == -EOPNOTSUPP) {
+                        read_blocking(f);
+                        queue_push(q, i);
+                        --inflight;
+                        break;
+                    }
+
+                    if (res < 0) {
+                        fprintf(stderr, "Failed to load file '%s'\n", f->path);
+                        exit(1);
+                    }
+
+                    if (res > 0) {
+                        f->len += res;
+                        grow(f);
+                        uring_push(&u, IORING_OP_READ, f->fd, f, i, REQ_READ);
+                        break;
+                    }
+
+                    // EOF, lex it while the close is in flight
+                    queue_push(q, i);
+                    uring_push(&u, IORING_OP_CLOSE, f->fd, f, i, REQ_CLOSE);
+                    break;
+
+                case REQ_CLOSE:
+                    if (res < 0)
+                        close(f->fd);
+
+                    f->fd = -1;
+                    --inflight;
+                    break;
+            }
+        }
+    }
+
+    uring_exit(&u);
+
+    return next;
+}
+
+int uring_init(Uring *u, unsigned entries) {
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(Uring));
+
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return -1;
+
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_size > u->sq_size)
+            u->sq_size = u->cq_size;
+        u->cq_size = 0;
+    }
+
+    u->sq_map = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_map = u->cq_size
+              ? mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING)
+              : u->sq_map;
+    u->sqes = mmap(NULL, u->sqe_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+
+    if (u->sq_map == MAP_FAILED || u->cq_map == MAP_FAILED
+            || u->sqes == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+
+    char *sq = u->sq_map;
+    char *cq = u->cq_map;
+
+    u->sq_head  = (unsigned*) (sq + p.sq_off.head);
+    u->sq_tail  = (unsigned*) (sq + p.sq_off.tail);
+    u->sq_mask  = (unsigned*) (sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*) (sq + p.sq_off.array);
+    u->cq_head  = (unsigned*) (cq + p.cq_off.head);
+    u->cq_tail  = (unsigned*) (cq + p.cq_off.tail);
+    u->cq_mask  = (unsigned*) (cq + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+void uring_exit(Uring *u) {
+    munmap(u->sqes, u->sqe_size);
+    if (u->cq_size)
+        munmap(u->cq_map, u->cq_size);
+    munmap(u->sq_map, u->sq_size);
+    close(u->fd);
+}
+
+// Queue a request; it is submitted with the next io_uring_enter
+void uring_push(Uring *u, int op, int fd, Input *in, int i, int kind) {
+
+    unsigned tail = *u->sq_tail;
+    unsigned idx = tail & *u->sq_mask;
+
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = ((unsigned long long) i << 2) | kind;
+
+    switch (op) {
+        case IORING_OP_OPENAT:
+            sqe->addr = (unsigned long) in->path;
+            sqe->open_flags = O_RDONLY;
+            break;
+
+        case IORING_OP_READ:
+            sqe->addr = (unsigned long) (in->buf + in->len);
+            sqe->len = in->cap - in->len;
+            sqe->off = in->len;
+            break;
+
+        default:
+            break;
+    }
+
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++u->queued;
+}
+
+#endif
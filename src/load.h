@@ -0,0 +1 @@
+void load_files(FileList *fl, char **files, int n, int jobs);
@@ -0,0 +1,891 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lex.h"
+#include "prog.h"
+#include "table.h"
+#include "prof.h"
+#include "write.h"
+#include "cfg.h"
+#include "conv.h"
+#include "loop.h"
+#include "live.h"
+
+/**
+ * Loop unrolling.
+ *
+ * Jack writes `while (i < 16) { ...; let i = i + 1; }` after `let i = 0;`
+ * as
+ *
+ *     push constant 0; pop X
+ *     label H
+ *     push X; push constant 16; lt; not; if-goto E
+ *     ...
+ *     push X; push constant 1; add; pop X
+ *     goto H
+ *     label E
+ *
+ * When nothing else jumps to H, and the body has no labels or jumps of
+ * its own and leaves X to the last four instructions, the body runs a
+ * number of times known here. Up to a ROM budget, the writer then drops
+ * the test and writes the body that many times. Failing that, it keeps
+ * the loop with the body written a number of times that divides it, so
+ * the test still falls on every iteration it would have stopped at.
+ *
+ * Calls may change statics and temp, so loops over those have to be
+ * free of calls.
+ *
+ * Loops over arrays are strength reduced instead. In a loop like the
+ * above that reads or writes a[i], each `push a; push i; add` that ends
+ * up in `pop pointer 1` loads both again. When a isn't changed in the
+ * loop and i only by its step, the writer keeps a + i in a local of its
+ * own, set up before the header and stepped with i, and pushes that. If
+ * the test and the sums are all that read i in the loop, and nothing
+ * reads it again wherever the loop leaves to, it stops stepping i too,
+ * and tests a + i against a plus what i was tested against: the
+ * difference, and so the compare, is the same. The header reads i, so
+ * that holds too for a loop entered again with the i it left behind.
+ *
+ */
+
+static int counted(Func *f, int h, const int *refs, Table *names, int *trips);
+static void plan(Func *f, int h, int back, int budget, Loop *lp);
+static int is_push(TokenList *inst, Memory mem, int num);
+static int is_pop(TokenList *inst, Memory mem, int num);
+static int is_op(TokenList *inst, RType op);
+static void plan_func(Ivs *v, TokenList **in, int n, char *fname,
+                      const CallConv *conv, int *cap, int *fcap);
+static int reduce(TokenList **in, Func *f, int h, Table *names, const int *lo,
+                  const int *hi, IvLoop *lp);
+static int read_after(Func *f, int h, int back, const TokenList *inst);
+static int site(TokenList **in, int j, Memory mem, int num, int *a);
+static int popped(TokenList **in, int first, int end, Memory mem, int num);
+static int addressed(TokenList **in, int j, int end);
+static int array_of(IvLoop *lp, Memory mem, int num);
+static void cost(IvLoop *lp, char *fname, const Conv *fast);
+static int token(TokenList *code, CmdArg *argv, int n, CommandType cmd, int x,
+                 int num, int line);
+
+
+Unroll *plan_unroll(FileList *fl, int budget) {
+
+    int nfunc;
+    Func *func = cfg_split(fl, &nfunc);
+
+    Unroll *u = malloc(sizeof(Unroll));
+    int cap = 16;
+
+    if (u)
+        u->loop = malloc(cap * sizeof(Loop));
+
+    if (!u || !u->loop) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    u->heads = new_table();
+
+    for (int i = 0; i < nfunc; ++i) {
+        Func *f = &func[i];
+
+        // Jumps to each label of the function
+        Table *names = new_table();
+        int *refs = calloc(f->ninst + 1, sizeof(int));
+        if (!refs) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+
+        for (int j = 0; j < f->ninst; ++j)
+            if (f->inst[j].cmd == GOTO || f->inst[j].cmd == IF)
+                ++refs[table_intern(names, f->inst[j].argv[0].name)];
+
+        for (int j = 0; j < f->ninst; ++j) {
+            int trips;
+            int back = f->inst[j].cmd == LABEL ? counted(f, j, refs, names, &trips) : 0;
+
+            if (!back)
+                continue;
+
+            const char *scope = f->scope ? f->scope : "null";
+            const char *name = f->inst[j].argv[0].name;
+
+            char *label = malloc(strlen(scope) + strlen(name) + 2);
+            if (!label) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                exit(1);
+            }
+            sprintf(label, "%s$%s", scope, name);
+
+            int known = u->heads->size;
+            int id = table_intern(u->heads, label);
+            free(label);
+
+            if (id == cap) {
+                cap *= 2;
+                u->loop = realloc(u->loop, cap * sizeof(Loop));
+                if (!u->loop) {
+                    fprintf(stderr, "Failed to allocate memory\n");
+                    exit(1);
+                }
+            }
+
+            Loop *lp = &u->loop[id];
+
+            if (u->heads->size == known) {
+                lp->why = "header label defined twice";
+                continue;
+            }
+
+            lp->trips = trips;
+            plan(f, j, back, budget, lp);
+        }
+
+        free(refs);
+        free_table(names);
+    }
+
+    free_funcs(func, nfunc);
+
+    return u;
+}
+
+// Index of the goto closing the counted loop headed by label h, or 0 if
+// h doesn't head one. Sets *trips to the times the body runs.
+int counted(Func *f, int h, const int *refs, Table *names, int *trips) {
+
+    TokenList *in = f->inst;
+    int n = f->ninst;
+
+    if (h < 2 || h + 5 >= n)
+        return 0;
+
+    int id = table_find(names, in[h].argv[0].name);
+    if (id < 0 || refs[id] != 1)
+        return 0;
+
+    // Counter set just before
+    TokenList *init = &in[h - 2];
+    if (!is_push(init, CONSTANT, -1) || in[h - 1].cmd != POP)
+        return 0;
+
+    Memory mem = in[h - 1].argv[0].mem;
+    int num = in[h - 1].argv[1].num;
+
+    if (mem != LOCAL && mem != ARGUMENT && mem != STATIC && mem != TEMP)
+        return 0;
+
+    // Tested against a constant
+    if (!is_push(&in[h + 1], mem, num) || !is_push(&in[h + 2], CONSTANT, -1))
+        return 0;
+
+    if (!is_op(&in[h + 3], LT) && !is_op(&in[h + 3], GT) && !is_op(&in[h + 3], EQ))
+        return 0;
+
+    RType op = in[h + 3].argv[0].op;
+
+    int k = h + 4, nots = 0;
+    for (; k < n && is_op(&in[k], NOT); ++k)
+        ++nots;
+
+    if (k == n || in[k].cmd != IF)
+        return 0;
+
+    // A straight body, then back to h and out to the if-goto's label
+    int back;
+    for (back = k + 1; back < n; ++back) {
+        CommandType cmd = in[back].cmd;
+
+        if (cmd != PUSH && cmd != POP && cmd != ARITHMETIC && cmd != CALL)
+            break;
+    }
+
+    if (back + 1 >= n || back - 4 <= k
+            || in[back].cmd != GOTO || in[back + 1].cmd != LABEL
+            || strcmp(in[back].argv[0].name, in[h].argv[0].name) != 0
+            || strcmp(in[back + 1].argv[0].name, in[k].argv[0].name) != 0)
+        return 0;
+
+    // Stepped by a constant at the end alone
+    if (!is_push(&in[back - 4], mem, num) || !is_push(&in[back - 3], CONSTANT, -1)
+            || !(is_op(&in[back - 2], ADD) || is_op(&in[back - 2], SUB))
+            || !is_pop(&in[back - 1], mem, num))
+        return 0;
+
+    for (int i = k + 1; i < back - 4; ++i) {
+        if (is_pop(&in[i], mem, num))
+            return 0;
+
+        if (in[i].cmd == CALL && (mem == STATIC || mem == TEMP))
+            return 0;
+    }
+
+    int x = init->argv[1].num;
+    int bound = in[h + 2].argv[1].num;
+    int step = in[back - 3].argv[1].num;
+
+    if (is_op(&in[back - 2], SUB))
+        step = -step;
+
+    // As the compare writes it, from the difference in 16 bits
+    for (*trips = 0; ; ++*trips) {
+        short d = x - bound;
+        int exit = op == LT ? d < 0 : op == GT ? d > 0 : d == 0;
+
+        if (nots % 2)
+            exit = !exit;
+
+        if (exit)
+            break;
+
+        if (*trips == LOOP_TRIPS)
+            return 0;
+
+        x = (short) (x + step);
+    }
+
+    return back;
+}
+
+// Copies of the body to write for the loop headed by h and closed by back
+void plan(Func *f, int h, int back, int budget, Loop *lp) {
+
+    int branch = h + 1;
+    while (f->inst[branch].cmd != IF)
+        ++branch;
+
+    int test = write_cost(&f->inst[h + 1], branch - h, f->fname, NULL);
+    int body = write_cost(&f->inst[branch + 1], back - branch - 1, f->fname, NULL);
+    int trips = lp->trips;
+
+    // Test and goto per iteration, and the test that ends it
+    lp->why = NULL;
+    lp->factor = trips;
+    lp->words = (trips - 1) * body - test - 2;
+    lp->cycles = -(long) (trips + 1) * test - 2L * trips;
+
+    if (lp->words <= budget)
+        return;
+
+    for (int k = trips / 2; k > 1; --k) {
+        if (trips % k || (k - 1) * body > budget)
+            continue;
+
+        lp->factor = k;
+        lp->words = (k - 1) * body;
+        lp->cycles = -(long) (trips - trips / k) * (test + 2);
+        return;
+    }
+
+    lp->why = "over the ROM budget";
+    lp->factor = 1;
+    lp->words = 0;
+    lp->cycles = 0;
+}
+
+// Whether inst pushes mem num, or any constant for num -1
+int is_push(TokenList *inst, Memory mem, int num) {
+    return inst->cmd == PUSH && inst->argv[0].mem == mem
+        && (num < 0 || inst->argv[1].num == num);
+}
+
+int is_pop(TokenList *inst, Memory mem, int num) {
+    return inst->cmd == POP && inst->argv[0].mem == mem && inst->argv[1].num == num;
+}
+
+int is_op(TokenList *inst, RType op) {
+    return inst->cmd == ARITHMETIC && inst->argv[0].op == op;
+}
+
+// How to write the loop headed by label, NULL if it isn't counted
+const Loop *find_loop(const Unroll *u, const char *label) {
+
+    if (!u)
+        return NULL;
+
+    int id = table_find(u->heads, label);
+
+    return id < 0 ? NULL : &u->loop[id];
+}
+
+void free_unroll(Unroll *u) {
+    if (u) {
+        free_table(u->heads);
+        free(u->loop);
+        free(u);
+    }
+}
+
+// Loops over arrays to strength reduce, given the convention of each
+// function
+Ivs *plan_ivs(FileList *fl, const CallConv *conv) {
+
+    Ivs *v = malloc(sizeof(Ivs));
+    int cap = 16, fcap = 16;
+
+    if (v) {
+        v->loop = malloc(cap * sizeof(IvLoop));
+        v->extra = malloc(fcap * sizeof(int));
+    }
+
+    if (!v || !v->loop || !v->extra) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    v->heads = new_table();
+    v->fns = new_table();
+
+    TokenList **in = NULL;
+    int incap = 0;
+
+    for (FileList *it = fl; it; it = it->next) {
+        TokenList *inst = it->tl;
+
+        // Code before the first function has no locals to keep pointers in
+        while (inst && inst->cmd != FUNCTION)
+            inst = inst->next;
+
+        while (inst) {
+            int n = 0;
+
+            do {
+                if (n == incap) {
+                    incap = incap ? incap * 2 : 256;
+                    in = realloc(in, incap * sizeof(TokenList*));
+                    if (!in) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        exit(1);
+                    }
+                }
+
+                in[n++] = inst;
+                inst = inst->next;
+            } while (inst && inst->cmd != FUNCTION);
+
+            plan_func(v, in, n, it->name, conv, &cap, &fcap);
+        }
+    }
+
+    free(in);
+
+    return v;
+}
+
+// Plan the loops of the function defined by in[0], n instructions long
+void plan_func(Ivs *v, TokenList **in, int n, char *fname,
+               const CallConv *conv, int *cap, int *fcap) {
+
+    char *scope = in[0]->argv[0].name;
+    const char *why;
+
+    int known = v->fns->size;
+    int fn = table_intern(v->fns, scope);
+
+    if (v->fns->size == known)
+        return;
+
+    if (fn == *fcap) {
+        *fcap *= 2;
+        v->extra = realloc(v->extra, *fcap * sizeof(int));
+        if (!v->extra) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+    }
+
+    v->extra[fn] = 0;
+
+    // A fast function without locals has no frame to add them to
+    const Conv *c = find_conv(conv, scope, &why);
+    if (c && !c->framed)
+        return;
+
+    Func *f = cfg_func(in[0], in[n - 1]->next, scope, fname);
+    cfg_build(f);
+
+    // First and last jump to each label
+    Table *names = new_table();
+    int *lo = malloc(n * sizeof(int));
+    int *hi = malloc(n * sizeof(int));
+    if (!lo || !hi) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    for (int j = 0; j < n; ++j) {
+        if (in[j]->cmd != GOTO && in[j]->cmd != IF)
+            continue;
+
+        int seen = names->size;
+        int id = table_intern(names, in[j]->argv[0].name);
+
+        if (names->size != seen)
+            lo[id] = j;
+        hi[id] = j;
+    }
+
+    // Loops within one already reduced are left as they are
+    int end = 0;
+
+    for (int h = 1; h < n; ++h) {
+        IvLoop lp;
+        int back = in[h]->cmd == LABEL && h > end
+            ? reduce(in, f, h, names, lo, hi, &lp) : 0;
+
+        if (!back)
+            continue;
+
+        char *label = malloc(strlen(scope) + strlen(in[h]->argv[0].name) + 2);
+        if (!label) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+        sprintf(label, "%s$%s", scope, in[h]->argv[0].name);
+
+        int seen = v->heads->size;
+        int id = table_intern(v->heads, label);
+        free(label);
+
+        if (id == *cap) {
+            *cap *= 2;
+            v->loop = realloc(v->loop, *cap * sizeof(IvLoop));
+            if (!v->loop) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                exit(1);
+            }
+        }
+
+        if (v->heads->size == seen) {
+            free(lp.site);
+            free(lp.site_array);
+            v->loop[id].why = "header label defined twice";
+            continue;
+        }
+
+        lp.local = in[0]->argv[1].num + v->extra[fn];
+        cost(&lp, fname, c);
+
+        if (!lp.why) {
+            v->extra[fn] += lp.narray + !lp.keep;
+            end = back;
+        }
+
+        v->loop[id] = lp;
+    }
+
+    free(lo);
+    free(hi);
+    free_table(names);
+    free_func(f);
+    free(f);
+}
+
+// Index of the goto closing the loop headed by label h, if it walks
+// arrays with a counter as described above, else 0. Fills in lp.
+int reduce(TokenList **in, Func *f, int h, Table *names, const int *lo,
+           const int *hi, IvLoop *lp) {
+
+    int id = table_find(names, in[h]->argv[0].name);
+    if (id < 0 || lo[id] < h)
+        return 0;
+
+    int back = hi[id];
+    if (in[back]->cmd != GOTO || back < h + 8)
+        return 0;
+
+    // Tested against something the loop leaves as it is
+    TokenList *test = in[h + 1], *bound = in[h + 2];
+    if (test->cmd != PUSH || bound->cmd != PUSH)
+        return 0;
+
+    Memory mem = test->argv[0].mem;
+    int num = test->argv[1].num;
+    Memory bmem = bound->argv[0].mem;
+    int bnum = bound->argv[1].num;
+
+    if ((mem != LOCAL && mem != ARGUMENT)
+            || (bmem != CONSTANT && bmem != LOCAL && bmem != ARGUMENT)
+            || (bmem == mem && bnum == num) || popped(in, h, back, bmem, bnum))
+        return 0;
+
+    if (!is_op(in[h + 3], LT) && !is_op(in[h + 3], GT) && !is_op(in[h + 3], EQ))
+        return 0;
+
+    // Entered at the header alone
+    for (int j = h + 1; j <= back; ++j) {
+        int l = in[j]->cmd == LABEL ? table_find(names, in[j]->argv[0].name) : -1;
+
+        if (l >= 0 && (lo[l] < h || hi[l] > back))
+            return 0;
+    }
+
+    // Changed by a constant step alone
+    int step = -1;
+    for (int j = h + 4; j < back; ++j) {
+        if (!is_pop(in[j], mem, num))
+            continue;
+
+        if (step >= 0 || j < h + 7
+                || !is_push(in[j - 3], mem, num) || !is_push(in[j - 2], CONSTANT, -1)
+                || !(is_op(in[j - 1], ADD) || is_op(in[j - 1], SUB)))
+            return 0;
+
+        step = j - 3;
+    }
+
+    if (step < 0)
+        return 0;
+
+    lp->why = NULL;
+    lp->head = in[h];
+    lp->back = in[back];
+    lp->test = test;
+    lp->step = in[step];
+    lp->mem = mem;
+    lp->num = num;
+    lp->bmem = bmem;
+    lp->bnum = bnum;
+    lp->narray = 0;
+    lp->nsite = 0;
+    lp->keep = 0;
+    lp->site = malloc((back - h) * sizeof(TokenList*));
+    lp->site_array = malloc((back - h) * sizeof(int));
+
+    if (!lp->site || !lp->site_array) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    // Sums with arrays the loop doesn't change, and other reads of i
+    for (int j = h + 4; j < back; ++j) {
+        int a;
+
+        if (j == step) {
+            j += 3;
+            continue;
+        }
+
+        if (j + 2 < back && site(in, j, mem, num, &a) && addressed(in, j + 3, back)) {
+            Memory amem = in[a]->argv[0].mem;
+            int anum = in[a]->argv[1].num;
+            int k = popped(in, h, back, amem, anum) ? -1 : array_of(lp, amem, anum);
+
+            if (k >= 0) {
+                lp->site[lp->nsite] = in[j];
+                lp->site_array[lp->nsite++] = k;
+                j += 2;
+                continue;
+            }
+        }
+
+        if (is_push(in[j], mem, num))
+            lp->keep = 1;
+    }
+
+    if (!lp->keep)
+        lp->keep = read_after(f, h, back, test);
+
+    if (!lp->nsite) {
+        free(lp->site);
+        free(lp->site_array);
+        return 0;
+    }
+
+    return back;
+}
+
+// Whether the slot inst pushes may be read after leaving the loop from
+// label h to the goto at back
+int read_after(Func *f, int h, int back, const TokenList *inst) {
+
+    char *live = NULL;
+    int r = 0;
+
+    for (int j = h; j <= back && !r; ++j) {
+        TokenList *jump = &f->inst[j];
+        if (jump->cmd != GOTO && jump->cmd != IF)
+            continue;
+
+        int b = cfg_target(f, jump->argv[0].name);
+        if (b < 0) {
+            r = 1;
+            break;
+        }
+
+        if (f->block[b].first >= h && f->block[b].first <= back)
+            continue;
+
+        if (!live)
+            live = live_slot(f, inst);
+        r = live[b];
+    }
+
+    free(live);
+
+    return r;
+}
+
+// Whether in[j] starts a sum of i and a local or argument, left in *a
+int site(TokenList **in, int j, Memory mem, int num, int *a) {
+
+    if (in[j]->cmd != PUSH || in[j + 1]->cmd != PUSH || !is_op(in[j + 2], ADD))
+        return 0;
+
+    if (is_push(in[j], mem, num))
+        *a = j + 1;
+    else if (is_push(in[j + 1], mem, num))
+        *a = j;
+    else
+        return 0;
+
+    Memory amem = in[*a]->argv[0].mem;
+
+    return (amem == LOCAL || amem == ARGUMENT) && !is_push(in[*a], mem, num);
+}
+
+// Whether the value on top of the stack before in[j] is popped to that
+// before in[end], with nothing jumping in between
+int addressed(TokenList **in, int j, int end) {
+
+    for (int depth = 1; j < end; ++j) {
+        TokenList *inst = in[j];
+
+        switch (inst->cmd) {
+            case PUSH:
+                ++depth;
+                break;
+
+            case POP:
+                if (--depth == 0)
+                    return is_pop(inst, POINTER, 1);
+                break;
+
+            case ARITHMETIC:
+                if (inst->argv[0].op != NEG && inst->argv[0].op != NOT)
+                    --depth;
+                break;
+
+            case CALL:
+                depth -= inst->argv[1].num - 1;
+                break;
+
+            default:
+                return 0;
+        }
+
+        if (depth <= 0)
+            return 0;
+    }
+
+    return 0;
+}
+
+// Whether in[first] to in[end] pop mem num
+int popped(TokenList **in, int first, int end, Memory mem, int num) {
+
+    for (int j = first; j <= end; ++j)
+        if (is_pop(in[j], mem, num))
+            return 1;
+
+    return 0;
+}
+
+// Index of the array mem num in lp, added if new, or -1 if there are
+// too many
+int array_of(IvLoop *lp, Memory mem, int num) {
+
+    for (int k = 0; k < lp->narray; ++k)
+        if (lp->array[k].mem == mem && lp->array[k].num == num)
+            return k;
+
+    if (lp->narray == IV_ARRAYS)
+        return -1;
+
+    lp->array[lp->narray].mem = mem;
+    lp->array[lp->narray].num = num;
+
+    return lp->narray++;
+}
+
+// Compare what the writer writes for the body of lp as it is and
+// reduced, to the goto closing it, in a function with convention fast
+void cost(IvLoop *lp, char *fname, const Conv *fast) {
+
+    int len = 1;
+    for (TokenList *it = lp->head; it != lp->back; it = it->next)
+        ++len;
+
+    int cap = len + (lp->nsite + 2) * IV_CODE;
+    TokenList *code = malloc(cap * sizeof(TokenList));
+    CmdArg *argv = malloc(2 * cap * sizeof(CmdArg));
+
+    if (!code || !argv) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    int n = 0, site = 0;
+    for (TokenList *it = lp->head; ; it = it->next) {
+        TokenList *last = it;
+
+        if (it == lp->step) {
+            n += iv_code(lp, IV_STEP, 0, &code[n], &argv[2 * n], NULL);
+            last = it->next->next->next;
+        } else if (it == lp->test && !lp->keep) {
+            n += iv_code(lp, IV_TEST, 0, &code[n], &argv[2 * n], NULL);
+            last = it->next;
+        } else if (site < lp->nsite && it == lp->site[site]) {
+            n += iv_code(lp, IV_SITE, site++, &code[n], &argv[2 * n], NULL);
+            last = it->next->next;
+        } else {
+            code[n++] = *it;
+        }
+
+        if (last == lp->back)
+            break;
+        it = last;
+    }
+
+    for (int i = 0; i + 1 < n; ++i)
+        code[i].next = &code[i + 1];
+
+    lp->cycles = write_cost(code, n, fname, fast) - write_cost(lp->head, len, fname, fast);
+
+    n = iv_code(lp, IV_INIT, 0, code, argv, NULL);
+    int init = write_cost(code, n, fname, fast);
+
+    lp->words = lp->cycles + init;
+
+    if (lp->cycles * IV_TRIPS + init >= 0)
+        lp->why = "pointers cost more than they save";
+
+    free(code);
+    free(argv);
+}
+
+// How to write lp up to the writer
+const IvLoop *find_iv(const Ivs *v, const char *label) {
+
+    if (!v)
+        return NULL;
+
+    int id = table_find(v->heads, label);
+
+    return id < 0 ? NULL : &v->loop[id];
+}
+
+// Locals function fn needs besides its own for the pointers of its loops
+int iv_locals(const Ivs *v, const char *fn) {
+
+    int id = v && fn ? table_find(v->fns, fn) : -1;
+
+    return id < 0 ? 0 : v->extra[id];
+}
+
+// Put what the writer writes instead of part of lp in code, linked up to
+// next, with arguments in argv. For IV_SITE, k is the sum, and for the
+// others it is unused. Returns the number of instructions.
+int iv_code(const IvLoop *lp, IvPart part, int k, TokenList *code, CmdArg *argv,
+            TokenList *next) {
+
+    int n = 0;
+    int q = lp->local + lp->narray;
+    TokenList *step = lp->step;
+    int s = step->next->argv[1].num;
+    RType op = step->next->next->argv[0].op;
+
+    switch (part) {
+        case IV_INIT:
+            for (int i = 0; i < lp->narray; ++i) {
+                int line = lp->head->line;
+
+                n = token(code, argv, n, PUSH, lp->array[i].mem, lp->array[i].num, line);
+                n = token(code, argv, n, PUSH, lp->mem, lp->num, line);
+                n = token(code, argv, n, ARITHMETIC, ADD, 0, line);
+                n = token(code, argv, n, POP, LOCAL, lp->local + i, line);
+            }
+
+            if (!lp->keep) {
+                int line = lp->head->line;
+
+                n = token(code, argv, n, PUSH, lp->array[0].mem, lp->array[0].num, line);
+                n = token(code, argv, n, PUSH, lp->bmem, lp->bnum, line);
+                n = token(code, argv, n, ARITHMETIC, ADD, 0, line);
+                n = token(code, argv, n, POP, LOCAL, q, line);
+            }
+            break;
+
+        case IV_SITE:
+            n = token(code, argv, n, PUSH, LOCAL, lp->local + lp->site_array[k],
+                      lp->site[k]->line);
+            break;
+
+        case IV_TEST:
+            n = token(code, argv, n, PUSH, LOCAL, lp->local, lp->test->line);
+            n = token(code, argv, n, PUSH, LOCAL, q, lp->test->line);
+            break;
+
+        case IV_STEP:
+            if (lp->keep) {
+                n = token(code, argv, n, PUSH, lp->mem, lp->num, step->line);
+                n = token(code, argv, n, PUSH, CONSTANT, s, step->line);
+                n = token(code, argv, n, ARITHMETIC, op, 0, step->line);
+                n = token(code, argv, n, POP, lp->mem, lp->num, step->line);
+            }
+
+            for (int i = 0; i < lp->narray; ++i) {
+                n = token(code, argv, n, PUSH, LOCAL, lp->local + i, step->line);
+                n = token(code, argv, n, PUSH, CONSTANT, s, step->line);
+                n = token(code, argv, n, ARITHMETIC, op, 0, step->line);
+                n = token(code, argv, n, POP, LOCAL, lp->local + i, step->line);
+            }
+            break;
+    }
+
+    if (n)
+        code[n - 1].next = next;
+
+    return n;
+}
+
+// Make code[n] the instruction cmd x num, linked to code[n + 1]
+int token(TokenList *code, CmdArg *argv, int n, CommandType cmd, int x,
+          int num, int line) {
+
+    TokenList *t = &code[n];
+
+    t->cmd = cmd;
+    t->argv = &argv[2 * n];
+    t->line = line;
+    t->next = &code[n + 1];
+
+    if (cmd == ARITHMETIC) {
+        t->argc = 1;
+        t->argv[0].op = x;
+    } else {
+        t->argc = 2;
+        t->argv[0].mem = x;
+        t->argv[1].num = num;
+    }
+
+    return n + 1;
+}
+
+void free_ivs(Ivs *v) {
+    if (!v)
+        return;
+
+    // A header defined twice keeps the sums of the first
+    for (int i = 0; i < v->heads->size; ++i) {
+        free(v->loop[i].site);
+        free(v->loop[i].site_array);
+    }
+
+    free_table(v->heads);
+    free_table(v->fns);
+    free(v->loop);
+    free(v->extra);
+    free(v);
+}
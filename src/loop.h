@@ -0,0 +1,76 @@
+// Iterations simulated before a loop counts as not ending
+#define LOOP_TRIPS  32768
+
+typedef struct Loop {
+    const char *why;    // Why the loop isn't unrolled, NULL if it is
+    int trips;          // Times the body runs
+    int factor;         // Copies of the body, trips when unrolled fully
+    int words;          // Estimated change in ROM words
+    long cycles;        // Estimated change in cycles over the whole loop
+} Loop;
+
+typedef struct Unroll {
+    struct Table *heads;    // Header labels of counted loops, as written
+    Loop *loop;             // By id in heads
+} Unroll;
+
+Unroll *plan_unroll(FileList *fl, int budget);
+const Loop *find_loop(const Unroll *u, const char *label);
+void free_unroll(Unroll *u);
+
+// Arrays a loop can walk with pointers of their own
+#define IV_ARRAYS  3
+
+// Iterations a loop is taken to run, to weigh setting up its pointers
+#define IV_TRIPS   16
+
+// Loop over a[i] with a pointer kept at a + i alongside the counter i
+typedef struct IvLoop {
+    const char *why;        // Why the loop is left as it is, NULL if it isn't
+    TokenList *head;        // Header label
+    TokenList *back;        // Last jump to it, which ends the loop
+    TokenList *test;        // Push of i starting the test
+    TokenList *step;        // Push of i starting its step
+    Memory mem;             // i
+    int num;
+    Memory bmem;            // What i is tested against, unchanged in the loop
+    int bnum;
+    int narray;
+    struct {
+        Memory mem;
+        int num;
+    } array[IV_ARRAYS];
+    int local;              // First local of the pointers, then a + what i
+                            // is tested against
+    int keep;               // i is read besides, so still has to be stepped
+    TokenList **site;       // First push of each a + i in the loop
+    int *site_array;        // Array each adds to
+    int nsite;
+    int words;              // Estimated change in ROM words
+    long cycles;            // Estimated change in cycles per iteration
+} IvLoop;
+
+typedef struct Ivs {
+    struct Table *heads;    // Header labels, as written
+    IvLoop *loop;           // By id in heads
+    struct Table *fns;      // Functions needing more locals for pointers
+    int *extra;             // By id in fns
+} Ivs;
+
+// Parts of a loop iv_code() writes instead
+typedef enum {
+    IV_INIT,    // Pointers set up before the header
+    IV_SITE,    // a + i
+    IV_TEST,    // i and what it is tested against
+    IV_STEP,    // Step of i
+} IvPart;
+
+// Most instructions iv_code() makes
+#define IV_CODE  (4 * (IV_ARRAYS + 1))
+
+Ivs *plan_ivs(FileList *fl, const struct CallConv *conv);
+const IvLoop *find_iv(const Ivs *v, const char *label);
+int iv_locals(const Ivs *v, const char *fn);
+int iv_code(const IvLoop *lp, IvPart part, int k, TokenList *code, CmdArg *argv,
+            TokenList *next);
+void free_ivs(Ivs *v);
@@ -4,14 +4,39 @@
 
 #include "lex.h"
 #include "prog.h"
+#include "table.h"
+#include "prof.h"
 #include "write.h"
+#include "analyze.h"
+#include "pipe.h"
+#include "load.h"
+#include "batch.h"
+#include "cfg.h"
+#include "stack.h"
+
+
+static char *long_opt(char *arg, const char *name, int argc, char **argv, int *i);
 
 
 int main(int argc, char **argv) {
 
     FileList *fl = new_file_list();
+    char **files = malloc(argc * sizeof(char*));
+    int nfiles = 0;
+    int pipeline = 0;
     char *fname = NULL;
+    char *imap = NULL;
+    char *rfile = NULL;
+    char *manifest = NULL;
+    char *lmap = NULL;
+    char *smap = NULL;
+    char *sfile = NULL;
+    int analyze = 0;
+    char *val;
     FILE *fo;
+    WriteOptions opt = { 0 };
+
+    opt.jobs = 1;
 
     for (int i = 1; i < argc; ++i) {
         if (argv[i][0] == '-') {
@@ -34,13 +59,92 @@ int main(int argc, char **argv) {
 
                         break;
 
+                    case 'j':
+                        if (*(a + 1) != '\0') {
+                            val = a + 1;
+                        } else if (argv[i + 1]) {
+                            val = argv[++i];
+                        } else {
+                            fprintf(stderr,
+                                    "Error: -j option requires number of threads\n");
+                            exit(1);
+                        }
+
+                        opt.jobs = atoi(val);
+                        if (opt.jobs < 1) {
+                            fprintf(stderr,
+                                    "Error: -j option requires number of threads\n");
+                            exit(1);
+                        }
+
+                        a = NULL;
+                        break;
+
                     case 'h':
                         printf(
                             "%s [OPTIONS] [FILES] ...\n"
                             "\n"
                             "Options:\n"
                             "   -h  Print this help.\n"
+                            "   -j  Threads lexing and translating, 1 by default.\n"
+                            "       Experimental: only measured on one CPU so far,\n"
+                            "       where more threads are slower.\n"
                             "   -o  Output file. Print to stdout if none provided.\n"
+                            "\n"
+                            "   --analyze[=N]     Report opcode n-grams up to length N\n"
+                            "                     (default 3) instead of translating.\n"
+                            "   --pipeline        Lex, translate and write on separate\n"
+                            "                     threads, streaming the input.\n"
+                            "   --batch MANIFEST  Translate every program in MANIFEST,\n"
+                            "                     one `OUTPUT INPUT.vm ...` per line,\n"
+                            "                     overwriting outputs. Inputs shared by\n"
+                            "                     programs are lexed once, and translated\n"
+                            "                     once when listed first.\n"
+                            "   --instrument MAP  Count function entries, calls and loop\n"
+                            "                     iterations in RAM, writing the counter\n"
+                            "                     layout to MAP for `hackprof -m`. The\n"
+                            "                     counters take 2 words each from the top\n"
+                            "                     of the heap, which Memory.alloc doesn't\n"
+                            "                     keep clear of.\n"
+                            "   --profile FILE    Use an execution profile decoded by\n"
+                            "                     `hackprof -m`.\n"
+                            "   --remarks FILE    Write applied and missed optimizations\n"
+                            "                     to FILE as JSON.\n"
+                            "   --short-labels    Write labels as short base-36 ids.\n"
+                            "   --label-map FILE  With --short-labels, write the name\n"
+                            "                     behind each id to FILE.\n"
+                            "   --alloc-statics[=MAP]\n"
+                            "                     Give statics RAM addresses from 16,\n"
+                            "                     file by file, writing them to MAP.\n"
+                            "   --fast-calls      Call leaf functions taking up to 2\n"
+                            "                     arguments with them in R13 and R14,\n"
+                            "                     returning in D, instead of the standard\n"
+                            "                     convention.\n"
+                            "   --stack-report FILE\n"
+                            "                     Write the deepest each function takes\n"
+                            "                     the stack, calls included, to FILE.\n"
+                            "   --unroll[=WORDS]  Unroll loops over a counter with constant\n"
+                            "                     bounds, letting each grow the ROM by up\n"
+                            "                     to WORDS (default 128).\n"
+                            "   --strength-reduce Keep a pointer into each array a loop\n"
+                            "                     walks by its counter, stepped with it,\n"
+                            "                     instead of adding the two every time.\n"
+                            "   --inline-alloc    Allocate constant sizes inline from the\n"
+                            "                     region statics 0 and 1 of Memory bound,\n"
+                            "                     calling Memory.alloc once it runs out.\n"
+                            "   --alias           Keep registers and statics known over\n"
+                            "                     stores to locals, arguments, and this\n"
+                            "                     and that where they only hold references.\n"
+                            "   --dead-code       Drop code nothing reaches, and stores to\n"
+                            "                     locals, arguments and temp nothing reads.\n"
+                            "   --size            Favour fewer words over cycles: where\n"
+                            "                     branches end alike, write the end once\n"
+                            "                     and jump to it from the others. Without\n"
+                            "                     it, this is done in functions --profile\n"
+                            "                     shows are cold.\n"
+                            "   --self-calls      Enter methods past setting THIS from\n"
+                            "                     argument 0 when called on this, which\n"
+                            "                     THIS already holds.\n"
 
                             , argv[0]
                         );
@@ -50,16 +154,91 @@ int main(int argc, char **argv) {
 
                     case '-':
 
-                        if (*(a + 1) != '\0') {
-                            fprintf(stderr,
-                                    "Error on option '%s': Long arguments not supported\n",
-                                    argv[i]);
-                            a = NULL;
+                        if (*(a + 1) == '\0') {
+                            for (++i; i < argc; ++i)
+                                files[nfiles++] = argv[i];
+
+                        } else if ((val = long_opt(a + 1, "instrument", argc, argv, &i))) {
+                            imap = val;
+
+                        } else if ((val = long_opt(a + 1, "batch", argc, argv, &i))) {
+                            manifest = val;
+
+                        } else if (strcmp(a + 1, "short-labels") == 0) {
+                            opt.short_labels = 1;
+
+                        } else if ((val = long_opt(a + 1, "label-map", argc, argv, &i))) {
+                            lmap = val;
+
+                        } else if (strcmp(a + 1, "alloc-statics") == 0) {
+                            opt.alloc_statics = 1;
+
+                        } else if (strncmp(a + 1, "alloc-statics=", 14) == 0) {
+                            opt.alloc_statics = 1;
+                            smap = a + 15;
+
+                        } else if ((val = long_opt(a + 1, "stack-report", argc, argv, &i))) {
+                            sfile = val;
+
+                        } else if (strcmp(a + 1, "fast-calls") == 0) {
+                            opt.fast_calls = 1;
+
+                        } else if (strcmp(a + 1, "unroll") == 0) {
+                            opt.unroll = 128;
+
+                        } else if (strncmp(a + 1, "unroll=", 7) == 0) {
+                            opt.unroll = atoi(a + 8);
+                            if (opt.unroll < 1) {
+                                fprintf(stderr,
+                                        "Error: --unroll budget must be positive\n");
+                                exit(1);
+                            }
+
+                        } else if (strcmp(a + 1, "strength-reduce") == 0) {
+                            opt.reduce_ivs = 1;
+
+                        } else if (strcmp(a + 1, "inline-alloc") == 0) {
+                            opt.inline_alloc = 1;
+
+                        } else if (strcmp(a + 1, "alias") == 0) {
+                            opt.alias = 1;
+
+                        } else if (strcmp(a + 1, "dead-code") == 0) {
+                            opt.dead_code = 1;
+
+                        } else if (strcmp(a + 1, "size") == 0) {
+                            opt.size = 1;
+
+                        } else if (strcmp(a + 1, "self-calls") == 0) {
+                            opt.self_calls = 1;
+
+                        } else if (strcmp(a + 1, "pipeline") == 0) {
+                            pipeline = 1;
+
+                        } else if (strcmp(a + 1, "analyze") == 0) {
+                            analyze = 3;
+
+                        } else if (strncmp(a + 1, "analyze=", 8) == 0) {
+                            analyze = atoi(a + 9);
+                            if (analyze < 1) {
+                                fprintf(stderr,
+                                        "Error: --analyze n-gram length must be positive\n");
+                                exit(1);
+                            }
+
+                        } else if ((val = long_opt(a + 1, "remarks", argc, argv, &i))) {
+                            rfile = val;
+
+                        } else if ((val = long_opt(a + 1, "profile", argc, argv, &i))) {
+                            free_profile(opt.profile);
+                            opt.profile = load_profile(val);
 
                         } else {
-                            for (++i; i < argc; ++i)
-                                add_file(fl, argv[i]);
+                            fprintf(stderr,
+                                    "Invalid option '%s', ignoring\n", argv[i]);
                         }
+
+                        a = NULL;
                         break;
 
                     default:
@@ -71,11 +250,47 @@ int main(int argc, char **argv) {
                 if (a) ++a;
             }
         } else {
-            add_file(fl, argv[i]);
+            files[nfiles++] = argv[i];
+        }
+    }
+
+    if (pipeline && (imap || analyze || opt.alloc_statics || sfile || opt.fast_calls
+                || opt.unroll || opt.reduce_ivs || opt.alias || opt.dead_code
+                || opt.size || opt.self_calls)) {
+        fprintf(stderr,
+                "Error: --pipeline can't be used with --instrument, --analyze,\n"
+                "--alloc-statics, --stack-report, --fast-calls, --unroll,\n"
+                "--strength-reduce, --alias, --dead-code, --size or --self-calls\n");
+        exit(1);
+    }
+
+    if (manifest) {
+        if (nfiles || fname || pipeline || imap || analyze || rfile
+                || opt.short_labels || lmap || opt.alloc_statics || sfile
+                || opt.fast_calls || opt.unroll || opt.reduce_ivs || opt.alias
+                || opt.dead_code || opt.size || opt.self_calls) {
+            fprintf(stderr,
+                    "Error: --batch takes its files from the manifest, and can't be\n"
+                    "used with -o, --pipeline, --instrument, --analyze, --remarks,\n"
+                    "--short-labels, --alloc-statics, --stack-report, --fast-calls,\n"
+                    "--unroll, --strength-reduce, --alias, --dead-code, --size or\n"
+                    "--self-calls\n");
+            exit(1);
         }
+
+        batch_translate(stdout, manifest, &opt);
+
+        free_profile(opt.profile);
+        free_file_list(fl);
+        free(files);
+
+        return 0;
     }
 
-    if (!fl->tl) {
+    if (!pipeline)
+        load_files(fl, files, nfiles, opt.jobs);
+
+    if (!nfiles || (!pipeline && !fl->tl)) {
         fprintf(stderr,
                 "No input files given\n");
         exit(1);
@@ -90,7 +305,6 @@ int main(int argc, char **argv) {
                     fname);
             exit(1);
         }
-        fclose(fo);
 
         fo = fopen(fname, "w");
         if (!fo) {
@@ -104,8 +318,109 @@ int main(int argc, char **argv) {
         fo = stdout;
     }
 
-    write_file_list(fo, fl);
+    if (imap) {
+        opt.instrument = fopen(imap, "w");
+        if (!opt.instrument) {
+            fprintf(stderr,
+                    "Failed to open file '%s' for writing\n",
+                    imap);
+            exit(1);
+        }
+    }
+
+    if (rfile) {
+        opt.remarks = fopen(rfile, "w");
+        if (!opt.remarks) {
+            fprintf(stderr,
+                    "Failed to open file '%s' for writing\n",
+                    rfile);
+            exit(1);
+        }
+    }
+
+    if (lmap) {
+        if (!opt.short_labels) {
+            fprintf(stderr,
+                    "Error: --label-map needs --short-labels\n");
+            exit(1);
+        }
+
+        opt.label_map = fopen(lmap, "w");
+        if (!opt.label_map) {
+            fprintf(stderr,
+                    "Failed to open file '%s' for writing\n",
+                    lmap);
+            exit(1);
+        }
+    }
+
+    if (smap) {
+        opt.static_map = fopen(smap, "w");
+        if (!opt.static_map) {
+            fprintf(stderr,
+                    "Failed to open file '%s' for writing\n",
+                    smap);
+            exit(1);
+        }
+    }
+
+    if (sfile) {
+        FILE *fp = fopen(sfile, "w");
+        if (!fp) {
+            fprintf(stderr,
+                    "Failed to open file '%s' for writing\n",
+                    sfile);
+            exit(1);
+        }
+
+        stack_report(fp, fl);
+        fclose(fp);
+    }
+
+    if (pipeline) {
+        pipe_translate(fo, files, nfiles, &opt);
+    } else if (analyze) {
+        analyze_file_list(fo, fl, analyze);
+    } else {
+        write_file_list(fo, fl, &opt);
+    }
+    free_file_list(fl);
     fclose(fo);
 
+    if (opt.instrument)
+        fclose(opt.instrument);
+    if (opt.remarks)
+        fclose(opt.remarks);
+    if (opt.label_map)
+        fclose(opt.label_map);
+    if (opt.static_map)
+        fclose(opt.static_map);
+    free_profile(opt.profile);
+    free(files);
+
     return 0;
 }
+
+
+// Match `--name value` or `--name=value`, returning the value
+char *long_opt(char *arg, const char *name, int argc, char **argv, int *i) {
+
+    int len = strlen(name);
+
+    if (strncmp(arg, name, len) != 0)
+        return NULL;
+
+    if (arg[len] == '=')
+        return arg + len + 1;
+
+    if (arg[len] != '\0')
+        return NULL;
+
+    if (*i + 1 >= argc) {
+        fprintf(stderr,
+                "Error: --%s option requires a value\n", name);
+        exit(1);
+    }
+
+    return argv[++(*i)];
+}
@@ -0,0 +1,310 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "model.h"
+
+/**
+ * Register contents.
+ *
+ * Follows each Hack instruction the writer emits symbolically, so an
+ * instruction that would leave A, D and RAM as they are is dropped:
+ * an `@SP` when A already holds 0, a `D=M` when D already holds that
+ * word, and so on.
+ *
+ * Values are constants, symbol addresses, or what a word held when it
+ * was read, each plus an offset. Words at known addresses remember what
+ * was last read from or written to them. A write through SP's value
+ * only touches the stack, so it leaves registers and statics known, as
+ * does one the writer marks high beforehand; a write through any other
+ * pointer forgets every word.
+ *
+ * Nothing is known at a label, since control can arrive from anywhere.
+ *
+ */
+
+static const struct {
+    const char *name;
+    int addr;
+} predefined[] = {
+    { "SP", 0 }, { "LCL", 1 }, { "ARG", 2 }, { "THIS", 3 }, { "THAT", 4 },
+    { "SCREEN", 16384 }, { "KBD", 24576 },
+};
+
+static RegVal address(RegModel *m, const char *sym);
+static RegVal comp(RegModel *m, const char *c);
+static RegVal operand(RegModel *m, char x);
+static RegVal read(RegModel *m, RegVal at);
+static void write(RegModel *m, RegVal at, RegVal val);
+static RegVal plus(RegVal v, int n);
+static RegVal num(int n);
+static RegVal unknown();
+static int same(RegVal x, RegVal y);
+static int wrap(int n);
+
+
+void model_reset(RegModel *m) {
+    m->a = unknown();
+    m->d = unknown();
+    m->nfact = 0;
+    m->nsym = 0;
+    m->reads = 0;
+    m->high = 0;
+}
+
+// Take ins into account. Returns 0 if it changes nothing, so needn't be
+// written.
+int model_step(RegModel *m, const char *ins) {
+
+    // A-instruction
+    if (ins[0] == '@') {
+        RegVal a = address(m, ins + 1);
+        int keep = !same(a, m->a);
+
+        m->a = a;
+        return keep;
+    }
+
+    // C-instruction, dest=comp;jump with any spaces
+    char buf[32];
+    int len = 0;
+    for (const char *c = ins; *c && len < (int) sizeof(buf) - 1; ++c)
+        if (*c != ' ')
+            buf[len++] = *c;
+    buf[len] = '\0';
+
+    char *dest = "";
+    char *c = buf;
+    char *jump = NULL;
+
+    for (char *p = buf; *p; ++p) {
+        if (*p == '=') {
+            *p = '\0';
+            dest = buf;
+            c = p + 1;
+        } else if (*p == ';') {
+            *p = '\0';
+            jump = p + 1;
+            break;
+        }
+    }
+
+    RegVal at = m->a;
+    RegVal val = comp(m, c);
+
+    int keep = jump != NULL;
+
+    if (strchr(dest, 'M')) {
+        // Writing what the word already holds is no write
+        int i;
+        for (i = 0; i < m->nfact; ++i)
+            if (same(m->fact[i].at, at))
+                break;
+
+        if (at.kind != VAL_NUM || i == m->nfact || !same(m->fact[i].val, val))
+            keep = 1;
+
+        write(m, at, val);
+        m->high = 0;
+    }
+
+    if (strchr(dest, 'A')) {
+        keep |= !same(m->a, val);
+        m->a = val;
+    }
+
+    if (strchr(dest, 'D')) {
+        keep |= !same(m->d, val);
+        m->d = val;
+    }
+
+    return keep;
+}
+
+
+RegVal address(RegModel *m, const char *sym) {
+
+    if (isdigit((unsigned char) sym[0]))
+        return num(atoi(sym));
+
+    if (sym[0] == 'R' && isdigit((unsigned char) sym[1])) {
+        char *end;
+        long r = strtol(sym + 1, &end, 10);
+        if (!*end && r < 16)
+            return num(r);
+    }
+
+    for (size_t i = 0; i < sizeof(predefined) / sizeof(predefined[0]); ++i)
+        if (strcmp(sym, predefined[i].name) == 0)
+            return num(predefined[i].addr);
+
+    for (int i = 0; i < m->nsym; ++i) {
+        if (strcmp(sym, m->sym[i]) == 0) {
+            RegVal r = { VAL_NUM, i, 0 };
+            return r;
+        }
+    }
+
+    if (m->nsym == MODEL_SYMS || strlen(sym) >= MODEL_SYMLEN)
+        return unknown();
+
+    strcpy(m->sym[m->nsym], sym);
+
+    RegVal r = { VAL_NUM, m->nsym++, 0 };
+    return r;
+}
+
+RegVal comp(RegModel *m, const char *c) {
+
+    if (strcmp(c, "0") == 0)
+        return num(0);
+    if (strcmp(c, "1") == 0)
+        return num(1);
+    if (strcmp(c, "-1") == 0)
+        return num(-1);
+
+    int len = strlen(c);
+
+    if (len == 1)
+        return operand(m, c[0]);
+
+    if (len == 2) {
+        RegVal x = operand(m, c[1]);
+        if (x.kind != VAL_NUM || x.base >= 0)
+            return unknown();
+
+        return num(c[0] == '!' ? ~x.off : -x.off);
+    }
+
+    if (len != 3)
+        return unknown();
+
+    RegVal x = operand(m, c[0]);
+    RegVal y = c[2] == '1' ? num(1) : operand(m, c[2]);
+
+    int xconst = x.kind == VAL_NUM && x.base < 0;
+    int yconst = y.kind == VAL_NUM && y.base < 0;
+
+    switch (c[1]) {
+        case '+':
+            if (yconst)
+                return plus(x, y.off);
+            if (xconst)
+                return plus(y, x.off);
+            return unknown();
+
+        case '-':
+            if (yconst)
+                return plus(x, -y.off);
+
+            // Offsets from the same thing
+            if (x.kind != VAL_UNKNOWN && x.kind == y.kind && x.base == y.base)
+                return num(x.off - y.off);
+            return unknown();
+
+        case '&':
+            return xconst && yconst ? num(x.off & y.off) : unknown();
+
+        case '|':
+            return xconst && yconst ? num(x.off | y.off) : unknown();
+
+        default:
+            return unknown();
+    }
+}
+
+RegVal operand(RegModel *m, char x) {
+    switch (x) {
+        case 'A': return m->a;
+        case 'D': return m->d;
+        case 'M': return read(m, m->a);
+        default:  return unknown();
+    }
+}
+
+RegVal read(RegModel *m, RegVal at) {
+
+    RegVal r = { VAL_LOAD, m->reads++, 0 };
+
+    if (at.kind != VAL_NUM)
+        return r;
+
+    for (int i = 0; i < m->nfact; ++i)
+        if (same(m->fact[i].at, at))
+            return m->fact[i].val;
+
+    if (at.base < 0 && at.off == 0)
+        r.kind = VAL_STACK;
+
+    write(m, at, r);
+
+    return r;
+}
+
+void write(RegModel *m, RegVal at, RegVal val) {
+
+    if (at.kind == VAL_NUM) {
+        int i;
+        for (i = 0; i < m->nfact; ++i)
+            if (same(m->fact[i].at, at))
+                break;
+
+        if (val.kind == VAL_UNKNOWN) {
+            if (i < m->nfact)
+                m->fact[i] = m->fact[--m->nfact];
+            return;
+        }
+
+        // Forget the oldest when full
+        if (i == MODEL_FACTS) {
+            memmove(m->fact, m->fact + 1, (MODEL_FACTS - 1) * sizeof(m->fact[0]));
+            i = MODEL_FACTS - 1;
+        } else if (i == m->nfact) {
+            ++m->nfact;
+        }
+
+        m->fact[i].at = at;
+        m->fact[i].val = val;
+
+        return;
+    }
+
+    // The stack is above the registers and statics, and below the heap
+    // and anything else that is at a known address, as is whatever a
+    // write marked high reaches
+    int keep = 0;
+    if (at.kind == VAL_STACK || m->high)
+        for (int i = 0; i < m->nfact; ++i)
+            if (m->fact[i].at.base >= 0 || m->fact[i].at.off < 256)
+                m->fact[keep++] = m->fact[i];
+
+    m->nfact = keep;
+}
+
+RegVal plus(RegVal v, int n) {
+    if (v.kind != VAL_UNKNOWN)
+        v.off = wrap(v.off + n);
+
+    return v;
+}
+
+RegVal num(int n) {
+    RegVal r = { VAL_NUM, -1, wrap(n) };
+    return r;
+}
+
+RegVal unknown() {
+    RegVal r = { VAL_UNKNOWN, -1, 0 };
+    return r;
+}
+
+int same(RegVal x, RegVal y) {
+    return x.kind != VAL_UNKNOWN
+        && x.kind == y.kind && x.base == y.base && x.off == y.off;
+}
+
+// Hack words are 16 bits
+int wrap(int n) {
+    return (short) n;
+}
@@ -0,0 +1,34 @@
+#define MODEL_SYMS    8
+#define MODEL_SYMLEN  64
+#define MODEL_FACTS   8
+
+typedef enum {
+    VAL_UNKNOWN,
+    VAL_NUM,    // Constant, or address of a symbol plus off
+    VAL_LOAD,   // What some word held when read, plus off
+    VAL_STACK,  // What SP held when read, plus off
+} ValKind;
+
+typedef struct RegVal {
+    ValKind kind;
+    int base;   // Symbol for VAL_NUM, -1 if constant; read for the others
+    int off;
+} RegVal;
+
+// What A, D and some RAM words are known to hold within a basic block
+typedef struct RegModel {
+    RegVal a;
+    RegVal d;
+    struct {
+        RegVal at;
+        RegVal val;
+    } fact[MODEL_FACTS];
+    int nfact;
+    char sym[MODEL_SYMS][MODEL_SYMLEN];
+    int nsym;
+    int reads;
+    int high;   // Next write through a pointer misses registers and statics
+} RegModel;
+
+void model_reset(RegModel *m);
+int model_step(RegModel *m, const char *ins);
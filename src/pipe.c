@@ -0,0 +1,194 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lex.h"
+#include "prog.h"
+#include "table.h"
+#include "prof.h"
+#include "write.h"
+#include "ring.h"
+#include "pipe.h"
+
+/**
+ * Pipelined translation.
+ *
+ * A lexer thread reads the input files and pushes batches of tokens,
+ * cut before a function once PIPE_BATCH tokens are reached, through a
+ * ring to a codegen thread. That translates each batch into a buffer
+ * and pushes it through a second ring to the calling thread, which
+ * writes the buffers out in order. A NULL ends each ring.
+ *
+ * Tokens are freed as soon as they are translated, so memory use stays
+ * flat however large the input.
+ *
+ */
+
+#define PIPE_BATCH  4096
+#define PIPE_DEPTH  64
+
+typedef struct Batch {
+    char *fname;
+    TokenList *tl;
+} Batch;
+
+typedef struct Buffer {
+    char *data;
+    size_t len;
+} Buffer;
+
+typedef struct Pipe {
+    char **files;
+    int nfiles;
+    const WriteOptions *opt;
+    Ring *tokens;
+    Ring *output;
+} Pipe;
+
+static Batch *new_batch(char *fname);
+static void *lex_stage(void *arg);
+static void *codegen_stage(void *arg);
+
+
+void pipe_translate(FILE *fp, char **files, int n, const WriteOptions *opt) {
+
+    Pipe p = { files, n, opt, new_ring(PIPE_DEPTH), new_ring(PIPE_DEPTH) };
+    pthread_t lexer, codegen;
+
+    if (pthread_create(&lexer, NULL, lex_stage, &p) != 0
+            || pthread_create(&codegen, NULL, codegen_stage, &p) != 0) {
+        fprintf(stderr, "Failed to start thread\n");
+        exit(1);
+    }
+
+    Buffer *buf;
+    while ((buf = ring_pop(p.output))) {
+        fwrite(buf->data, 1, buf->len, fp);
+
+        free(buf->data);
+        free(buf);
+    }
+
+    pthread_join(lexer, NULL);
+    pthread_join(codegen, NULL);
+
+    free_ring(p.tokens);
+    free_ring(p.output);
+}
+
+
+Batch *new_batch(char *fname) {
+
+    Batch *r = malloc(sizeof(Batch));
+    if (!r || !(r->fname = malloc(strlen(fname) + 1))) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    strcpy(r->fname, fname);
+    r->tl = NULL;
+
+    return r;
+}
+
+void *lex_stage(void *arg) {
+
+    Pipe *p = arg;
+
+    for (int i = 0; i < p->nfiles; ++i) {
+
+        char *fname = vm_basename(p->files[i]);
+
+        FILE *fi = fopen(p->files[i], "r");
+        if (!fi) {
+            fprintf(stderr, "Failed to load file '%s'\n", p->files[i]);
+            exit(1);
+        }
+
+        Batch *b = new_batch(fname);
+        TokenList *prev = NULL;
+        int count = 0;
+
+        int failure = 0;
+        int lineno = 1;
+
+        TokenList *inst;
+        while ((inst = scan_next(fi, &lineno, &failure, NULL))) {
+
+            if (inst->cmd == FUNCTION && count >= PIPE_BATCH) {
+                ring_push(p->tokens, b);
+
+                b = new_batch(fname);
+                prev = NULL;
+                count = 0;
+            }
+
+            if (prev)
+                prev->next = inst;
+            else
+                b->tl = inst;
+
+            prev = inst;
+            ++count;
+        }
+
+        fclose(fi);
+
+        if (failure) {
+            fprintf(stderr,
+                    "Failed to compile\n");
+            exit(1);
+        }
+
+        if (count) {
+            ring_push(p->tokens, b);
+        } else {
+            free(b->fname);
+            free(b);
+        }
+
+        free(fname);
+    }
+
+    ring_push(p->tokens, NULL);
+
+    return NULL;
+}
+
+void *codegen_stage(void *arg) {
+
+    Pipe *p = arg;
+    Buffer *buf = malloc(sizeof(Buffer));
+
+    FILE *fp = open_memstream(&buf->data, &buf->len);
+    WriteStream *s = write_begin(fp, p->opt);
+    fclose(fp);
+
+    ring_push(p->output, buf);
+
+    Batch *b;
+    while ((b = ring_pop(p->tokens))) {
+        buf = malloc(sizeof(Buffer));
+
+        fp = open_memstream(&buf->data, &buf->len);
+        if (!fp) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+
+        write_tokens(s, fp, b->tl, b->fname);
+        fclose(fp);
+
+        ring_push(p->output, buf);
+
+        free_token_list(b->tl);
+        free(b->fname);
+        free(b);
+    }
+
+    write_end(s);
+    ring_push(p->output, NULL);
+
+    return NULL;
+}
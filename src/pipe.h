@@ -0,0 +1 @@
+void pipe_translate(FILE *fp, char **files, int n, const WriteOptions *opt);
@@ -0,0 +1,121 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+/**
+ * Work-stealing thread pool.
+ *
+ * Tasks 0..ntasks-1 are split into one contiguous range per worker.
+ * A worker takes tasks from the bottom of its own range and, once that
+ * is empty, steals from the top of the others'. Tasks never spawn more
+ * tasks, so a worker that finds every range empty is done.
+ *
+ */
+
+typedef struct Deque {
+    pthread_mutex_t lock;
+    int top;
+    int bottom;
+} Deque;
+
+typedef struct Pool {
+    int nthreads;
+    Deque *dq;
+    PoolTask task;
+    void *ctx;
+} Pool;
+
+typedef struct Worker {
+    Pool *pool;
+    int id;
+} Worker;
+
+static int take(Deque *dq, int bottom);
+static void *work(void *arg);
+
+
+void pool_run(int nthreads, int ntasks, PoolTask task, void *ctx) {
+
+    if (nthreads > ntasks)
+        nthreads = ntasks;
+
+    if (nthreads <= 1) {
+        for (int i = 0; i < ntasks; ++i)
+            task(ctx, i);
+        return;
+    }
+
+    Pool pool = { nthreads, malloc(nthreads * sizeof(Deque)), task, ctx };
+    Worker *wk = malloc(nthreads * sizeof(Worker));
+    pthread_t *th = malloc(nthreads * sizeof(pthread_t));
+
+    if (!pool.dq || !wk || !th) {
+        fprintf(stderr, "Failed to allocate thread pool\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_mutex_init(&pool.dq[i].lock, NULL);
+        pool.dq[i].top    = (long) ntasks * i / nthreads;
+        pool.dq[i].bottom = (long) ntasks * (i + 1) / nthreads;
+
+        wk[i].pool = &pool;
+        wk[i].id = i;
+    }
+
+    // The calling thread is worker 0
+    for (int i = 1; i < nthreads; ++i) {
+        if (pthread_create(&th[i], NULL, work, &wk[i]) != 0) {
+            fprintf(stderr, "Failed to start thread\n");
+            exit(1);
+        }
+    }
+
+    work(&wk[0]);
+
+    for (int i = 1; i < nthreads; ++i)
+        pthread_join(th[i], NULL);
+
+    for (int i = 0; i < nthreads; ++i)
+        pthread_mutex_destroy(&pool.dq[i].lock);
+
+    free(th);
+    free(wk);
+    free(pool.dq);
+}
+
+
+int take(Deque *dq, int bottom) {
+    int r = -1;
+
+    pthread_mutex_lock(&dq->lock);
+
+    if (dq->top < dq->bottom)
+        r = bottom ? --dq->bottom : dq->top++;
+
+    pthread_mutex_unlock(&dq->lock);
+
+    return r;
+}
+
+void *work(void *arg) {
+
+    Worker *wk = arg;
+    Pool *pool = wk->pool;
+
+    for (;;) {
+        int i = take(&pool->dq[wk->id], 1);
+
+        for (int k = 1; i < 0 && k < pool->nthreads; ++k)
+            i = take(&pool->dq[(wk->id + k) % pool->nthreads], 0);
+
+        if (i < 0)
+            break;
+
+        pool->task(pool->ctx, i);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,3 @@
+typedef void (*PoolTask)(void *ctx, int i);
+
+void pool_run(int nthreads, int ntasks, PoolTask task, void *ctx);
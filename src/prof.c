@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "table.h"
+#include "prof.h"
+
+/**
+ * Execution profiles.
+ *
+ * One counter per line, as decoded by `hackprof -m` from the RAM of an
+ * instrumented build:
+ *
+ *     fn Main.main 1
+ *     call Main.main Math.multiply 200
+ *     loop Main.main$WHILE_EXP0 3000
+ *
+ * The key is everything before the trailing count.
+ *
+ */
+
+
+Profile *load_profile(char *fname) {
+
+    FILE *fp = fopen(fname, "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to load profile '%s'\n", fname);
+        exit(1);
+    }
+
+    Profile *r = malloc(sizeof(Profile));
+    r->keys  = new_table();
+    r->count = NULL;
+
+    int cap = 0;
+    int line = 0;
+    char buf[1024];
+
+    while (fgets(buf, sizeof(buf), fp)) {
+        ++line;
+
+        char *end = buf + strlen(buf);
+        while (end > buf && (end[-1] == '\n' || end[-1] == ' '))
+            *(--end) = '\0';
+
+        if (buf[0] == '\0' || buf[0] == '#')
+            continue;
+
+        char *num = strrchr(buf, ' ');
+        if (!num) {
+            fprintf(stderr, "Malformed profile line %d in '%s'\n", line, fname);
+            exit(1);
+        }
+        *num++ = '\0';
+
+        int id = table_intern(r->keys, buf);
+        if (id >= cap) {
+            cap = cap ? cap * 2 : 64;
+            r->count = realloc(r->count, cap * sizeof(unsigned long));
+            if (!r->count) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                exit(1);
+            }
+        }
+
+        r->count[id] = strtoul(num, NULL, 10);
+    }
+
+    fclose(fp);
+
+    return r;
+}
+
+void free_profile(Profile *p) {
+    if (p) {
+        free_table(p->keys);
+        free(p->count);
+        free(p);
+    }
+}
+
+long prof_count(Profile *p, const char *kind, const char *name) {
+
+    if (!p)
+        return -1;
+
+    char *key = malloc(strlen(kind) + strlen(name) + 2);
+    sprintf(key, "%s %s", kind, name);
+
+    int id = table_find(p->keys, key);
+    free(key);
+
+    return id >= 0 ? (long) p->count[id] : -1;
+}
@@ -0,0 +1,8 @@
+typedef struct Profile {
+    Table *keys;
+    unsigned long *count;
+} Profile;
+
+Profile *load_profile(char *fname);
+void free_profile(Profile *p);
+long prof_count(Profile *p, const char *kind, const char *name);
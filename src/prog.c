@@ -20,82 +20,70 @@ FileList *new_file_list() {
 void free_file_list(FileList *fl) {
     FileList *n;
 
-    if (fl) {
+    for (; fl; fl = n) {
         n = fl->next;
 
         free(fl->name);
         free_token_list(fl->tl);
         free(fl);
-
-        if (n)
-            free_file_list(n);
     }
 }
 
-void add_file(FileList *fl, char *name) {
+// Name of a .vm file without directory and extension, as used for
+// static symbols. Exits on anything that isn't a .vm file.
+char *vm_basename(char *name) {
 
-    // Check if this is the last item
-    if (!fl->next && !fl->name) {
+    char *r = vm_name(name);
 
-        // Load filename
-        char *basename = NULL;
-        char *ext = NULL;
+    if (!r) {
+        fprintf(stderr,
+                "Invalid filename '%s' provided. Extension must be .vm\n", name);
+        exit(1);
+    }
 
-        // Look for extension
-        int base = 0;
-        for (int i = 0; name[i] != '\0'; ++i)
-            if (name[i] == '/') // NOTE: Windows path separator unsupported ATM
-                base = i + 1;
+    return r;
+}
 
-        for (int i = base; name[i] != '\0'; ++i) {
-            if (name[i] == '.') {
+// As vm_basename(), but NULL on anything that isn't a .vm file
+char *vm_name(const char *name) {
 
-                int len = 0;
+    char *basename = NULL;
+    char *ext = NULL;
 
-                // basename
-                len = i - base;
-                basename = malloc((len + 1) * sizeof(char));
-                basename[len] = '\0';
-                strncpy(basename, &name[base], len);
+    // Look for extension
+    int base = 0;
+    for (int i = 0; name[i] != '\0'; ++i)
+        if (name[i] == '/') // NOTE: Windows path separator unsupported ATM
+            base = i + 1;
 
-                // extension
-                len = strlen(name) - (i + 1);
-                ext = malloc((len + 1) * sizeof(char));
-                ext[len] = '\0';
-                strncpy(ext, &name[i+1], len);
+    for (int i = base; name[i] != '\0'; ++i) {
+        if (name[i] == '.') {
 
-                break;
-            }
-        }
+            int len = 0;
 
-        if (!basename || !ext || (strcmp("vm", ext) != 0)) {
-            fprintf(stderr,
-                    "Invalid filename '%s' provided. Extension must be .vm\n", name);
-            exit(1);
-        }
+            // basename
+            len = i - base;
+            basename = malloc((len + 1) * sizeof(char));
+            basename[len] = '\0';
+            strncpy(basename, &name[base], len);
 
-        free(ext);
-        fl->name = basename;
+            // extension
+            len = strlen(name) - (i + 1);
+            ext = malloc((len + 1) * sizeof(char));
+            ext[len] = '\0';
+            strncpy(ext, &name[i+1], len);
 
-        // Read the file
-        // Load token list
-        FILE *fi = fopen(name, "r");
-
-        if (!fi) {
-            fprintf(stderr, "Failed to load file '%s'\n", name);
-            exit(1);
+            break;
         }
+    }
 
-        fl->tl = scan_stream(fi);
+    if (!basename || !ext || (strcmp("vm", ext) != 0)) {
+        free(basename);
+        free(ext);
+        return NULL;
+    }
 
-        fclose(fi);
+    free(ext);
 
-    } else {
-        if (fl->next) {
-            add_file(fl->next, name);
-        } else {
-            fl->next = new_file_list();
-            add_file(fl->next, name);
-        }
-    }
+    return basename;
 }
@@ -6,4 +6,5 @@ typedef struct FileList {
 
 FileList *new_file_list();
 void free_file_list(FileList *fl);
-void add_file(FileList *fl, char *name);
+char *vm_basename(char *name);
+char *vm_name(const char *name);
@@ -0,0 +1,114 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "remark.h"
+
+/**
+ * Optimization remarks.
+ *
+ * Every pass reports what it did, and what it could have done but
+ * didn't, as one JSON object per VM source line:
+ *
+ *     {"pass": "fusion", "status": "missed", "file": "Main", "line": 12,
+ *      "function": "Main.main", "message": "...",
+ *      "reason": "label between ops", "words": -7, "cycles": -7,
+ *      "hotness": 200}
+ *
+ * hotness is the entry count of the function from --profile, if any.
+ * Remarks are collected one per line, possibly by several threads into
+ * their own buffers, and joined into a single JSON array at the end.
+ *
+ */
+
+static void json_str(FILE *fp, const char *s);
+
+
+void remark(FILE *fp, Remark *r, const char *reason, const char *fmt, ...) {
+
+    if (!fp)
+        return;
+
+    char msg[512];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    fputs("{\"pass\": ", fp);
+    json_str(fp, r->pass);
+    fprintf(fp, ", \"status\": \"%s\"",
+            r->kind == REMARK_APPLIED ? "applied" : "missed");
+
+    fputs(", \"file\": ", fp);
+    json_str(fp, r->file);
+    fprintf(fp, ", \"line\": %d", r->line);
+
+    fputs(", \"function\": ", fp);
+    if (r->fn)
+        json_str(fp, r->fn);
+    else
+        fputs("null", fp);
+
+    fputs(", \"message\": ", fp);
+    json_str(fp, msg);
+
+    if (reason) {
+        fputs(", \"reason\": ", fp);
+        json_str(fp, reason);
+    }
+
+    fprintf(fp, ", \"words\": %d, \"cycles\": %ld", r->words, r->cycles);
+
+    if (r->hotness >= 0)
+        fprintf(fp, ", \"hotness\": %ld", r->hotness);
+
+    fputs("}\n", fp);
+}
+
+// Join buffers of remarks, one per line, into a JSON array
+void remark_array(FILE *fp, char *const *lines, int n) {
+
+    int count = 0;
+
+    fputs("[", fp);
+
+    for (int i = 0; i < n; ++i) {
+        for (char *l = lines[i]; l && *l; ) {
+            char *end = strchr(l, '\n');
+            int len = end ? end - l : (int) strlen(l);
+
+            fputs(count++ ? ",\n  " : "\n  ", fp);
+            fwrite(l, 1, len, fp);
+
+            l += end ? len + 1 : len;
+        }
+    }
+
+    fputs(count ? "\n]\n" : "]\n", fp);
+}
+
+
+void json_str(FILE *fp, const char *s) {
+    fputc('"', fp);
+
+    for (; s && *s; ++s) {
+        switch (*s) {
+            case '"':  fputs("\\\"", fp); break;
+            case '\\': fputs("\\\\", fp); break;
+            case '\t': fputs("\\t", fp);  break;
+            case '\n': fputs("\\n", fp);  break;
+
+            default:
+                if ((unsigned char) *s < 0x20)
+                    fprintf(fp, "\\u%04x", *s);
+                else
+                    fputc(*s, fp);
+                break;
+        }
+    }
+
+    fputc('"', fp);
+}
@@ -0,0 +1,18 @@
+typedef enum {
+    REMARK_APPLIED,
+    REMARK_MISSED,
+} RemarkKind;
+
+typedef struct Remark {
+    const char *pass;
+    RemarkKind kind;
+    const char *file;
+    int line;
+    const char *fn;
+    int words;      // Estimated change in ROM words, negative is smaller
+    long cycles;    // Estimated change in cycles per execution
+    long hotness;   // Entry count of fn from the profile, -1 if unknown
+} Remark;
+
+void remark(FILE *fp, Remark *r, const char *reason, const char *fmt, ...);
+void remark_array(FILE *fp, char *const *lines, int n);
@@ -0,0 +1,66 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ring.h"
+
+/**
+ * Lock-free single producer, single consumer ring.
+ *
+ * head is only written by the consumer and tail only by the producer.
+ * Both run freely and are reduced modulo the size, a power of two, on
+ * use. Slots are published with a release store of tail and handed back
+ * with a release store of head. Either side yields while the ring is
+ * full or empty.
+ *
+ */
+
+
+Ring *new_ring(unsigned size) {
+
+    // Round up to a power of two
+    unsigned n = 2;
+    while (n < size)
+        n <<= 1;
+
+    Ring *r = malloc(sizeof(Ring));
+    if (!r || !(r->slot = malloc(n * sizeof(void*)))) {
+        fprintf(stderr, "Failed to allocate Ring\n");
+        exit(1);
+    }
+
+    r->size = n;
+    r->head = 0;
+    r->tail = 0;
+
+    return r;
+}
+
+void free_ring(Ring *r) {
+    if (r) {
+        free(r->slot);
+        free(r);
+    }
+}
+
+void ring_push(Ring *r, void *item) {
+    unsigned tail = r->tail;
+
+    while (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->size)
+        sched_yield();
+
+    r->slot[tail & (r->size - 1)] = item;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void *ring_pop(Ring *r) {
+    unsigned head = r->head;
+
+    while (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head)
+        sched_yield();
+
+    void *item = r->slot[head & (r->size - 1)];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+    return item;
+}
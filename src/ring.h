@@ -0,0 +1,11 @@
+typedef struct Ring {
+    unsigned size;
+    void **slot;
+    unsigned head __attribute__((aligned(64)));  // Next slot to pop
+    unsigned tail __attribute__((aligned(64)));  // Next slot to push
+} Ring;
+
+Ring *new_ring(unsigned size);
+void free_ring(Ring *r);
+void ring_push(Ring *r, void *item);
+void *ring_pop(Ring *r);
@@ -0,0 +1,207 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lex.h"
+#include "prog.h"
+#include "table.h"
+#include "self.h"
+
+/**
+ * Calls on this.
+ *
+ * Every method starts with `push argument 0; pop pointer 0`. A method
+ * calling another on its own object pushes `pointer 0` as argument 0,
+ * and write_call() leaves THIS as it is, so the callee sets THIS to what
+ * it already holds.
+ *
+ * Methods defined once that start this way get a second entry past
+ * setting THIS, and calls whose argument 0 is pushed from pointer 0 jump
+ * there. Nothing between the push and the call may pop pointer 0. Calls
+ * in the arguments may set THIS, but put it back before returning.
+ *
+ * Values on the stack are only followed from one label or jump to the
+ * next, which Jack's arguments never cross.
+ *
+ */
+
+// Values on the stack followed at once, deeper ones aren't this
+#define SELF_STACK  64
+
+static int is_method(const TokenList *inst);
+static void add(Selfs *s, int *cap, const TokenList *call);
+static int by_addr(const void *x, const void *y);
+
+
+Selfs *plan_selfs(FileList *fl) {
+
+    Selfs *s = malloc(sizeof(Selfs));
+    if (!s) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    s->names = new_table();
+    s->site = NULL;
+    s->nsite = 0;
+
+    // Methods, and how often each function is defined
+    Table *defs = new_table();
+    int *ndef = NULL;
+    char *method = NULL;
+    int cap = 0;
+
+    for (FileList *it = fl; it; it = it->next) {
+        for (TokenList *inst = it->tl; inst; inst = inst->next) {
+            if (inst->cmd != FUNCTION)
+                continue;
+
+            int known = defs->size;
+            int id = table_intern(defs, inst->argv[0].name);
+
+            if (id == cap) {
+                cap = cap ? cap * 2 : 256;
+                ndef = realloc(ndef, cap * sizeof(int));
+                method = realloc(method, cap);
+
+                if (!ndef || !method) {
+                    fprintf(stderr, "Failed to allocate memory\n");
+                    exit(1);
+                }
+            }
+
+            if (defs->size != known) {
+                ndef[id] = 0;
+                method[id] = 1;
+            }
+
+            ++ndef[id];
+            method[id] &= is_method(inst);
+        }
+    }
+
+    char stack[SELF_STACK];
+    int scap = 0;
+
+    for (FileList *it = fl; it; it = it->next) {
+        int depth = 0;
+
+        for (TokenList *inst = it->tl; inst; inst = inst->next) {
+            Memory mem = inst->argc > 0 ? inst->argv[0].mem : CONSTANT;
+            int num = inst->argc > 1 ? inst->argv[1].num : 0;
+            char v = 0;
+
+            switch (inst->cmd) {
+                case PUSH:
+                    v = mem == POINTER && num == 0;
+                    break;
+
+                case POP:
+                    if (depth)
+                        --depth;
+
+                    if (mem == POINTER && num == 0)
+                        memset(stack, 0, depth);
+                    continue;
+
+                case ARITHMETIC:
+                    if (inst->argv[0].op != NEG && inst->argv[0].op != NOT && depth)
+                        --depth;
+                    if (depth)
+                        --depth;
+                    break;
+
+                case CALL:
+                    if (num > 0 && depth >= num && stack[depth - num]) {
+                        int id = table_find(defs, inst->argv[0].name);
+
+                        if (id >= 0 && method[id] && ndef[id] == 1) {
+                            table_intern(s->names, inst->argv[0].name);
+                            add(s, &scap, inst);
+                        }
+                    }
+
+                    depth = depth > num ? depth - num : 0;
+                    break;
+
+                default:
+                    depth = 0;
+                    continue;
+            }
+
+            if (depth == SELF_STACK) {
+                memmove(stack, stack + 1, SELF_STACK - 1);
+                --depth;
+            }
+
+            stack[depth++] = v;
+        }
+    }
+
+    free_table(defs);
+    free(ndef);
+    free(method);
+
+    if (s->nsite)
+        qsort(s->site, s->nsite, sizeof(TokenList*), by_addr);
+
+    return s;
+}
+
+// Whether function inst starts by setting THIS to argument 0
+int is_method(const TokenList *inst) {
+
+    const TokenList *push = inst->next;
+    const TokenList *pop = push ? push->next : NULL;
+
+    return pop && push->cmd == PUSH && push->argv[0].mem == ARGUMENT
+        && push->argv[1].num == 0 && pop->cmd == POP
+        && pop->argv[0].mem == POINTER && pop->argv[1].num == 0;
+}
+
+void add(Selfs *s, int *cap, const TokenList *call) {
+
+    if (s->nsite == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        s->site = realloc(s->site, *cap * sizeof(TokenList*));
+        if (!s->site) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+    }
+
+    s->site[s->nsite++] = call;
+}
+
+int by_addr(const void *x, const void *y) {
+    uintptr_t a = (uintptr_t) *(const TokenList *const *) x;
+    uintptr_t b = (uintptr_t) *(const TokenList *const *) y;
+
+    return (a > b) - (a < b);
+}
+
+// Number of fn's entry past setting THIS, -1 if it has none
+int self_entry(const Selfs *s, const char *fn) {
+    return s && fn ? table_find(s->names, fn) : -1;
+}
+
+// Number of the entry call passes this to, -1 if it doesn't
+int self_call(const Selfs *s, const TokenList *call) {
+
+    if (!s || !s->nsite)
+        return -1;
+
+    if (!bsearch(&call, s->site, s->nsite, sizeof(TokenList*), by_addr))
+        return -1;
+
+    return table_find(s->names, call->argv[0].name);
+}
+
+void free_selfs(Selfs *s) {
+    if (s) {
+        free_table(s->names);
+        free(s->site);
+        free(s);
+    }
+}
@@ -0,0 +1,11 @@
+// Methods entered past setting THIS, from the calls passing them this
+typedef struct Selfs {
+    struct Table *names;        // Methods with a second entry, by its number
+    const TokenList **site;     // Calls passing this, sorted by address
+    int nsite;
+} Selfs;
+
+Selfs *plan_selfs(FileList *fl);
+int self_entry(const Selfs *s, const char *fn);
+int self_call(const Selfs *s, const TokenList *call);
+void free_selfs(Selfs *s);
@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lex.h"
+#include "prog.h"
+#include "table.h"
+#include "cfg.h"
+#include "stack.h"
+
+/**
+ * Static stack depth.
+ *
+ * Follows the stack height through each function's control flow graph,
+ * from 0 after its locals, to find the deepest it gets by itself. A call
+ * reaches the height at the call, which holds the arguments, plus the
+ * frame write_call() saves and the callee's own worst case. Worst cases
+ * are found callees first, over the strongly connected components of
+ * the call graph, so recursion shows up however it is reached.
+ *
+ * The preamble jumps to Sys.init without a frame, so the stack spans
+ * STACK_BASE up to STACK_BASE + worst(Sys.init), and must stay below
+ * the heap at HEAP_BASE.
+ *
+ */
+
+#define STACK_BASE  256
+#define HEAP_BASE   2048
+#define FRAME_WORDS 5
+
+static const struct {
+    int note;
+    const char *text;
+} notes[] = {
+    { STACK_RECURSIVE,    "recursive" },
+    { STACK_UNKNOWN,      "calls unknown" },
+    { STACK_UNBOUNDED,    "unbounded loop" },
+    { STACK_INCONSISTENT, "inconsistent" },
+    { STACK_UNDERFLOW,    "underflow" },
+};
+
+typedef struct Site {
+    int height;         // Height at the call, arguments included
+    int callee;         // -1 if unknown
+} Site;
+
+typedef struct Depth {
+    int max;            // Deepest without calls, locals excluded
+    int worst;          // Deepest with calls, locals included
+    int note;
+    Site *site;
+    int nsite;
+} Depth;
+
+static void function_depth(Func *f, Table *names, Depth *d);
+static void call_graph(Depth *d, int n, Func *f);
+static void finish(Depth *d, Func *f, int v, int *comp, int ncomp);
+
+
+void stack_report(FILE *fp, FileList *fl) {
+
+    int nfunc;
+    Func *func = cfg_split(fl, &nfunc);
+
+    // Functions by name, first definition wins
+    Table *names = new_table();
+    int *by_id = malloc((nfunc + 1) * sizeof(int));
+    Depth *d = calloc(nfunc + 1, sizeof(Depth));
+
+    if (!by_id || !d) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < nfunc; ++i) {
+        if (!func[i].name)
+            continue;
+
+        int known = names->size;
+        int id = table_intern(names, func[i].name);
+        if (names->size > known)
+            by_id[id] = i;
+    }
+
+    for (int i = 0; i < nfunc; ++i) {
+        cfg_build(&func[i]);
+        function_depth(&func[i], names, &d[i]);
+
+        for (int j = 0; j < d[i].nsite; ++j)
+            if (d[i].site[j].callee >= 0)
+                d[i].site[j].callee = by_id[d[i].site[j].callee];
+    }
+
+    call_graph(d, nfunc, func);
+
+    fprintf(fp, "# %6s %6s %6s  %-30s %s\n",
+            "locals", "depth", "worst", "function", "notes");
+
+    for (int i = 0; i < nfunc; ++i) {
+        if (!func[i].name)
+            continue;
+
+        char worst[16];
+        sprintf(worst, "%s%d", d[i].note & STACK_LOWER ? ">=" : "", d[i].worst);
+
+        char text[128] = "";
+        for (size_t k = 0; k < sizeof(notes) / sizeof(notes[0]); ++k) {
+            if (d[i].note & notes[k].note) {
+                if (text[0])
+                    strcat(text, ", ");
+                strcat(text, notes[k].text);
+            }
+        }
+
+        if (text[0])
+            fprintf(fp, "  %6d %6d %6s  %-30s %s\n",
+                    func[i].nlocals, d[i].max, worst, func[i].name, text);
+        else
+            fprintf(fp, "  %6d %6d %6s  %s\n",
+                    func[i].nlocals, d[i].max, worst, func[i].name);
+    }
+
+    int init = table_find(names, "Sys.init");
+    if (init < 0) {
+        fprintf(fp, "# No Sys.init, so no worst case for the program\n");
+    } else {
+        Depth *s = &d[by_id[init]];
+        int top = STACK_BASE + s->worst;
+
+        fprintf(fp, "# Stack %d..%d, %s%d words from Sys.init\n",
+                STACK_BASE, top, s->note & STACK_LOWER ? "at least " : "",
+                s->worst);
+
+        if (top > HEAP_BASE)
+            fprintf(fp, "# Warning: stack runs into the heap at %d\n", HEAP_BASE);
+        else if (s->note & STACK_LOWER)
+            fprintf(fp, "# Warning: stack may run into the heap at %d\n", HEAP_BASE);
+    }
+
+    for (int i = 0; i < nfunc; ++i)
+        free(d[i].site);
+
+    free(d);
+    free(by_id);
+    free_table(names);
+    free_funcs(func, nfunc);
+}
+
+
+// Deepest a function gets by itself, and the height at every call
+void function_depth(Func *f, Table *names, Depth *d) {
+
+    d->site = NULL;
+    d->nsite = 0;
+
+    int *height = malloc((f->nblock + 1) * sizeof(int));
+    int cap = 0;
+
+    if (!height) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    d->note = stack_heights(f, height, &d->max);
+
+    // Calls at the heights their blocks settled at
+    for (int b = 0; b < f->nblock; ++b) {
+        int h = height[b];
+
+        for (int i = f->block[b].first; h >= 0 && i < f->block[b].end; ++i) {
+            TokenList *inst = &f->inst[i];
+
+            if (inst->cmd == CALL) {
+                if (d->nsite == cap) {
+                    cap = cap ? cap * 2 : 16;
+                    d->site = realloc(d->site, cap * sizeof(Site));
+
+                    if (!d->site) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        exit(1);
+                    }
+                }
+
+                Site *s = &d->site[d->nsite++];
+                s->height = h;
+                s->callee = table_find(names, inst->argv[0].name);
+            }
+
+            h += stack_effect(inst);
+            if (h < 0)
+                h = 0;
+        }
+    }
+
+    free(height);
+}
+
+// Height at the start of each block of f, from 0 at the entry, or -1 if
+// unreached. Heights don't count locals. Sets *max to the deepest the
+// function gets, and returns STACK_* notes on anything odd.
+int stack_heights(Func *f, int *height, int *max) {
+
+    int note = 0;
+    *max = 0;
+
+    if (!f->nblock)
+        return 0;
+
+    int *visits = calloc(f->nblock, sizeof(int));
+    int *work = malloc(f->nblock * sizeof(int));
+    char *queued = calloc(f->nblock, 1);
+
+    if (!visits || !work || !queued) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < f->nblock; ++i)
+        height[i] = -1;
+
+    height[0] = 0;
+    work[0] = 0;
+    queued[0] = 1;
+    int nwork = 1;
+
+    while (nwork) {
+        int b = work[--nwork];
+        queued[b] = 0;
+
+        // A loop that keeps pushing raises its blocks every time round;
+        // a finite difference settles after one visit per block
+        if (++visits[b] > f->nblock) {
+            note |= STACK_UNBOUNDED | STACK_LOWER;
+            break;
+        }
+
+        int h = height[b];
+        for (int i = f->block[b].first; i < f->block[b].end; ++i) {
+            h += stack_effect(&f->inst[i]);
+
+            if (h < 0) {
+                note |= STACK_UNDERFLOW;
+                h = 0;
+            }
+
+            if (h > *max)
+                *max = h;
+        }
+
+        for (int k = 0; k < f->block[b].nsucc; ++k) {
+            int s = f->block[b].succ[k];
+
+            if (height[s] == h)
+                continue;
+
+            if (height[s] >= 0)
+                note |= STACK_INCONSISTENT;
+
+            // Keep the higher height, and go round again with it
+            if (h > height[s]) {
+                height[s] = h;
+                if (!queued[s]) {
+                    queued[s] = 1;
+                    work[nwork++] = s;
+                }
+            }
+        }
+    }
+
+    free(visits);
+    free(work);
+    free(queued);
+
+    return note;
+}
+
+// Worst cases over the call graph, by Tarjan's strongly connected
+// components, kept off the C stack so long call chains don't overflow
+void call_graph(Depth *d, int n, Func *f) {
+
+    int *index = malloc(n * sizeof(int));
+    int *low   = malloc(n * sizeof(int));
+    int *next  = malloc(n * sizeof(int));   // Next call site to follow
+    int *frame = malloc(n * sizeof(int));   // Functions being walked
+    int *comp  = malloc(n * sizeof(int));   // Functions not in a component yet
+    char *open = calloc(n, 1);
+
+    if (!index || !low || !next || !frame || !comp || !open) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < n; ++i)
+        index[i] = -1;
+
+    int counter = 0, ncomp = 0;
+
+    for (int root = 0; root < n; ++root) {
+        if (index[root] >= 0)
+            continue;
+
+        int nframe = 0;
+        frame[nframe++] = root;
+        index[root] = low[root] = counter++;
+        next[root] = 0;
+        comp[ncomp++] = root;
+        open[root] = 1;
+
+        while (nframe) {
+            int v = frame[nframe - 1];
+
+            if (next[v] < d[v].nsite) {
+                int w = d[v].site[next[v]++].callee;
+
+                if (w < 0)
+                    continue;
+
+                if (index[w] < 0) {
+                    index[w] = low[w] = counter++;
+                    next[w] = 0;
+                    comp[ncomp++] = w;
+                    open[w] = 1;
+                    frame[nframe++] = w;
+
+                } else if (open[w] && index[w] < low[v]) {
+                    low[v] = index[w];
+                }
+
+                continue;
+            }
+
+            --nframe;
+            if (nframe && low[v] < low[frame[nframe - 1]])
+                low[frame[nframe - 1]] = low[v];
+
+            if (low[v] != index[v])
+                continue;
+
+            // v heads a component: everything above it on comp
+            int first = ncomp;
+            do {
+                --first;
+            } while (comp[first] != v);
+
+            for (int i = first; i < ncomp; ++i)
+                open[comp[i]] = 0;
+
+            finish(d, f, v, comp + first, ncomp - first);
+            ncomp = first;
+        }
+    }
+
+    free(index);
+    free(low);
+    free(next);
+    free(frame);
+    free(comp);
+    free(open);
+}
+
+// Worst cases for a component, once every callee outside it is done.
+// Calls within a recursive component count the callee's frame only.
+void finish(Depth *d, Func *f, int v, int *comp, int ncomp) {
+
+    int recursive = ncomp > 1;
+    for (int j = 0; !recursive && j < d[v].nsite; ++j)
+        if (d[v].site[j].callee == v)
+            recursive = 1;
+
+    for (int i = 0; i < ncomp; ++i) {
+        Depth *c = &d[comp[i]];
+
+        if (recursive)
+            c->note |= STACK_RECURSIVE | STACK_LOWER;
+
+        int worst = c->max;
+        for (int j = 0; j < c->nsite; ++j) {
+            Site *s = &c->site[j];
+            int peak = s->height + FRAME_WORDS;
+
+            if (s->callee < 0) {
+                c->note |= STACK_UNKNOWN | STACK_LOWER;
+
+            } else {
+                int in = 0;
+                for (int k = 0; recursive && k < ncomp; ++k)
+                    if (comp[k] == s->callee)
+                        in = 1;
+
+                if (in) {
+                    peak += f[s->callee].nlocals;
+                } else {
+                    peak += d[s->callee].worst;
+                    c->note |= d[s->callee].note & STACK_LOWER;
+                }
+            }
+
+            if (peak > worst)
+                worst = peak;
+        }
+
+        c->worst = f[comp[i]].nlocals + worst;
+    }
+}
+
+// Words an instruction leaves on the stack, once any call returns
+int stack_effect(TokenList *inst) {
+    switch (inst->cmd) {
+        case PUSH:       return 1;
+        case POP:        return -1;
+        case IF:         return -1;
+        case CALL:       return 1 - inst->argv[1].num;
+
+        case ARITHMETIC:
+            return inst->argv[0].op == NEG || inst->argv[0].op == NOT ? 0 : -1;
+
+        default:         return 0;
+    }
+}
@@ -0,0 +1,13 @@
+// Notes on stack heights and worst cases
+enum {
+    STACK_RECURSIVE    = 1,  // In a cycle of calls
+    STACK_UNKNOWN      = 2,  // Calls a function the program lacks
+    STACK_UNBOUNDED    = 4,  // Some loop keeps pushing
+    STACK_INCONSISTENT = 8,  // Paths join at different heights
+    STACK_UNDERFLOW    = 16, // Pops more than it pushed
+    STACK_LOWER        = 32, // Worst case is only a lower bound
+};
+
+void stack_report(FILE *fp, FileList *fl);
+int stack_heights(Func *f, int *height, int *max);
+int stack_effect(TokenList *inst);
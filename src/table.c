@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "table.h"
+
+/**
+ * String interning table.
+ *
+ * Maps strings to dense ids, handed out in insertion order.
+ * Callers keep their own per-id data in plain arrays indexed by id.
+ *
+ */
+
+static unsigned long hash(const char *s);
+static void grow(Table *t);
+
+
+Table *new_table() {
+    Table *r = malloc(sizeof(Table));
+
+    if (!r) {
+        fprintf(stderr, "Failed to allocate Table\n");
+        exit(1);
+    }
+
+    r->size  = 0;
+    r->cap   = 0;
+    r->key   = NULL;
+    r->slot  = NULL;
+    r->nslot = 0;
+
+    return r;
+}
+
+void free_table(Table *t) {
+    if (t) {
+        for (int i = 0; i < t->size; ++i)
+            free(t->key[i]);
+
+        free(t->key);
+        free(t->slot);
+        free(t);
+    }
+}
+
+int table_find(Table *t, const char *key) {
+    if (!t->nslot)
+        return -1;
+
+    unsigned long h = hash(key) & (t->nslot - 1);
+
+    // Linear probing, slots hold id + 1 so 0 means empty
+    for (; t->slot[h]; h = (h + 1) & (t->nslot - 1))
+        if (strcmp(t->key[t->slot[h] - 1], key) == 0)
+            return t->slot[h] - 1;
+
+    return -1;
+}
+
+int table_intern(Table *t, const char *key) {
+    int id = table_find(t, key);
+
+    if (id >= 0)
+        return id;
+
+    if ((t->size + 1) * 2 > t->nslot)
+        grow(t);
+
+    if (t->size == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 16;
+        t->key = realloc(t->key, t->cap * sizeof(char*));
+
+        if (!t->key) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+    }
+
+    id = t->size++;
+    t->key[id] = malloc(strlen(key) + 1);
+    strcpy(t->key[id], key);
+
+    unsigned long h = hash(key) & (t->nslot - 1);
+    while (t->slot[h])
+        h = (h + 1) & (t->nslot - 1);
+    t->slot[h] = id + 1;
+
+    return id;
+}
+
+const char *table_key(Table *t, int id) {
+    return (id >= 0 && id < t->size) ? t->key[id] : NULL;
+}
+
+
+void grow(Table *t) {
+    int n = t->nslot ? t->nslot * 2 : 64;
+    int *slot = calloc(n, sizeof(int));
+
+    if (!slot) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < t->size; ++i) {
+        unsigned long h = hash(t->key[i]) & (n - 1);
+        while (slot[h])
+            h = (h + 1) & (n - 1);
+        slot[h] = i + 1;
+    }
+
+    free(t->slot);
+    t->slot  = slot;
+    t->nslot = n;
+}
+
+unsigned long hash(const char *s) {
+    // FNV-1a
+    unsigned long h = 2166136261UL;
+
+    for (; *s; ++s) {
+        h ^= (unsigned char) *s;
+        h *= 16777619UL;
+    }
+
+    return h;
+}
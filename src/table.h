@@ -0,0 +1,13 @@
+typedef struct Table {
+    int size;
+    int cap;
+    char **key;
+    int *slot;
+    int nslot;
+} Table;
+
+Table *new_table();
+void free_table(Table *t);
+int table_intern(Table *t, const char *key);
+int table_find(Table *t, const char *key);
+const char *table_key(Table *t, int id);
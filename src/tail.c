@@ -0,0 +1,388 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lex.h"
+#include "prog.h"
+#include "table.h"
+#include "prof.h"
+#include "write.h"
+#include "cfg.h"
+#include "conv.h"
+#include "tail.h"
+
+/**
+ * Cross-jumping.
+ *
+ * Branches of an if often end the same way before they meet again, with
+ * the same field stored before the jump to the end of the if, or the
+ * same value pushed and returned. Only one copy of such a tail is kept,
+ * and the others jump to it instead. That costs a jump on their path,
+ * unless they ended in one already.
+ *
+ * Tails are compared among the blocks ending in a return, and among the
+ * blocks reaching the same label by a jump or by falling through to it.
+ * The block falling through is kept where there is one, so its copies
+ * trade the jump they end in for the one to it. Labels jumped back to
+ * head loops and are left alone. Both copies have to be in the same
+ * loop, so nothing enters one other than through its header, and both
+ * reached, so the kept one isn't dropped as dead code. A tail doesn't
+ * start right after a push or a call, which are written together with
+ * what follows them.
+ *
+ * Words are traded for cycles, so this is done in every function with
+ * --size, and otherwise only in functions a profile shows are cold.
+ *
+ */
+
+// Words of the jump to a kept copy
+#define TAIL_JUMP  2
+
+// A function entered at most once for every TAIL_COLD entries of the
+// function entered most is cold
+#define TAIL_COLD  1000
+
+// The end of a block a tail may come from
+typedef struct Copy {
+    int block;
+    int first;      // First instruction after the block's label
+    int end;        // One past the last the tail may take
+    int jumps;      // Ends in a goto left out of the tail
+    int loop;       // Header of the innermost loop it is in, -1 if none
+    int gone;       // Jumps to another copy instead
+} Copy;
+
+static void plan_func(Tails *t, TokenList **in, int n, char *fname,
+                      const CallConv *conv, int *cap, int *nlabel);
+static void merge(Tails *t, Func *f, TokenList **in, Copy *c, int nc,
+                  const Conv *fast, int *label_at, int *cap, int *nlabel);
+static int common(Func *f, const Copy *x, const Copy *y);
+static int cut(Func *f, const Copy *c, int k);
+static int same_inst(const TokenList *x, const TokenList *y);
+static long hottest(Profile *p);
+static void add(Tails *t, int *cap, const TokenList *inst, TokenList *last,
+                int label, int n, int line, int words, int cycles);
+static int by_inst(const void *x, const void *y);
+
+
+Tails *plan_tails(FileList *fl, const CallConv *conv, Profile *profile, int size) {
+
+    Tails *t = malloc(sizeof(Tails));
+    if (!t) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    t->at = NULL;
+    t->n = 0;
+
+    int cap = 0;
+    int nlabel = 0;
+    long hot = hottest(profile);
+
+    TokenList **in = NULL;
+    int incap = 0;
+
+    for (FileList *it = fl; it; it = it->next) {
+        TokenList *inst = it->tl;
+
+        while (inst && inst->cmd != FUNCTION)
+            inst = inst->next;
+
+        while (inst) {
+            int n = 0;
+
+            do {
+                if (n == incap) {
+                    incap = incap ? incap * 2 : 256;
+                    in = realloc(in, incap * sizeof(TokenList*));
+                    if (!in) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        exit(1);
+                    }
+                }
+
+                in[n++] = inst;
+                inst = inst->next;
+            } while (inst && inst->cmd != FUNCTION);
+
+            long entries = prof_count(profile, "fn", in[0]->argv[0].name);
+
+            if (size || (entries >= 0 && entries * TAIL_COLD <= hot))
+                plan_func(t, in, n, it->name, conv, &cap, &nlabel);
+        }
+    }
+
+    free(in);
+
+    if (t->n)
+        qsort(t->at, t->n, sizeof(Tail), by_inst);
+
+    return t;
+}
+
+// Merge the tails of the function in[0] defines, n instructions long
+void plan_func(Tails *t, TokenList **in, int n, char *fname,
+               const CallConv *conv, int *cap, int *nlabel) {
+
+    Func *f = cfg_func(in[0], in[n - 1]->next, in[0]->argv[0].name, fname);
+    cfg_build(f);
+
+    const char *why;
+    const Conv *fast = find_conv(conv, f->name, &why);
+
+    char *reach = calloc(f->nblock + 1, 1);
+    char *header = calloc(f->nblock + 1, 1);
+    int *work = malloc((f->nblock + 1) * sizeof(int));
+    int *loop = malloc((f->ninst + 1) * sizeof(int));
+    int *label_at = malloc((f->ninst + 1) * sizeof(int));
+    Copy *c = malloc((f->nblock + 1) * sizeof(Copy));
+
+    if (!reach || !header || !work || !loop || !label_at || !c) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    int nwork = 0;
+    work[nwork++] = 0;
+    reach[0] = 1;
+
+    while (nwork) {
+        Block *b = &f->block[work[--nwork]];
+
+        for (int j = 0; j < b->nsucc; ++j) {
+            if (!reach[b->succ[j]]) {
+                reach[b->succ[j]] = 1;
+                work[nwork++] = b->succ[j];
+            }
+        }
+    }
+
+    // Innermost loop of each instruction, from the jumps back to a label
+    for (int i = 0; i < f->ninst; ++i)
+        loop[i] = -1, label_at[i] = -1;
+
+    for (int j = 0; j < f->ninst; ++j) {
+        TokenList *inst = &f->inst[j];
+        if (inst->cmd != GOTO && inst->cmd != IF)
+            continue;
+
+        int b = cfg_target(f, inst->argv[0].name);
+        if (b < 0 || f->block[b].first > j)
+            continue;
+
+        header[b] = 1;
+
+        int h = f->block[b].first;
+        for (int i = h; i <= j; ++i)
+            if (loop[i] < h)
+                loop[i] = h;
+    }
+
+    int nc = 0;
+    for (int b = 0; b < f->nblock; ++b) {
+        Block *blk = &f->block[b];
+        TokenList *last = &f->inst[blk->end - 1];
+
+        if (!reach[b] || last->cmd != RETURN)
+            continue;
+
+        int first = blk->first;
+        while (first < blk->end && (f->inst[first].cmd == LABEL
+                                    || f->inst[first].cmd == FUNCTION))
+            ++first;
+
+        c[nc++] = (Copy) { b, first, blk->end, 0, loop[blk->end - 1], 0 };
+    }
+
+    merge(t, f, in, c, nc, fast, label_at, cap, nlabel);
+
+    for (int l = 1; l < f->nblock; ++l) {
+        if (!reach[l] || header[l] || f->inst[f->block[l].first].cmd != LABEL)
+            continue;
+
+        // Falling through first, to be kept
+        nc = 0;
+        for (int b = l - 1; b >= 0; --b) {
+            Block *blk = &f->block[b];
+            TokenList *last = &f->inst[blk->end - 1];
+            int jumps = last->cmd == GOTO;
+
+            if (!reach[b])
+                continue;
+
+            if (jumps ? cfg_target(f, last->argv[0].name) != l
+                      : b != l - 1 || last->cmd == IF || last->cmd == RETURN)
+                continue;
+
+            int first = blk->first;
+            while (first < blk->end && (f->inst[first].cmd == LABEL
+                                        || f->inst[first].cmd == FUNCTION))
+                ++first;
+
+            c[nc++] = (Copy) { b, first, blk->end - jumps, jumps, loop[blk->end - 1], 0 };
+        }
+
+        merge(t, f, in, c, nc, fast, label_at, cap, nlabel);
+    }
+
+    free(reach);
+    free(header);
+    free(work);
+    free(loop);
+    free(label_at);
+    free(c);
+    free_func(f);
+    free(f);
+}
+
+// Keep the first of copies c, and each after it that none before it
+// can stand in for, jumping from the rest to the kept copy that saves
+// most words
+void merge(Tails *t, Func *f, TokenList **in, Copy *c, int nc,
+           const Conv *fast, int *label_at, int *cap, int *nlabel) {
+
+    for (int x = 1; x < nc; ++x) {
+        int best = 0, to = -1, len = 0;
+
+        for (int y = 0; y < x; ++y) {
+            if (c[y].gone || c[y].loop != c[x].loop)
+                continue;
+
+            int k = common(f, &c[x], &c[y]);
+            while (k && (!cut(f, &c[x], k) || !cut(f, &c[y], k)))
+                --k;
+
+            if (!k)
+                continue;
+
+            int saves = write_cost(&f->inst[c[x].end - k], k, f->fname, fast)
+                      - (c[x].jumps ? 0 : TAIL_JUMP);
+
+            if (saves > best) {
+                best = saves;
+                to = y;
+                len = k;
+            }
+        }
+
+        if (to < 0)
+            continue;
+
+        int at = c[to].end - len;
+        if (label_at[at] < 0) {
+            label_at[at] = (*nlabel)++;
+            add(t, cap, in[at], NULL, label_at[at], len, in[at]->line, 0, 0);
+        }
+
+        int from = c[x].end - len;
+        add(t, cap, in[from], in[f->block[c[x].block].end - 1], label_at[at],
+            len, in[at]->line, -best, c[x].jumps ? 0 : TAIL_JUMP);
+
+        c[x].gone = 1;
+    }
+}
+
+// Instructions copies x and y end in alike
+int common(Func *f, const Copy *x, const Copy *y) {
+
+    int k = 0;
+    while (x->end - k > x->first && y->end - k > y->first
+            && same_inst(&f->inst[x->end - k - 1], &f->inst[y->end - k - 1]))
+        ++k;
+
+    return k;
+}
+
+// Whether the last k instructions of c can be written apart from those
+// before them
+int cut(Func *f, const Copy *c, int k) {
+
+    int s = c->end - k;
+
+    if (s == c->first || f->inst[s].cmd == RETURN)
+        return 1;
+
+    return f->inst[s - 1].cmd != PUSH && f->inst[s - 1].cmd != CALL;
+}
+
+int same_inst(const TokenList *x, const TokenList *y) {
+
+    if (x->cmd != y->cmd)
+        return 0;
+
+    switch (x->cmd) {
+        case PUSH:
+        case POP:
+            return x->argv[0].mem == y->argv[0].mem
+                && x->argv[1].num == y->argv[1].num;
+
+        case ARITHMETIC:
+            return x->argv[0].op == y->argv[0].op;
+
+        case CALL:
+            return strcmp(x->argv[0].name, y->argv[0].name) == 0
+                && x->argv[1].num == y->argv[1].num;
+
+        case RETURN:
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+// Entries of the function entered most, 0 without a profile
+long hottest(Profile *p) {
+
+    long r = 0;
+    if (!p)
+        return r;
+
+    for (int i = 0; i < p->keys->size; ++i)
+        if (strncmp(table_key(p->keys, i), "fn ", 3) == 0 && (long) p->count[i] > r)
+            r = p->count[i];
+
+    return r;
+}
+
+void add(Tails *t, int *cap, const TokenList *inst, TokenList *last,
+         int label, int n, int line, int words, int cycles) {
+
+    if (t->n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        t->at = realloc(t->at, *cap * sizeof(Tail));
+        if (!t->at) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+    }
+
+    t->at[t->n++] = (Tail) { inst, last, label, n, line, words, cycles };
+}
+
+int by_inst(const void *x, const void *y) {
+    uintptr_t a = (uintptr_t) ((const Tail*) x)->inst;
+    uintptr_t b = (uintptr_t) ((const Tail*) y)->inst;
+
+    return (a > b) - (a < b);
+}
+
+// The copy of a tail inst starts, or NULL if it starts none
+const Tail *find_tail(const Tails *t, const TokenList *inst) {
+
+    if (!t || !t->n || !inst)
+        return NULL;
+
+    Tail key = { inst, NULL, 0, 0, 0, 0, 0 };
+
+    return bsearch(&key, t->at, t->n, sizeof(Tail), by_inst);
+}
+
+void free_tails(Tails *t) {
+    if (t) {
+        free(t->at);
+        free(t);
+    }
+}
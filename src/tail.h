@@ -0,0 +1,21 @@
+// Ends of blocks written once, the other copies jumping to the one kept
+typedef struct Tail {
+    const TokenList *inst;  // First instruction of the copy
+    TokenList *last;        // Last of a copy jumped to the kept one, NULL
+                            // for the kept copy, which gets the label
+    int label;              // Number of the kept copy's label
+    int n;                  // Instructions merged
+    int line;               // Where the kept copy starts
+    int words;              // Estimated change in ROM words
+    int cycles;             // Estimated change in cycles each time it runs
+} Tail;
+
+typedef struct Tails {
+    Tail *at;               // Sorted by address of inst
+    int n;
+} Tails;
+
+Tails *plan_tails(FileList *fl, const struct CallConv *conv, Profile *profile,
+                  int size);
+const Tail *find_tail(const Tails *t, const TokenList *inst);
+void free_tails(Tails *t);
@@ -1,99 +1,1711 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "lex.h"
 #include "prog.h"
+#include "table.h"
+#include "prof.h"
+#include "remark.h"
+#include "pool.h"
 #include "write.h"
+#include "conv.h"
+#include "model.h"
+#include "loop.h"
+#include "alias.h"
+#include "live.h"
+#include "tail.h"
+#include "self.h"
 
-static int PC = 0;
 #define STR(x) #x
 
 //#define P(str) fputs(STR(str\n), fp)
 //#define PF(str, ...) fprintf(fp, STR(str\n), __VA_ARGS__)
 //#define P(str) fprintf(fp, "%d: "STR(str\n), PC++);
 //#define PF(str, ...) fprintf(fp, "%d: "STR(str\n), PC++, __VA_ARGS__)
-#define P(str)       fprintf(fp, STR(str)"\t// %d\n", PC++);
-#define PF(str, ...) fprintf(fp, STR(str)"\t// %d\n", __VA_ARGS__, PC++)
-#define C(str)       fputs  ("// " STR(str\n), fp)
-#define CF(str, ...) fprintf(fp, "// " STR(str\n), __VA_ARGS__)
-#define LF(str, ...) fprintf(fp, "("STR(str)")\n", __VA_ARGS__)
-#define N()          fputs  ("\n", fp)
+
+// A writer without a stream only counts words and labels. Instructions
+// that leave the registers as they are go nowhere.
+#define P(str)       emit(w, STR(str))
+#define PF(str, ...) emitf(w, STR(str), __VA_ARGS__)
+#define C(str)       (w->fp ? fputs  ("// " STR(str\n), w->fp) : 0)
+#define CF(str, ...) (w->fp ? fprintf(w->fp, "// " STR(str\n), __VA_ARGS__) : 0)
+// Control may join at a label, so it ends what the registers are known
+// to hold, and the run the slots are planned for, whatever writes it
+#define LF(str, ...) (model_reset(&w->regs), w->planned = 0, \
+                      w->fp ? fprintf(w->fp, "("STR(str)")\n", __VA_ARGS__) : 0)
+#define N()          (w->fp ? fputs  ("\n", w->fp) : 0)
 
 const static char *reg_save_list[4] = { "LCL", "ARG", "THIS", "THAT" }; // 4 elem
 const static int reg_save_list_len = 4;
 
-static void write_preamble(FILE *fp, FileList *fl);
-static void write_arithmetic(FILE *fp, RType op);
-static void write_stack(FILE *fp, CommandType cmd, Memory mem, int num, char *fname);
-static void write_label(FILE *fp, char *label);
-static void write_goto(FILE *fp, CommandType cmd, char *label);
-static void write_fn(FILE *fp, char *name, int varc);
-static void write_ret(FILE *fp);
-static void write_call(FILE *fp, char *name, int argc);
+// Words, and so cycles, saved by fusing a push into the op consuming it
+#define FUSE_OP_SAVES   7
+#define FUSE_POP_SAVES  10
+
+// Short labels are `$` and a base-36 id for functions and VM labels.
+// Labels made up here get a prefix no id starts with instead, none of
+// them the start of another, so --label-map patterns match one kind.
+enum { GEN_COMPARE_TRUE, GEN_COMPARE_END, GEN_CALL_RETURN, GEN_INSTR_SKIP,
+       GEN_ALLOC_SLOW, GEN_ALLOC_DONE, GEN_TAIL, GEN_THIS_ENTRY };
+
+static const char *gen_long[] = {
+    "__COMPARE_TRUE_%ld__", "__COMPARE_END_%ld__",
+    "__CALL_COUNT_%ld__",   "__INSTR_SKIP_%ld__",
+    "__ALLOC_SLOW_%ld__",   "__ALLOC_DONE_%ld__",
+    "__TAIL_%ld__",         "__THIS_ENTRY_%ld__",
+};
+static const char *gen_short[] = { "$_", "$.", "$:", "$$_", "$$.", "$$:", "$$$_", "$$$." };
+
+#define LABEL_BUF  32
+
+// Statics live between the registers and the stack
+#define STATIC_BASE  16
+#define STATIC_TOP   256
+
+// Instrumented builds keep a 32 bit counter, low word first, for every
+// function entry, call edge and loop header at the top of the heap.
+// Nothing keeps Memory from allocating there too, so that is warned of.
+#define INSTR_TOP  16384
+#define INSTR_MIN  2048
+
+// R13 to R15 hold slot addresses within a run of stack ops. Keeping one
+// costs SLOT_SETUP words once, or SLOT_NEAR_SETUP for slots 0 and 1, and
+// saves SLOT_PUSH_SAVES on each push and SLOT_POP_SAVES on each pop of
+// the slot after that.
+#define NSLOT             3
+#define SLOT_SETUP        6
+#define SLOT_NEAR_SETUP   4
+#define SLOT_PUSH_SAVES   1
+#define SLOT_POP_SAVES    7
+
+// With --inline-alloc, `push constant N; call Memory.alloc 1` takes N words
+// from the region an allocator like ours hands out in order: static 0 of
+// Memory is the next free word and static 1 the end. Memory.alloc is
+// only called once the region runs out.
+#define ALLOC_FILE  "Memory"
+#define ALLOC_FN    "Memory.alloc"
+
+// With --self-calls, a call passing a method the this it already has
+// enters past its setting THIS, which takes this many words
+#define THIS_ENTRY_SAVES  5
+
+// Options for callers that don't have any, like write_cost()
+static const WriteOptions no_options = { 0 };
+
+// Everything a translation touches lives here or in its options, so
+// independent translations can run at once
+typedef struct Writer {
+    FILE *fp;       // NULL to only count
+    int pc;
+    long jcount;    // __COMPARE_*__ labels
+    long ccount;    // __CALL_COUNT_*__ labels
+    long icount;    // __INSTR_SKIP_*__ labels
+    FILE *remarks;
+    const WriteOptions *opt;
+    Table *counters;    // Instrumented events, NULL when not instrumenting
+    int counter_base;
+    Table *labels;      // Short label ids, NULL for full names
+    int intern;         // Give labels ids as they come, else all have one
+    Table *statics;     // Static symbols by RAM slot, NULL for symbols
+    CallConv *conv;     // Functions with the fast convention, may be NULL
+    const Conv *fast;   // Convention of the function being written, if fast
+    RegModel regs;      // What A, D and RAM hold at this point of the block
+    struct {
+        Memory mem;     // Slot whose address R13 + i holds
+        int num;        // -1 if R13 + i is free
+        int ready;      // Address computed yet
+    } slot[NSLOT];
+    TokenList *plan_end;    // First instruction the slots aren't planned for
+    int planned;
+    Unroll *unroll;     // Loops to unroll, NULL when off
+    Ivs *ivs;           // Loops to strength reduce, NULL when off
+    const IvLoop *iv;   // Loop being written with pointers, if any
+    Aliases *aliases;   // Pointers holding references, NULL when off
+    int refs;           // Those of the function being written
+    Dead *dead;         // Pops and code to drop, NULL when off
+    Tails *tails;       // Tails written once, NULL when off
+    Selfs *selfs;       // Calls passing this to methods, NULL when off
+} Writer;
+
+struct WriteStream {
+    Writer w;
+    char *fn;       // Current function, owned as tokens are freed as we go
+    char *rem;
+    size_t remlen;
+};
+
+// Translation unit for the thread pool: a function, or whatever comes
+// before the first function of a file
+typedef struct Chunk {
+    char *fname;
+    TokenList *first;
+    TokenList *end;
+    char *fn;       // Function the chunk starts in, for labels
+    Writer start;   // State on entry, or counted use before that is known
+    char *out;
+    size_t outlen;
+    off_t off;      // Where out goes in the output file
+    char *rem;
+    size_t remlen;
+} Chunk;
+
+typedef struct Placement {
+    int fd;
+    Chunk *ch;
+} Placement;
+
+// Conditions are at most this many instructions before their if-goto
+#define COND_MAX  32
+
+// Value on the stack in a condition, made by first to last
+typedef struct Cond {
+    TokenList *first;
+    TokenList *last;
+    int test;           // A comparison, or and, or or not of tests
+    struct Cond *x;
+    struct Cond *y;
+} Cond;
+
+static void emit(Writer *w, const char *ins);
+static void emitf(Writer *w, const char *fmt, ...);
+static Chunk *split_chunks(FileList *fl, int *n);
+static void write_chunk(Writer *w, Chunk *c);
+static void count_chunk(void *ctx, int i);
+static void emit_chunk(void *ctx, int i);
+static int place_chunks(FILE *fp, Chunk *ch, int n, int jobs);
+static void pwrite_chunk(void *ctx, int i);
+static int fusible(TokenList *inst);
+static TokenList *write_fused(Writer *w, TokenList *inst, char *fname, char *fn);
+static TokenList *write_alloc(Writer *w, TokenList *inst, char *fname, char *fn);
+static TokenList *write_dead(Writer *w, TokenList *inst, char *fname, char *fn);
+static TokenList *write_tail(Writer *w, TokenList *inst, char *fname, char *fn);
+static TokenList *write_unrolled(Writer *w, TokenList *inst, char *fname, char **curr_fn);
+static void write_iv_init(Writer *w, TokenList *inst, char *fname, char **curr_fn);
+static TokenList *write_reduced(Writer *w, TokenList *inst, char *fname, char **curr_fn);
+static TokenList *write_code(Writer *w, TokenList *code, int n, TokenList *first,
+                             TokenList *last, char *fname, char **curr_fn);
+static int within(TokenList *inst, TokenList *code, int n);
+static void write_insts(Writer *w, TokenList *first, TokenList *last,
+                        char *fname, char **curr_fn);
+static Cond *parse_cond(TokenList *inst, Cond *node);
+static TokenList *write_cond(Writer *w, TokenList *inst, char *fname, char *fn);
+static void write_jump(Writer *w, Cond *c, int sense, const char *label,
+                       char *fname, char *fn);
+static void write_diff(Writer *w, Cond *x, Cond *y, char *fname, char *fn);
+static void write_into_d(Writer *w, Cond *c, char *fname, char *fn);
+static int direct(Writer *w, Cond *c, char *fname, char **seg);
+static void write_run(Writer *w, TokenList *first, TokenList *last,
+                      char *fname, char *fn);
+static char *vm_label(char *fn, char *name);
+static Table *collect_labels(FileList *fl);
+static const char *symbol(Writer *w, const char *name, char *buf);
+static const char *gen_label(Writer *w, int kind, long n, char *buf);
+static void write_label_map(FILE *fp, Table *labels);
+static void base36(char *buf, long n);
+static void count_instrument(Writer *w, FileList *fl);
+static char *counter_key(const char *kind, const char *name, const char *callee);
+static void write_counter(Writer *w, const char *kind, const char *name,
+                          const char *callee);
+static TokenList *write_inst(Writer *w, TokenList *inst, char *fname, char **curr_fn);
+static void write_preamble(Writer *w, FileList *fl);
+static void write_arithmetic(Writer *w, RType op);
+static void write_binary(Writer *w, RType op);
+static Table *alloc_statics(FileList *fl, FILE *map);
+static char *segment(Writer *w, Memory mem, int num, char *fname, int *deref);
+static void plan_slots(Writer *w, TokenList *inst, char *fname, char *fn);
+static int slot_reg(Writer *w, Memory mem, int num);
+static const char *scratch(Writer *w);
+static void write_load(Writer *w, Memory mem, int num, char *fname);
+static void write_store(Writer *w, Memory mem);
+static void write_stack(Writer *w, CommandType cmd, Memory mem, int num, char *fname);
+static void write_push_op(Writer *w, Memory mem, int num, char *fname, RType op);
+static void write_push_pop(Writer *w, Memory src, int snum, Memory dst, int dnum,
+                           char *fname);
+static void write_label(Writer *w, char *label);
+static void write_goto(Writer *w, CommandType cmd, char *label);
+static void write_fn(Writer *w, char *name, int varc, int entry);
+static void write_ret(Writer *w);
+static void write_call(Writer *w, char *caller, char *name, int argc, int entry);
+static TokenList *write_conv_call(Writer *w, TokenList *inst, char *fname, char *fn);
+static void write_fast_call(Writer *w, char *caller, char *name, int argc);
+static void write_fast_ret(Writer *w);
+static int call_words(const Writer *w, const Conv *c, char *name,
+                      TokenList *pop, int ret, char *fname);
+static void push_reg(Writer *w, const char *reg);
+static void pop_reg(Writer *w, const char *reg);
+
+
+// Translate fl into fp. The list is left for the caller to free.
+void write_file_list(FILE *fp, FileList *fl, const WriteOptions *opt) {
+
+    Writer w = { fp, 0, 0, 0, 0, NULL, opt, NULL, 0, NULL, 0, NULL, NULL, NULL };
+
+    if (opt->instrument)
+        count_instrument(&w, fl);
+
+    if (opt->alloc_statics)
+        w.statics = alloc_statics(fl, opt->static_map);
+
+    if (opt->fast_calls)
+        w.conv = choose_conv(fl);
+
+    if (opt->unroll)
+        w.unroll = plan_unroll(fl, opt->unroll);
+
+    if (opt->reduce_ivs)
+        w.ivs = plan_ivs(fl, w.conv);
+
+    if (opt->alias)
+        w.aliases = plan_aliases(fl);
+
+    if (opt->dead_code)
+        w.dead = plan_dead(fl);
+
+    if (opt->size || opt->profile)
+        w.tails = plan_tails(fl, w.conv, opt->profile, opt->size);
+
+    if (opt->self_calls)
+        w.selfs = plan_selfs(fl);
+
+    if (opt->short_labels) {
+        w.labels = collect_labels(fl);
+
+        if (opt->label_map)
+            write_label_map(opt->label_map, w.labels);
+    }
+
+    write_preamble(&w, fl);
+
+    int n;
+    Chunk *ch = split_chunks(fl, &n);
+
+    char **rem = calloc(n + 1, sizeof(char*));
+    size_t remlen;
+
+    if (opt->jobs <= 1) {
+        if (opt->remarks)
+            w.remarks = open_memstream(&rem[0], &remlen);
+
+        for (int i = 0; i < n; ++i)
+            write_chunk(&w, &ch[i]);
+
+        if (w.remarks)
+            fclose(w.remarks);
+
+    } else {
+        // Count first, so every chunk knows its PC and label numbers
+        for (int i = 0; i < n; ++i)
+            ch[i].start = w;
+
+        pool_run(opt->jobs, n, count_chunk, ch);
+
+        for (int i = 0; i < n; ++i) {
+            Writer delta = ch[i].start;
+
+            ch[i].start = w;
+            w.pc     += delta.pc;
+            w.jcount += delta.jcount;
+            w.ccount += delta.ccount;
+            w.icount += delta.icount;
+        }
+
+        pool_run(opt->jobs, n, emit_chunk, ch);
+
+        // Pipes and appends can't take positioned writes
+        if (!place_chunks(fp, ch, n, opt->jobs))
+            for (int i = 0; i < n; ++i)
+                fwrite(ch[i].out, 1, ch[i].outlen, fp);
+
+        for (int i = 0; i < n; ++i) {
+            free(ch[i].out);
+
+            rem[i] = ch[i].rem;
+        }
+    }
+
+    if (opt->remarks)
+        remark_array(opt->remarks, rem, n);
+
+    for (int i = 0; i < n; ++i)
+        free(rem[i]);
+    free(rem);
+    free(ch);
+
+    free_table(w.counters);
+    free_table(w.labels);
+    free_table(w.statics);
+    free_conv(w.conv);
+    free_unroll(w.unroll);
+    free_ivs(w.ivs);
+    free_aliases(w.aliases);
+    free_dead(w.dead);
+    free_tails(w.tails);
+    free_selfs(w.selfs);
+}
+
+// Start translating input that arrives in pieces, writing the preamble
+WriteStream *write_begin(FILE *fp, const WriteOptions *opt) {
+
+    WriteStream *s = malloc(sizeof(WriteStream));
+    if (!s) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    Writer w = { fp, 0, 0, 0, 0, NULL, opt, NULL, 0, NULL, 0, NULL, NULL, NULL };
+
+    s->w = w;
+    s->fn = NULL;
+    s->rem = NULL;
+    s->remlen = 0;
+
+    // Input isn't known up front, so ids are handed out as labels come
+    if (opt->short_labels) {
+        s->w.labels = new_table();
+        s->w.intern = 1;
+    }
+
+    write_preamble(&s->w, NULL);
+
+    if (opt->remarks)
+        s->w.remarks = open_memstream(&s->rem, &s->remlen);
+
+    return s;
+}
+
+// Translate the next piece of input into fp. Pieces are cut before a
+// function, so nothing is fused across them.
+void write_tokens(WriteStream *s, FILE *fp, TokenList *tl, char *fname) {
+
+    char *curr_fn = s->fn;
+    s->w.fp = fp;
+    model_reset(&s->w.regs);
+    s->w.planned = 0;
+
+    TokenList *inst;
+    for (inst = tl; inst; inst = inst->next)
+        inst = write_inst(&s->w, inst, fname, &curr_fn);
+
+    if (curr_fn != s->fn) {
+        char *fn = malloc(strlen(curr_fn) + 1);
+        strcpy(fn, curr_fn);
+
+        free(s->fn);
+        s->fn = fn;
+    }
+}
+
+void write_end(WriteStream *s) {
+
+    if (s->w.remarks) {
+        fclose(s->w.remarks);
+        remark_array(s->w.opt->remarks, &s->rem, 1);
+    }
+
+    if (s->w.labels) {
+        if (s->w.opt->label_map)
+            write_label_map(s->w.opt->label_map, s->w.labels);
+
+        free_table(s->w.labels);
+    }
+
+    free(s->rem);
+    free(s->fn);
+    free(s);
+}
+
+WriteMark write_mark(WriteStream *s) {
+    WriteMark r = { s->w.pc, s->w.jcount, s->w.ccount, s->w.icount, s->fn };
+    return r;
+}
+
+// Carry on as if the input that took the stream to m had been written
+void write_seek(WriteStream *s, const WriteMark *m) {
+
+    s->w.pc     = m->pc;
+    s->w.jcount = m->jcount;
+    s->w.ccount = m->ccount;
+    s->w.icount = m->icount;
+
+    if (m->fn != s->fn) {
+        char *fn = NULL;
+
+        if (m->fn) {
+            fn = malloc(strlen(m->fn) + 1);
+            strcpy(fn, m->fn);
+        }
+
+        free(s->fn);
+        s->fn = fn;
+    }
+}
+
+// Words the current translation of n instructions takes, in a function
+// with the fast convention if fast isn't NULL. Generated label numbers
+// move on, so this is for analysis, not while writing output.
+int write_cost(TokenList *inst, int n, char *fname, const Conv *fast) {
+
+    // Translate a copy, so ops past the n-th can't be fused in
+    TokenList *copy = malloc(n * sizeof(TokenList));
+    for (int i = 0; i < n; ++i, inst = inst->next) {
+        copy[i] = *inst;
+        copy[i].next = (i + 1 < n) ? &copy[i + 1] : NULL;
+    }
+
+    Writer w = { NULL, 0, 0, 0, 0, NULL, &no_options, NULL, 0, NULL, 0, NULL, NULL, fast };
+    char *curr_fn = NULL;
+
+    for (inst = copy; inst; inst = inst->next)
+        inst = write_inst(&w, inst, fname, &curr_fn);
+
+    free(copy);
+
+    return w.pc;
+}
+
+
+void emit(Writer *w, const char *ins) {
+    if (!model_step(&w->regs, ins))
+        return;
+
+    // One write per line, fprintf would be most of the time spent here
+    if (w->fp) {
+        char tail[16];
+        int i = sizeof(tail);
+        unsigned n = w->pc;
+
+        tail[--i] = '\n';
+        do {
+            tail[--i] = '0' + n % 10;
+            n /= 10;
+        } while (n);
+        memcpy(tail + i - 4, "\t// ", 4);
+        i -= 4;
+
+        fputs(ins, w->fp);
+        fwrite(tail + i, 1, sizeof(tail) - i, w->fp);
+    }
+    ++w->pc;
+}
+
+void emitf(Writer *w, const char *fmt, ...) {
+    char buf[256];
+    va_list ap, again;
+
+    va_start(ap, fmt);
+    va_copy(again, ap);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    // Symbols can be as long as the names in the input
+    char *ins = buf;
+    if (len >= (int) sizeof(buf)) {
+        ins = malloc(len + 1);
+        if (!ins) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+
+        vsnprintf(ins, len + 1, fmt, again);
+    }
+    va_end(again);
+
+    emit(w, ins);
+
+    if (ins != buf)
+        free(ins);
+}
+
+
+// Split at every function and file. Chunks only depend on each other
+// through the PC and label numbers they start with.
+Chunk *split_chunks(FileList *fl, int *n) {
+
+    Chunk *r = NULL;
+    int cap = 0;
+    char *curr_fn = NULL;
+
+    *n = 0;
+
+    FileList *it;
+    for (it = fl; it; it = it->next) {
+
+        TokenList *inst;
+        for (inst = it->tl; inst; inst = inst->next) {
+
+            if (inst == it->tl || inst->cmd == FUNCTION) {
+                if (*n == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    r = realloc(r, cap * sizeof(Chunk));
+
+                    if (!r) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        exit(1);
+                    }
+                }
+
+                if (*n && inst != it->tl)
+                    r[*n - 1].end = inst;
+
+                Chunk *c = &r[(*n)++];
+                c->fname  = it->name;
+                c->first  = inst;
+                c->end    = NULL;
+                c->fn     = curr_fn;
+                c->out    = NULL;
+                c->outlen = 0;
+                c->off    = 0;
+                c->rem    = NULL;
+                c->remlen = 0;
+            }
+
+            if (inst->cmd == FUNCTION)
+                curr_fn = inst->argv[0].name;
+        }
+    }
+
+    return r;
+}
+
+void write_chunk(Writer *w, Chunk *c) {
+    char *curr_fn = c->fn;
+    const char *why;
+
+    // Chunks are written on their own, so nothing carries over
+    w->fast = find_conv(w->conv, curr_fn, &why);
+    w->refs = alias_refs(w->aliases, curr_fn);
+    model_reset(&w->regs);
+    w->planned = 0;
+    w->iv = NULL;
+
+    TokenList *inst;
+    for (inst = c->first; inst && inst != c->end; inst = inst->next)
+        inst = write_inst(w, inst, c->fname, &curr_fn);
+}
+
+void count_chunk(void *ctx, int i) {
+    Chunk *c = &((Chunk*) ctx)[i];
+    Writer w = c->start;
+
+    w.fp = NULL;
+    w.pc = w.jcount = w.ccount = w.icount = 0;
+    write_chunk(&w, c);
+    c->start = w;
+}
+
+void emit_chunk(void *ctx, int i) {
+    Chunk *c = &((Chunk*) ctx)[i];
+    Writer w = c->start;
+
+    w.fp = open_memstream(&c->out, &c->outlen);
+    if (w.opt->remarks)
+        w.remarks = open_memstream(&c->rem, &c->remlen);
+
+    if (!w.fp || (w.opt->remarks && !w.remarks)) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    write_chunk(&w, c);
+
+    fclose(w.fp);
+    if (w.remarks)
+        fclose(w.remarks);
+}
+
+// Write every chunk at its offset in fp from the thread pool. Returns 0,
+// having written nothing, if fp isn't a regular file we can do that to.
+// Like the rest of -j this is experimental: it has only been timed on
+// one CPU, where it was no faster than writing the chunks in order.
+int place_chunks(FILE *fp, Chunk *ch, int n, int jobs) {
+
+    struct stat st;
+    int fd = fileno(fp);
+
+    if (fflush(fp) != 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+            || (fcntl(fd, F_GETFL) & O_APPEND))
+        return 0;
+
+    off_t end = ftello(fp);
+    if (end < 0)
+        return 0;
+
+    off_t base = end;
+    for (int i = 0; i < n; ++i) {
+        ch[i].off = end;
+        end += ch[i].outlen;
+    }
+
+    // Only a hint, the writes extend the file anyway
+    int e = end > base ? posix_fallocate(fd, base, end - base) : 0;
+    if (e && e != EINVAL && e != EOPNOTSUPP) {
+        fprintf(stderr, "Failed to write output: %s\n", strerror(e));
+        exit(1);
+    }
+
+    Placement p = { fd, ch };
+    pool_run(jobs, n, pwrite_chunk, &p);
+
+    if (fseeko(fp, end, SEEK_SET) != 0) {
+        fprintf(stderr, "Failed to write output\n");
+        exit(1);
+    }
+
+    return 1;
+}
+
+void pwrite_chunk(void *ctx, int i) {
+    Placement *p = ctx;
+    Chunk *c = &p->ch[i];
+
+    size_t done = 0;
+    while (done < c->outlen) {
+        ssize_t r = pwrite(p->fd, c->out + done, c->outlen - done, c->off + done);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+
+        if (r < 0) {
+            fprintf(stderr, "Failed to write output: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        done += r;
+    }
+}
+
+// Translate one instruction, or several if they are fused. Returns the
+// last instruction translated.
+TokenList *write_inst(Writer *w, TokenList *inst, char *fname, char **curr_fn) {
+
+    char *label = NULL;
+    const char *why;
+    int entry;
+
+    if (w->tails) {
+        TokenList *last = write_tail(w, inst, fname, *curr_fn);
+
+        if (last)
+            return last;
+    }
+
+    if (w->iv) {
+        TokenList *last = write_reduced(w, inst, fname, curr_fn);
+
+        if (last)
+            return last;
+    }
+
+    if (!w->planned || inst == w->plan_end)
+        plan_slots(w, inst, fname, *curr_fn);
+
+    if (w->dead) {
+        TokenList *last = write_dead(w, inst, fname, *curr_fn);
+
+        if (last)
+            return last;
+    }
+
+    N();
+
+    if (inst->cmd == PUSH) {
+        TokenList *last = write_alloc(w, inst, fname, *curr_fn);
+
+        if (!last)
+            last = write_cond(w, inst, fname, *curr_fn);
+
+        if (!last)
+            last = write_fused(w, inst, fname, *curr_fn);
+
+        if (last)
+            return last;
+    }
+
+    if (inst->cmd == LABEL && w->unroll) {
+        TokenList *last = write_unrolled(w, inst, fname, curr_fn);
+
+        if (last)
+            return last;
+    }
+
+    if (inst->cmd == LABEL && w->ivs && !w->iv)
+        write_iv_init(w, inst, fname, curr_fn);
+
+    const CmdArg *argv = inst->argv;
+    switch (inst->cmd) {
+        case PUSH:
+        case POP:
+            write_stack(w,
+                    inst->cmd, argv[0].mem, argv[1].num,
+                    fname);
+            break;
+
+        case ARITHMETIC:
+            write_arithmetic(w, argv[0].op);
+            break;
+
+        case LABEL:
+        case GOTO:
+        case IF:
+            label = vm_label(*curr_fn, argv[0].name);
+
+            if (inst->cmd == LABEL)
+                write_label(w, label);
+            else
+                write_goto(w, inst->cmd, label);
+
+            free(label);
+            break;
+
+        case FUNCTION:
+            *curr_fn = argv[0].name;
+            w->fast = find_conv(w->conv, *curr_fn, &why);
+            w->refs = alias_refs(w->aliases, *curr_fn);
+
+            // Setting THIS moves up to the entry, which skips it
+            entry = w->fast ? -1 : self_entry(w->selfs, *curr_fn);
+            write_fn(w, *curr_fn, argv[1].num + iv_locals(w->ivs, *curr_fn), entry);
+
+            if (entry >= 0)
+                return inst->next->next;
+            break;
+
+        case RETURN:
+            write_ret(w);
+            break;
+
+        case CALL:
+            return write_conv_call(w, inst, fname, *curr_fn);
+
+        default: /* NOP */
+            break;
+    }
+
+    return inst;
+}
+
+int fusible(TokenList *inst) {
+    if (!inst)
+        return 0;
+
+    if (inst->cmd == POP)
+        return 1;
+
+    return inst->cmd == ARITHMETIC
+        && inst->argv[0].op != NEG && inst->argv[0].op != NOT;
+}
+
+TokenList *write_fused(Writer *w, TokenList *inst, char *fname, char *fn) {
+
+    TokenList *next = inst->next;
+    const CmdArg *argv = inst->argv;
+
+    Remark r = { "fusion", REMARK_APPLIED, fname, inst->line, fn, 0, 0,
+                 fn ? prof_count(w->opt->profile, "fn", fn) : -1 };
+
+    if (fusible(next)) {
+        if (next->cmd == POP) {
+            write_push_pop(w, argv[0].mem, argv[1].num,
+                           next->argv[0].mem, next->argv[1].num, fname);
+
+            r.words = r.cycles = -FUSE_POP_SAVES;
+            remark(w->remarks, &r, NULL, "fused 'push %s %d' into 'pop %s %d'",
+                   mem_name[argv[0].mem], argv[1].num,
+                   mem_name[next->argv[0].mem], next->argv[1].num);
+        } else {
+            write_push_op(w, argv[0].mem, argv[1].num, fname,
+                          next->argv[0].op);
+
+            r.words = r.cycles = -FUSE_OP_SAVES;
+            remark(w->remarks, &r, NULL, "fused 'push %s %d' into '%s'",
+                   mem_name[argv[0].mem], argv[1].num,
+                   op_name[next->argv[0].op]);
+        }
+
+        return next;
+    }
+
+    // A label is a jump target, so the ops around it can't be merged
+    while (next && next->cmd == LABEL)
+        next = next->next;
+
+    if (next != inst->next && fusible(next)) {
+        r.kind = REMARK_MISSED;
+        r.words = r.cycles = next->cmd == POP ? -FUSE_POP_SAVES : -FUSE_OP_SAVES;
+
+        remark(w->remarks, &r, "label between ops", "'push %s %d' not fused into '%s'",
+               mem_name[argv[0].mem], argv[1].num,
+               next->cmd == POP ? "pop" : op_name[next->argv[0].op]);
+    }
+
+    return NULL;
+}
+
+// Write `push constant N; call Memory.alloc 1` starting at inst with the
+// bump from Memory's region inline, returning the call, or NULL if inst
+// doesn't start one
+TokenList *write_alloc(Writer *w, TokenList *inst, char *fname, char *fn) {
+
+    TokenList *call = inst->next;
+
+    if (!w->opt->inline_alloc || inst->argv[0].mem != CONSTANT
+            || !call || call->cmd != CALL || call->argv[1].num != 1
+            || strcmp(call->argv[0].name, ALLOC_FN) != 0)
+        return NULL;
+
+    // The allocator keeps the region up itself
+    if (fn && strncmp(fn, ALLOC_FILE ".", strlen(ALLOC_FILE ".")) == 0)
+        return NULL;
+
+    Remark r = { "inline-alloc", REMARK_APPLIED, fname, inst->line, fn, 0, 0,
+                 fn ? prof_count(w->opt->profile, "fn", fn) : -1 };
+
+    // Statics Memory doesn't use have no address
+    if (w->statics && (table_find(w->statics, ALLOC_FILE ".0") < 0
+                || table_find(w->statics, ALLOC_FILE ".1") < 0)) {
+        r.kind = REMARK_MISSED;
+        remark(w->remarks, &r, "no region in " ALLOC_FILE "'s statics",
+               "'call %s' not inlined", ALLOC_FN);
+        return NULL;
+    }
+
+    int deref;
+    char *next = segment(w, STATIC, 0, ALLOC_FILE, &deref);
+    char *end = segment(w, STATIC, 1, ALLOC_FILE, &deref);
+    int n = inst->argv[1].num;
+
+    char slow[LABEL_BUF], done[LABEL_BUF];
+    long k = w->jcount++;
+    gen_label(w, GEN_ALLOC_SLOW, k, slow);
+    gen_label(w, GEN_ALLOC_DONE, k, done);
+
+    int start = w->pc;
+
+    CF(INLINE ALLOC %d, n);
+
+    // Room left past the n words
+    PF(@%s, end);
+    P(D=M);
+    PF(@%s, next);
+    P(D=D-M);
+    PF(@%d, n);
+    P(D=D-A);
+    PF(@%s, slow);
+    P(D;JLT);
+
+    // Take them, pushing where they start
+    PF(@%s, next);
+    P(D=M);
+    PF(@%d, n);
+    P(D=D+A);
+    PF(@%s, next);
+    P(M=D);
+    PF(@%d, n);
+    P(D=D-A);
+    P(@SP);
+    P(AM=M+1);
+    P(A=A-1);
+    P(M=D);
+    PF(@%s, done);
+    P(0;JMP);
+
+    int fast = w->pc - start;
+
+    // Or call it, with nothing after fused into this path alone
+    TokenList only = *call;
+    only.next = NULL;
+
+    LF(%s, slow);
+    N();
+    write_stack(w, PUSH, CONSTANT, n, fname);
+    write_conv_call(w, &only, fname, fn);
+    LF(%s, done);
+
+    w->planned = 0;
+
+    r.words = fast;
+    r.cycles = 2 * fast - (w->pc - start);
+    remark(w->remarks, &r, NULL, "'call %s' for %d words inlined", ALLOC_FN, n);
+
+    free(next);
+    free(end);
+
+    return call;
+}
+
+// Drop code plan_dead() found nothing reaches, and pops of what nothing
+// reads: with the push before them when there is one, else leaving only
+// the decrement of SP. Returns the last instruction dropped, or NULL if
+// inst isn't one.
+TokenList *write_dead(Writer *w, TokenList *inst, char *fname, char *fn) {
+
+    Remark r = { "dead-code", REMARK_APPLIED, fname, inst->line, fn, 0, 0,
+                 fn ? prof_count(w->opt->profile, "fn", fn) : -1 };
+
+    int n;
+    TokenList *last = dead_run(w->dead, inst, &n);
+
+    if (last) {
+        // What follows is a label, where the slots are planned again
+        w->planned = 0;
+
+        if (w->remarks) {
+            r.words = -write_cost(inst, n, fname, w->fast);
+            remark(w->remarks, &r, NULL, "%d instructions nothing reaches dropped", n);
+        }
+
+        return last;
+    }
+
+    TokenList *pop = inst->cmd == PUSH ? inst->next : inst;
+    if (!pop || pop->cmd != POP || !dead_store(w->dead, pop))
+        return NULL;
+
+    if (pop != inst) {
+        if (w->remarks) {
+            r.words = r.cycles = -write_cost(inst, 2, fname, w->fast);
+            remark(w->remarks, &r, NULL,
+                   "'push %s %d' into 'pop %s %d' nothing reads dropped",
+                   mem_name[inst->argv[0].mem], inst->argv[1].num,
+                   mem_name[pop->argv[0].mem], pop->argv[1].num);
+        }
+
+        return pop;
+    }
+
+    N();
+    C(POP DEAD);
+    P(@SP);
+    P(M=M-1);
+
+    if (w->remarks) {
+        r.words = r.cycles = 2 - write_cost(inst, 1, fname, w->fast);
+        remark(w->remarks, &r, NULL, "'pop %s %d' nothing reads left moving SP",
+               mem_name[pop->argv[0].mem], pop->argv[1].num);
+    }
+
+    return inst;
+}
+
+// Label the copy of a tail plan_tails() kept where inst starts it, or
+// jump to it where inst starts another. Returns the last instruction of
+// the copy jumped over, or NULL to write inst.
+TokenList *write_tail(Writer *w, TokenList *inst, char *fname, char *fn) {
+
+    const Tail *t = find_tail(w->tails, inst);
+    if (!t)
+        return NULL;
+
+    char buf[LABEL_BUF];
+    gen_label(w, GEN_TAIL, t->label, buf);
+
+    N();
+
+    if (!t->last) {
+        LF(%s, buf);
+        return NULL;
+    }
+
+    C(GOTO TAIL);
+    PF(@%s, buf);
+    P(0; JEQ);
+
+    // What follows is a label, where the slots are planned again
+    w->planned = 0;
+
+    Remark r = { "cross-jump", REMARK_APPLIED, fname, inst->line, fn, t->words,
+                 t->cycles, fn ? prof_count(w->opt->profile, "fn", fn) : -1 };
+    remark(w->remarks, &r, NULL, "%d instructions shared with the copy at line %d",
+           t->n, t->line);
+
+    return t->last;
+}
+
+// Write the counted loop headed by label inst the way plan_unroll()
+// chose, returning the goto closing it, or NULL to write it as it is
+TokenList *write_unrolled(Writer *w, TokenList *inst, char *fname, char **curr_fn) {
+
+    char *label = vm_label(*curr_fn, inst->argv[0].name);
+    const Loop *lp = find_loop(w->unroll, label);
+
+    if (!lp) {
+        free(label);
+        return NULL;
+    }
+
+    Remark r = { "unroll", lp->why ? REMARK_MISSED : REMARK_APPLIED, fname,
+                 inst->line, *curr_fn, lp->words, lp->cycles,
+                 *curr_fn ? prof_count(w->opt->profile, "fn", *curr_fn) : -1 };
+
+    if (lp->why) {
+        remark(w->remarks, &r, lp->why, "loop '%s' of %d iterations not unrolled",
+               inst->argv[0].name, lp->trips);
+        free(label);
+        return NULL;
+    }
+
+    TokenList *branch = inst->next;
+    while (branch->cmd != IF)
+        branch = branch->next;
+
+    TokenList *last = branch->next;
+    while (last->next->cmd != GOTO)
+        last = last->next;
+
+    int full = lp->factor == lp->trips;
+
+    CF(UNROLLED %s %d TIMES, inst->argv[0].name, lp->factor);
+
+    if (!full) {
+        write_label(w, label);
+        write_insts(w, inst->next, branch, fname, curr_fn);
+    }
+
+    for (int i = 0; i < lp->factor; ++i) {
+        w->planned = 0;
+        write_insts(w, branch->next, last, fname, curr_fn);
+    }
+
+    // The last copy's slots were planned up to the goto, which isn't
+    // written, so are planned again after it
+    w->planned = 0;
+
+    if (!full) {
+        write_goto(w, GOTO, label);
+        w->planned = 0;
+    }
+
+    if (full)
+        remark(w->remarks, &r, NULL, "loop '%s' of %d iterations unrolled fully",
+               inst->argv[0].name, lp->trips);
+    else
+        remark(w->remarks, &r, NULL, "loop '%s' of %d iterations unrolled %d times",
+               inst->argv[0].name, lp->trips, lp->factor);
+
+    free(label);
+
+    return last->next;
+}
+
+// Set up the pointers of the loop headed by label inst, if plan_ivs()
+// reduced it, before the label is written
+void write_iv_init(Writer *w, TokenList *inst, char *fname, char **curr_fn) {
+
+    char *label = vm_label(*curr_fn, inst->argv[0].name);
+    const IvLoop *lp = find_iv(w->ivs, label);
+
+    free(label);
+
+    if (!lp)
+        return;
+
+    Remark r = { "iv", lp->why ? REMARK_MISSED : REMARK_APPLIED, fname,
+                 inst->line, *curr_fn, lp->words, lp->cycles,
+                 *curr_fn ? prof_count(w->opt->profile, "fn", *curr_fn) : -1 };
+
+    if (lp->why) {
+        remark(w->remarks, &r, lp->why, "loop '%s' over '%s %d' not strength reduced",
+               inst->argv[0].name, mem_name[lp->mem], lp->num);
+        return;
+    }
+
+    TokenList code[IV_CODE + 1];
+    CmdArg argv[2 * IV_CODE];
+    int n = iv_code(lp, IV_INIT, 0, code, argv, inst);
+
+    CF(POINTERS FOR %s IN LOCAL %d, inst->argv[0].name, lp->local);
+    write_code(w, code, n, NULL, NULL, fname, curr_fn);
+
+    w->iv = lp;
+
+    remark(w->remarks, &r, NULL, "loop '%s' steps a pointer per array %s '%s %d'",
+           inst->argv[0].name, lp->keep ? "alongside" : "instead of",
+           mem_name[lp->mem], lp->num);
+}
+
+// Write inst the way it is in the loop w->iv reduces, returning the last
+// instruction written for, or NULL to write it as it is
+TokenList *write_reduced(Writer *w, TokenList *inst, char *fname, char **curr_fn) {
+
+    const IvLoop *lp = w->iv;
+    TokenList code[IV_CODE + 1];
+    CmdArg argv[2 * IV_CODE];
+    TokenList *last = NULL;
+    int n = 0;
+
+    if (inst == lp->back) {
+        w->iv = NULL;
+        return NULL;
+    }
+
+    if (inst == lp->step) {
+        last = inst->next->next->next;
+        n = iv_code(lp, IV_STEP, 0, code, argv, last->next);
+    } else if (inst == lp->test && !lp->keep) {
+        last = inst->next;
+        n = iv_code(lp, IV_TEST, 0, code, argv, last->next);
+    } else {
+        for (int i = 0; i < lp->nsite && !last; ++i) {
+            if (inst == lp->site[i]) {
+                last = inst->next->next;
+                n = iv_code(lp, IV_SITE, i, code, argv, last->next);
+            }
+        }
+    }
+
+    return last ? write_code(w, code, n, inst, last, fname, curr_fn) : NULL;
+}
+
+// Write the n instructions iv_code() put in code for first to last.
+// Returns last, or what was fused in past it.
+TokenList *write_code(Writer *w, TokenList *code, int n, TokenList *first,
+                      TokenList *last, char *fname, char **curr_fn) {
+
+    // Slots planned up to an instruction that isn't written are planned
+    // again, as they are after code
+    for (TokenList *it = first; it; it = it == last ? NULL : it->next)
+        if (it == w->plan_end)
+            w->planned = 0;
+
+    TokenList *it;
+    for (it = code; ; it = it->next) {
+        it = write_inst(w, it, fname, curr_fn);
+
+        if (it == &code[n - 1]) {
+            it = last;
+            break;
+        }
+
+        if (!within(it, code, n))
+            break;
+    }
+
+    if (within(w->plan_end, code, n))
+        w->planned = 0;
+
+    return it;
+}
+
+// Whether inst is one of the n in code
+int within(TokenList *inst, TokenList *code, int n) {
+
+    for (int i = 0; i < n; ++i)
+        if (inst == &code[i])
+            return 1;
+
+    return 0;
+}
+
+// Write first to last, as the loop in write_chunk() would
+void write_insts(Writer *w, TokenList *first, TokenList *last,
+                 char *fname, char **curr_fn) {
+
+    for (TokenList *it = first; ; it = it->next) {
+        it = write_inst(w, it, fname, curr_fn);
+
+        if (it == last)
+            break;
+    }
+}
+
+// The condition an if-goto tests, if inst starts it and it is built from
+// pushes and ops alone, with a test at the root. Nodes go in node.
+Cond *parse_cond(TokenList *inst, Cond *node) {
+
+    Cond *stack[COND_MAX];
+    int n = 0, depth = 0;
+
+    for (TokenList *it = inst; it; it = it->next) {
+
+        if (it->cmd == IF)
+            return depth == 1 && stack[0]->test ? stack[0] : NULL;
+
+        if (n == COND_MAX || (it->cmd != PUSH && it->cmd != ARITHMETIC))
+            return NULL;
+
+        Cond *c = &node[n++];
+        c->last = it;
+        c->test = 0;
+        c->x = c->y = NULL;
+
+        if (it->cmd == PUSH) {
+            c->first = it;
+            stack[depth++] = c;
+            continue;
+        }
+
+        RType op = it->argv[0].op;
+        int unary = op == NEG || op == NOT;
+
+        if (depth < (unary ? 1 : 2))
+            return NULL;
+
+        if (!unary)
+            c->y = stack[--depth];
+        c->x = stack[--depth];
+        c->first = c->x->first;
+
+        switch (op) {
+            case EQ:
+            case GT:
+            case LT:
+                c->test = 1;
+                break;
+
+            // Bitwise on anything else
+            case AND:
+            case OR:
+                c->test = c->x->test && c->y->test;
+                break;
+
+            case NOT:
+                c->test = c->x->test;
+                break;
+
+            default:
+                break;
+        }
+
+        stack[depth++] = c;
+    }
+
+    return NULL;
+}
+
+// Jump straight to an if-goto's label on the comparisons under it. Tests
+// are -1 or 0, so and, or and not of them only need the jumps, and the
+// rest of an and or or can be skipped once the first test decides it
+// since nothing in a condition has a side effect.
+TokenList *write_cond(Writer *w, TokenList *inst, char *fname, char *fn) {
+
+    Cond node[COND_MAX];
+    Cond *root = parse_cond(inst, node);
+
+    if (!root)
+        return NULL;
+
+    TokenList *branch = root->last->next;
+
+    char *label = vm_label(fn, branch->argv[0].name);
+    char buf[LABEL_BUF];
+    const char *sym = symbol(w, label, buf);
+
+    if (w->remarks) {
+        Writer t = *w;
+        t.fp = NULL;
+        t.remarks = NULL;
+        t.pc = 0;
+
+        write_run(&t, root->first, root->last, fname, fn);
+        write_goto(&t, IF, label);
+        int words = t.pc;
+
+        t.pc = 0;
+        write_jump(&t, root, 1, sym, fname, fn);
+
+        Remark r = { "short-circuit", REMARK_APPLIED, fname, inst->line, fn,
+                     t.pc - words, t.pc - words,
+                     fn ? prof_count(w->opt->profile, "fn", fn) : -1 };
+        remark(w->remarks, &r, NULL, "condition of 'if-goto %s' written as jumps",
+               branch->argv[0].name);
+    }
+
+    // Slots are set up where first used, which a jump may skip
+    for (int i = 0; i < NSLOT; ++i)
+        w->slot[i].num = -1;
+
+    C(IF-GOTO JUMPS);
+    write_jump(w, root, 1, sym, fname, fn);
+
+    w->planned = 0;
+    free(label);
+
+    return branch;
+}
+
+// Jump to label if c is true, or false if sense is 0, else fall through
+void write_jump(Writer *w, Cond *c, int sense, const char *label,
+                char *fname, char *fn) {
+
+    RType op = c->last->argv[0].op;
+    char skip[LABEL_BUF];
+    const char *jmp = NULL;
+
+    switch (op) {
+        case NOT:
+            write_jump(w, c->x, !sense, label, fname, fn);
+            break;
+
+        // Either test decides it one way, only both the other
+        case AND:
+        case OR:
+            if ((op == OR) == sense) {
+                write_jump(w, c->x, sense, label, fname, fn);
+                write_jump(w, c->y, sense, label, fname, fn);
+                break;
+            }
+
+            gen_label(w, GEN_COMPARE_END, w->jcount++, skip);
+
+            write_jump(w, c->x, !sense, skip, fname, fn);
+            write_jump(w, c->y, sense, label, fname, fn);
+
+            LF(%s, skip);
+            break;
+
+        default:
+            switch (op) {
+                case EQ: jmp = sense ? "JEQ" : "JNE"; break;
+                case LT: jmp = sense ? "JLT" : "JGE"; break;
+                case GT: jmp = sense ? "JGT" : "JLE"; break;
+                default:                              break;
+            }
+
+            write_diff(w, c->x, c->y, fname, fn);
+            PF(@%s, label);
+            PF(D;%s, jmp);
+            break;
+    }
+}
+
+// D = x - y, without the stack where either is a constant or register
+void write_diff(Writer *w, Cond *x, Cond *y, char *fname, char *fn) {
+
+    char *seg;
+
+    if (direct(w, y, fname, &seg)) {
+        write_into_d(w, x, fname, fn);
+
+        if (seg) {
+            PF(@%s, seg);
+            P(D=D-M);
+        } else if (y->first->argv[1].num == 1) {
+            P(D=D-1);
+        } else if (y->first->argv[1].num) {
+            PF(@%d, y->first->argv[1].num);
+            P(D=D-A);
+        }
+    } else if (direct(w, x, fname, &seg)) {
+        write_into_d(w, y, fname, fn);
+
+        if (seg) {
+            PF(@%s, seg);
+            P(D=M-D);
+        } else if (x->first->argv[1].num) {
+            PF(@%d, x->first->argv[1].num);
+            P(D=A-D);
+        } else {
+            P(D=-D);
+        }
+    } else {
+        if (x->first == x->last)
+            write_stack(w, PUSH, x->first->argv[0].mem, x->first->argv[1].num, fname);
+        else
+            write_run(w, x->first, x->last, fname, fn);
+
+        write_into_d(w, y, fname, fn);
+
+        P(@SP);
+        P(AM=M-1);
+        P(D=M-D);
+    }
+
+    free(seg);
+}
+
+// D = c
+void write_into_d(Writer *w, Cond *c, char *fname, char *fn) {
+
+    if (c->first == c->last) {
+        write_load(w, c->first->argv[0].mem, c->first->argv[1].num, fname);
+        return;
+    }
+
+    write_run(w, c->first, c->last, fname, fn);
+
+    P(@SP);
+    P(AM=M-1);
+    P(D=M);
+}
+
+// Whether c is a constant, or a push of a word at a fixed address, which
+// *seg is set to. *seg is NULL for constants, or to free.
+int direct(Writer *w, Cond *c, char *fname, char **seg) {
+
+    *seg = NULL;
+
+    if (c->first != c->last)
+        return 0;
 
+    int deref;
+    *seg = segment(w, c->first->argv[0].mem, c->first->argv[1].num, fname, &deref);
 
-void write_file_list(FILE *fp, FileList *fl) {
+    if (deref) {
+        free(*seg);
+        *seg = NULL;
+    }
 
-    char *curr_fn = NULL;
-    char *label = NULL;
+    return !deref;
+}
+
+// Write first to last, pushes and ops alone, as write_inst would
+void write_run(Writer *w, TokenList *first, TokenList *last,
+               char *fname, char *fn) {
+
+    for (TokenList *it = first; ; it = it->next) {
+        TokenList *end = it->cmd == PUSH ? write_fused(w, it, fname, fn) : NULL;
+
+        if (end)
+            it = end;
+        else if (it->cmd == PUSH)
+            write_stack(w, PUSH, it->argv[0].mem, it->argv[1].num, fname);
+        else
+            write_arithmetic(w, it->argv[0].op);
+
+        if (it == last)
+            break;
+    }
+}
+
+char *vm_label(char *fn, char *name) {
+    if (!fn)
+        fn = "null";
+
+    char *r = malloc(sizeof(char) * (strlen(fn) + strlen(name) + 2));
+    sprintf(r, "%s$%s", fn, name);
+
+    return r;
+}
+
+// Give the statics of each file, then of all files, consecutive slots in
+// RAM from STATIC_BASE. Indexes a file skips get no slot, and are
+// reported as unused.
+Table *alloc_statics(FileList *fl, FILE *map) {
 
-    write_preamble(fp, fl);
+    Table *r = new_table();
+    char *used = NULL;
+    int cap = 0;
 
     FileList *it;
     for (it = fl; it; it = it->next) {
 
+        int max = -1;
+
         TokenList *inst;
         for (inst = it->tl; inst; inst = inst->next) {
+            if ((inst->cmd != PUSH && inst->cmd != POP)
+                    || inst->argv[0].mem != STATIC)
+                continue;
+
+            int num = inst->argv[1].num;
+            if (num >= cap) {
+                int n = cap ? cap : 64;
+                while (n <= num)
+                    n *= 2;
+
+                used = realloc(used, n);
+                if (!used) {
+                    fprintf(stderr, "Failed to allocate memory\n");
+                    exit(1);
+                }
+
+                memset(used + cap, 0, n - cap);
+                cap = n;
+            }
 
-            N();
+            used[num] = 1;
+            if (num > max)
+                max = num;
+        }
 
-            const CmdArg *argv = inst->argv;
+        char *key = malloc(strlen(it->name) + 16);
+
+        for (int i = 0; i <= max; ++i) {
+            sprintf(key, "%s.%d", it->name, i);
+
+            if (used[i]) {
+                int slot = table_intern(r, key);
+
+                if (map)
+                    fprintf(map, "%s %d\n", key, STATIC_BASE + slot);
+            } else {
+                fprintf(stderr, "Warning: static %s is never used\n", key);
+
+                if (map)
+                    fprintf(map, "%s unused\n", key);
+            }
+
+            used[i] = 0;
+        }
+
+        free(key);
+    }
+
+    free(used);
+
+    if (STATIC_BASE + r->size > STATIC_TOP) {
+        fprintf(stderr,
+                "Too many statics (%d) to fit below the stack at %d\n",
+                r->size, STATIC_TOP);
+        exit(1);
+    }
+
+    return r;
+}
+
+// Give every function and VM label an id, in the order writing them
+// would come across them
+Table *collect_labels(FileList *fl) {
+
+    Table *r = new_table();
+    char *curr_fn = NULL;
+
+    table_intern(r, "Sys.init");
+
+    FileList *it;
+    for (it = fl; it; it = it->next) {
+
+        TokenList *inst;
+        for (inst = it->tl; inst; inst = inst->next) {
+
+            char *label;
             switch (inst->cmd) {
-                case PUSH:
-                case POP:
-                    write_stack(fp,
-                            inst->cmd, argv[0].mem, argv[1].num,
-                            it->name);
+                case FUNCTION:
+                    curr_fn = inst->argv[0].name;
+                    table_intern(r, curr_fn);
                     break;
 
-                case ARITHMETIC:
-                    write_arithmetic(fp, argv[0].op);
+                case CALL:
+                    table_intern(r, inst->argv[0].name);
                     break;
 
                 case LABEL:
                 case GOTO:
                 case IF:
-                    if (curr_fn) {
-                        label = malloc(sizeof(char) *
-                                       strlen(curr_fn) + strlen(argv[0].name) + 3);
-                        strcpy(label, curr_fn);
-                        strcat(label, "$");
-                    } else {
-                        label = malloc(sizeof(char) * strlen(argv[0].name + 2));
-                        strcpy(label, "null$");
-                    }
-
-                    strcat(label, argv[0].name);
+                    label = vm_label(curr_fn, inst->argv[0].name);
+                    table_intern(r, label);
+                    free(label);
+                    break;
 
-                    if (inst->cmd == LABEL)
-                        write_label(fp, label);
-                    else
-                        write_goto(fp, inst->cmd, label);
+                default: /* NOP */
                     break;
+            }
+        }
+    }
+
+    return r;
+}
+
+// Label to write for a function or VM label name, in buf if short
+const char *symbol(Writer *w, const char *name, char *buf) {
+
+    if (!w->labels)
+        return name;
+
+    int id = w->intern ? table_intern(w->labels, name)
+                       : table_find(w->labels, name);
+
+    if (id < 0) {
+        fprintf(stderr, "No short label for '%s'\n", name);
+        exit(1);
+    }
+
+    buf[0] = '$';
+    base36(buf + 1, id);
+
+    return buf;
+}
+
+const char *gen_label(Writer *w, int kind, long n, char *buf) {
+
+    if (w->labels) {
+        strcpy(buf, gen_short[kind]);
+        base36(buf + strlen(buf), n);
+    } else {
+        sprintf(buf, gen_long[kind], n);
+    }
+
+    return buf;
+}
+
+// One `short long` line per label, with * standing for the id in
+// labels made up here
+void write_label_map(FILE *fp, Table *labels) {
+
+    for (size_t i = 0; i < sizeof gen_long / sizeof *gen_long; ++i) {
+        const char *pct = strstr(gen_long[i], "%ld");
+        fprintf(fp, "%s* %.*s*%s\n", gen_short[i],
+                (int) (pct - gen_long[i]), gen_long[i], pct + 3);
+    }
+
+    char buf[LABEL_BUF];
+    for (int i = 0; i < labels->size; ++i) {
+        buf[0] = '$';
+        base36(buf + 1, i);
+        fprintf(fp, "%s %s\n", buf, table_key(labels, i));
+    }
+}
+
+void count_instrument(Writer *w, FileList *fl) {
+
+    char *curr_fn = NULL;
+    char *key;
+    int allocs = 0;
 
+    Table *seen = new_table();
+    Table *counters = new_table();
+
+    // Loop headers are labels some later branch jumps back to. An empty
+    // `label X; goto X` is an idle loop, not worth counting.
+    FileList *it;
+    for (it = fl; it; it = it->next) {
+
+        TokenList *inst, *prev = NULL;
+        for (inst = it->tl; inst; prev = inst, inst = inst->next) {
+
+            const CmdArg *argv = inst->argv;
+            switch (inst->cmd) {
                 case FUNCTION:
                     curr_fn = argv[0].name;
-                    write_fn(fp, curr_fn, argv[1].num);
-                    break;
 
-                case RETURN:
-                    write_ret(fp);
+                    key = counter_key("fn", curr_fn, NULL);
+                    table_intern(counters, key);
+                    free(key);
                     break;
 
                 case CALL:
-                    write_call(fp, argv[0].name, argv[1].num);
+                    key = counter_key("call", curr_fn ? curr_fn : "null",
+                                      argv[0].name);
+                    table_intern(counters, key);
+                    free(key);
+
+                    allocs |= strcmp(argv[0].name, "Memory.alloc") == 0;
+                    break;
+
+                case LABEL:
+                    key = vm_label(curr_fn, argv[0].name);
+                    table_intern(seen, key);
+                    free(key);
+                    break;
+
+                case GOTO:
+                case IF:
+                    key = vm_label(curr_fn, argv[0].name);
+                    if (table_find(seen, key) >= 0
+                            && !(prev && prev->cmd == LABEL
+                                 && strcmp(prev->argv[0].name, argv[0].name) == 0)) {
+                        char *loop = counter_key("loop", key, NULL);
+                        table_intern(counters, loop);
+                        free(loop);
+                    }
+                    free(key);
                     break;
 
                 default: /* NOP */
@@ -102,11 +1714,81 @@ void write_file_list(FILE *fp, FileList *fl) {
         }
     }
 
-    free_file_list(fl);
+    free_table(seen);
+
+    int counter_base = INSTR_TOP - 2 * counters->size;
+    if (counter_base < INSTR_MIN) {
+        fprintf(stderr,
+                "Too many counters (%d) to instrument\n", counters->size);
+        exit(1);
+    }
+
+    if (allocs)
+        fprintf(stderr,
+                "Warning: counters take RAM %d-%d from the top of the heap,\n"
+                "where Memory.alloc may place objects too\n",
+                counter_base, INSTR_TOP - 1);
+
+    FILE *map = w->opt->instrument;
+    fprintf(map, "# Counters take RAM %d-%d from the top of the heap, which\n"
+                 "# Memory doesn't know of. Objects placed there overwrite them.\n",
+            counter_base, INSTR_TOP - 1);
+    fprintf(map, "base %d\n", counter_base);
+    for (int i = 0; i < counters->size; ++i)
+        fprintf(map, "%d %s\n", i, table_key(counters, i));
+
+    w->counters = counters;
+    w->counter_base = counter_base;
+}
+
+char *counter_key(const char *kind, const char *name, const char *callee) {
+
+    int len = strlen(kind) + strlen(name) + 2;
+    if (callee)
+        len += strlen(callee) + 1;
+
+    char *r = malloc(sizeof(char) * len);
+
+    if (callee)
+        sprintf(r, "%s %s %s", kind, name, callee);
+    else
+        sprintf(r, "%s %s", kind, name);
+
+    return r;
+}
+
+void write_counter(Writer *w, const char *kind, const char *name,
+                   const char *callee) {
+
+    if (!w->counters)
+        return;
+
+    char *key = counter_key(kind, name, callee);
+    int id = table_find(w->counters, key);
+    free(key);
+
+    if (id < 0)
+        return;
+
+    char skip[LABEL_BUF];
+    gen_label(w, GEN_INSTR_SKIP, w->icount, skip);
+    ++w->icount;
+
+    C(INSTRUMENT);
+
+    // Bump the low word, carry into the high word on wrap
+    PF(@%d, w->counter_base + 2 * id);
+    P(M=M+1);
+    P(D=M);
+    PF(@%s, skip);
+    P(D;JNE);
+    PF(@%d, w->counter_base + 2 * id + 1);
+    P(M=M+1);
+    LF(%s, skip);
 }
 
 
-void write_preamble(FILE *fp, FileList *fl) {
+void write_preamble(Writer *w, FileList *fl) {
 
     //static const struct {
     //    char *seg;
@@ -128,8 +1810,10 @@ void write_preamble(FILE *fp, FileList *fl) {
     P(M=D);
 
     N();
-    //write_call(fp, "Sys.init", 0);
-    P(@Sys.init);
+    //write_call(w, "Sys.init", 0);
+    char buf[LABEL_BUF];
+    const char *init = symbol(w, "Sys.init", buf);
+    PF(@%s, init);
     P(0;JMP);
 
     //for (int i = 0; i < sizeof(regs)/sizeof(regs[0]); ++i) {
@@ -142,142 +1826,376 @@ void write_preamble(FILE *fp, FileList *fl) {
     C(PREAMBLE END);
 }
 
-void write_arithmetic(FILE *fp, RType op) {
+void write_arithmetic(Writer *w, RType op) {
+
+    CF(ARITHMETIC %s, op_name[op]);
+
+    // Dereference
+    P(@SP);
+    P(AM=M-1);
+
+    // Single operand operations
+    if (op == NOT) {
+        P(M=!M);
+        P(@SP);
+        P(M=M+1);
+        return;
+    }
+
+    if (op == NEG) {
+        P(M=-M);
+        P(@SP);
+        P(M=M+1);
+        return;
+    }
+
+    // Pop next item
+    P(D=M);
+    P(A=A-1);
+
+    write_binary(w, op);
+}
+
+// Apply a binary op with the left operand in M and the right one in D.
+// The result replaces M.
+void write_binary(Writer *w, RType op) {
+
+    char opsym = 0;
+    int comp = 0;
+    switch(op) {
+        case ADD:   opsym = '+'; break;
+
+        case EQ:
+        case GT:
+        case LT:    comp = 1;
+        case SUB:   opsym = '-'; break;
+
+        case AND:   opsym = '&'; break;
+        case OR:    opsym = '|'; break;
+
+        default: /* UNREACHABLE */
+            break;
+    }
+
+    // Comparison operators
+    if (comp) {
+        char t[LABEL_BUF], end[LABEL_BUF];
+        gen_label(w, GEN_COMPARE_TRUE, w->jcount, t);
+        gen_label(w, GEN_COMPARE_END, w->jcount, end);
+        ++w->jcount;
+
+        PF(D=M%cD, opsym);
+        PF(@%s, t);
+
+        switch (op) {
+            case EQ: P(D;JEQ); break;
+            case LT: P(D;JLT); break;
+            case GT: P(D;JGT); break;
+            default:           break;
+        }
+
+        // If false
+        P(@SP);
+        P(A=M-1);
+        P(M=0);
+        PF(@%s, end);
+        P(0;JMP);
+
+        // If true
+        LF(%s, t);
+        P(@SP);
+        P(A=M-1);
+        P(M=-1);
+
+        LF(%s, end);
+    } else {
+        PF(M=M%cD, opsym);
+    }
+}
+
+// Symbol holding a segment, NULL for constants. Sets *deref if the symbol
+// holds a base address rather than the value itself.
+char *segment(Writer *w, Memory mem, int num, char *fname, int *deref) {
+
+    char *seg = NULL;
+    *deref = 0;
+
+    // A fast function has its arguments in registers
+    if (mem == ARGUMENT && w->fast) {
+        seg = malloc(sizeof(char) * 16);
+        sprintf(seg, "R%d", 13 + num);
+
+        return seg;
+    }
+
+    switch (mem) {
+        case ARGUMENT: *deref = 1; seg = "ARG";  break;
+        case LOCAL:    *deref = 1; seg = "LCL";  break;
+        case THIS:     *deref = 1; seg = "THIS"; break;
+        case THAT:     *deref = 1; seg = "THAT"; break;
+        case POINTER:
+            if      (num == 0)     seg = "THIS";
+            else if (num == 1)     seg = "THAT";
+            break;
+
+        case TEMP:
+        case STATIC:
+            /* NOP */
+            break;
+
+        case CONSTANT:
+            return NULL;
+    }
+
+    if (seg) {
+        char *r = malloc(sizeof(char) * (strlen(seg) + 1));
+        strcpy(r, seg);
+
+        return r;
+    }
+
+    int len;
+    if (num <= 0) // log not defined for 0
+        len = 2;
+    else
+        len = (int) floor(log10(num) + 2);
+
+    if (mem == STATIC) {
+        seg = malloc(sizeof(char) * (strlen(fname) + len + 1));
+        sprintf(seg, "%s.%d", fname, num);
+
+        if (w->statics) {
+            int slot = table_find(w->statics, seg);
+            sprintf(seg, "%d", STATIC_BASE + slot);
+        }
+    } else {
+        seg = malloc(sizeof(char) * (len + 2));
+        sprintf(seg, "R%d", num + 5);
+    }
+
+    return seg;
+}
+
+// Keep the addresses of the slots a run of stack ops uses most in R13
+// to R15. The run ends where control can join or leave, at a call, and
+// after anything that could move a segment: a pop to pointer, this or
+// that. Any label LF() writes ends it too, so one written while the
+// run's instructions are skipped can't carry it on.
+void plan_slots(Writer *w, TokenList *inst, char *fname, char *fn) {
+
+    struct {
+        Memory mem;
+        int num;
+        int push;
+        int pop;
+    } use[64];
+    int nuse = 0;
+    int pops = 0;   // Pops through a segment, which need a scratch register
+
+    w->planned = 1;
+    for (int i = 0; i < NSLOT; ++i)
+        w->slot[i].num = -1;
+
+    TokenList *it;
+    for (it = inst; it; it = it->next) {
+        if (it->cmd != PUSH && it->cmd != POP && it->cmd != ARITHMETIC)
+            break;
+
+        if (it->cmd == ARITHMETIC)
+            continue;
+
+        Memory mem = it->argv[0].mem;
+        int num = it->argv[1].num;
+
+        if (mem == LOCAL || mem == ARGUMENT || mem == THIS || mem == THAT) {
+            int k;
+            for (k = 0; k < nuse; ++k)
+                if (use[k].mem == mem && use[k].num == num)
+                    break;
+
+            if (k == nuse && nuse < 64) {
+                use[k].mem = mem;
+                use[k].num = num;
+                use[k].push = use[k].pop = 0;
+                ++nuse;
+            }
+
+            if (it->cmd == POP)
+                ++pops;
+
+            if (k < nuse) {
+                if (it->cmd == PUSH)
+                    ++use[k].push;
+                else
+                    ++use[k].pop;
+            }
+        }
+
+        if (it->cmd == POP && (mem == POINTER || mem == THIS || mem == THAT)) {
+            it = it->next;
+            break;
+        }
+    }
+
+    // Plan again at whatever follows an instruction outside any run, as
+    // that may be written along with the instruction after it
+    if (it == inst) {
+        w->planned = 0;
+        return;
+    }
+
+    w->plan_end = it;
+
+    // Fast functions have no registers to spare
+    if (w->fast)
+        return;
+
+    for (int n = 0; n < NSLOT; ++n) {
+        int best = -1, gain = 0;
+
+        for (int k = 0; k < nuse; ++k) {
+            int g = use[k].push * SLOT_PUSH_SAVES + use[k].pop * SLOT_POP_SAVES
+                  - (use[k].num > 1 ? SLOT_SETUP : SLOT_NEAR_SETUP);
+
+            if (g > gain) {
+                best = k;
+                gain = g;
+            }
+        }
+
+        if (best < 0)
+            break;
+
+        // Pops through a segment not kept need one register free
+        pops -= use[best].pop;
+        if (n == NSLOT - 1 && pops > 0)
+            break;
+
+        w->slot[n].mem = use[best].mem;
+        w->slot[n].num = use[best].num;
+        w->slot[n].ready = 0;
+
+        Remark r = { "scratch-regs", REMARK_APPLIED, fname, inst->line, fn,
+                     -gain, -gain,
+                     fn ? prof_count(w->opt->profile, "fn", fn) : -1 };
+        remark(w->remarks, &r, NULL, "address of '%s %d' kept in R%d for %d pushes and %d pops",
+               mem_name[use[best].mem], use[best].num, 13 + n,
+               use[best].push, use[best].pop);
+
+        use[best].push = use[best].pop = 0;
+    }
+}
+
+// Register holding the address of a slot, computing it the first time,
+// or 0 if it isn't kept in one
+int slot_reg(Writer *w, Memory mem, int num) {
 
-    C(ARITHMETIC INSTRUCTION);
+    int i;
+    for (i = 0; i < NSLOT; ++i)
+        if (w->slot[i].num == num && w->slot[i].mem == mem)
+            break;
 
-    static long JCOUNT = 0;
+    if (i == NSLOT)
+        return 0;
 
-    // Dereference
-    P(@SP);
-    P(AM=M-1);
+    if (!w->slot[i].ready) {
+        int deref;
+        char *seg = segment(w, mem, num, NULL, &deref);
 
-    // Single operand operations
-    if (op == NOT) {
-        P(M=!M);
-        P(@SP);
-        P(M=M+1);
-        return;
-    }
+        if (num == 0) {
+            PF(@%s, seg);
+            P(D=M);
+        } else if (num == 1) {
+            PF(@%s, seg);
+            P(D=M+1);
+        } else {
+            PF(@%d, num);
+            P(D=A);
+            PF(@%s, seg);
+            P(D=M+D);
+        }
 
-    if (op == NEG) {
-        P(M=-M);
-        P(@SP);
-        P(M=M+1);
-        return;
+        PF(@R%d, 13 + i);
+        P(M=D);
+
+        free(seg);
+        w->slot[i].ready = 1;
     }
 
-    // Pop next item
-    P(D=M);
-    P(A=A-1);
+    return 13 + i;
+}
 
-    char opsym = 0;
-    int comp = 0;
-    switch(op) {
-        case ADD:   opsym = '+'; break;
+// Register a pop through a segment keeps its address in. Fast functions
+// have their arguments in R13 and R14, and nothing else uses R15 while
+// they run.
+const char *scratch(Writer *w) {
 
-        case EQ:
-        case GT:
-        case LT:    comp = 1;
-        case SUB:   opsym = '-'; break;
+    static const char *reg[NSLOT] = { "R13", "R14", "R15" };
 
-        case AND:   opsym = '&'; break;
-        case OR:    opsym = '|'; break;
+    if (w->fast)
+        return "R15";
 
-        default: /* UNREACHABLE */
-            break;
-    }
+    for (int i = 0; i < NSLOT; ++i)
+        if (w->slot[i].num < 0)
+            return reg[i];
 
-    // Comparison operators
-    if (comp) {
-        PF(D=M%cD, opsym);
-        PF(@__COMPARE_TRUE_%ld__, JCOUNT);
+    return "R13";
+}
 
-        switch (op) {
-            case EQ: P(D;JEQ); break;
-            case LT: P(D;JLT); break;
-            case GT: P(D;JGT); break;
-            default:           break;
-        }
+// Load a segment's value into D
+void write_load(Writer *w, Memory mem, int num, char *fname) {
 
-        // If false
-        P(@SP);
-        P(A=M-1);
-        P(M=0);
-        PF(@__COMPARE_END_%ld__, JCOUNT);
-        P(0;JMP);
+    int reg = slot_reg(w, mem, num);
+    if (reg) {
+        PF(@R%d, reg);
+        P(A=M);
+        P(D=M);
+        return;
+    }
 
-        // If true
-        LF(__COMPARE_TRUE_%ld__, JCOUNT);
-        P(@SP);
-        P(A=M-1);
-        P(M=-1);
+    int deref;
+    char *seg = segment(w, mem, num, fname, &deref);
 
-        LF(__COMPARE_END_%ld__, JCOUNT);
-        ++JCOUNT;
-    } else {
-        PF(M=M%cD, opsym);
+    // Load num
+    if (deref || mem == CONSTANT) {
+        PF(@%d, num);
+        P(D=A);
     }
-}
 
-void write_stack(FILE *fp, CommandType cmd, Memory mem, int num, char *fname) {
+    // Load register and dereference if necessary
+    if (mem != CONSTANT) {
+        PF(@%s, seg);
 
-    int deref = 0, dofree = 0;
-    char *seg = NULL;
+        if (deref)
+            P(A=M+D);
 
-    switch (mem) {
-        case ARGUMENT: deref = 1; seg = "ARG";  break;
-        case LOCAL:    deref = 1; seg = "LCL";  break;
-        case THIS:     deref = 1; seg = "THIS"; break;
-        case THAT:     deref = 1; seg = "THAT"; break;
-        case POINTER:
-            if      (num == 0)    seg = "THIS";
-            else if (num == 1)    seg = "THAT";
-            break;
+        P(D=M);
+    }
 
-        case TEMP:
-        case STATIC:
-            dofree = 1;
+    free(seg);
+}
 
-            int len;
-            if (num <= 0) // log not defined for 0
-                len = 2;
-            else
-                len = (int) floor(log10(num) + 2);
+// Store D where A points, in mem. With --alias, the model keeps what
+// it knows of registers and statics over stores to the frame and heap.
+void write_store(Writer *w, Memory mem) {
 
-            seg = malloc(sizeof(char) * len);
+    Region r = alias_region(w->refs, mem);
+    w->regs.high = w->aliases && !alias_may(r, REGION_BASE)
+                && !alias_may(r, REGION_TEMP) && !alias_may(r, REGION_STATIC);
 
-            if (mem == STATIC)
-                sprintf(seg, "%s.%d", fname, num);
-            else if (mem == TEMP)
-                sprintf(seg, "R%d", num + 5);
+    P(M=D);
+}
 
-            break;
+void write_stack(Writer *w, CommandType cmd, Memory mem, int num, char *fname) {
 
-        case CONSTANT:
-            // Handled below
-            /* NOP */
-            break;
-    }
+    int deref, reg;
+    char *seg;
+    const char *tmp = scratch(w);
 
     switch (cmd) {
         case PUSH:
             C(PUSH);
-            // Load num
-            if (deref || mem == CONSTANT) {
-                PF(@%d, num);
-                P(D=A);
-            }
-
-            // Load register and dereference if necessary
-            if (mem != CONSTANT) {
-                PF(@%s, seg);
-
-                if (deref)
-                    P(A=M+D);
-
-                P(D=M);
-            }
+            write_load(w, mem, num, fname);
 
             // Push
             P(@SP);
@@ -289,6 +2207,20 @@ void write_stack(FILE *fp, CommandType cmd, Memory mem, int num, char *fname) {
 
         case POP:
             C(POP);
+
+            reg = slot_reg(w, mem, num);
+            if (reg) {
+                P(@SP);
+                P(AM=M-1);
+                P(D=M);
+                PF(@R%d, reg);
+                P(A=M);
+                write_store(w, mem);
+                break;
+            }
+
+            seg = segment(w, mem, num, fname, &deref);
+
             // Store ptr for later use
             if (deref) {
                 PF(@%d, num);
@@ -296,7 +2228,7 @@ void write_stack(FILE *fp, CommandType cmd, Memory mem, int num, char *fname) {
                 PF(@%s, seg);
                 P(D=M+D);
 
-                P(@R13);
+                PF(@%s, tmp);
                 P(M=D);
             }
 
@@ -306,9 +2238,9 @@ void write_stack(FILE *fp, CommandType cmd, Memory mem, int num, char *fname) {
             P(D=M);
 
             if (deref) {
-                P(@R13);
+                PF(@%s, tmp);
                 P(A=M);
-                P(M=D);
+                write_store(w, mem);
             } else {
                 PF(@%s, seg);
                 P(M=D);
@@ -317,23 +2249,86 @@ void write_stack(FILE *fp, CommandType cmd, Memory mem, int num, char *fname) {
             // Decrement stack
             P(@SP);
             P(M=M-1);
+
+            free(seg);
             break;
 
         default: /* UNREACHABLE */
             break;
     }
+}
 
-    if (dofree)
-        free(seg);
+// push X; op  --  apply op to the stack top and X without pushing X
+void write_push_op(Writer *w, Memory mem, int num, char *fname, RType op) {
+
+    CF(FUSED PUSH %s, op_name[op]);
+
+    write_load(w, mem, num, fname);
+
+    P(@SP);
+    P(A=M-1);
+
+    write_binary(w, op);
+}
+
+// push X; pop Y  --  copy X to Y without going through the stack
+void write_push_pop(Writer *w, Memory src, int snum, Memory dst, int dnum,
+                    char *fname) {
+
+    C(FUSED PUSH POP);
+
+    int reg = slot_reg(w, dst, dnum);
+    if (reg) {
+        write_load(w, src, snum, fname);
+
+        PF(@R%d, reg);
+        P(A=M);
+        write_store(w, dst);
+        return;
+    }
+
+    int deref;
+    char *seg = segment(w, dst, dnum, fname, &deref);
+    const char *tmp = scratch(w);
+
+    if (deref) {
+        PF(@%d, dnum);
+        P(D=A);
+        PF(@%s, seg);
+        P(D=M+D);
+
+        PF(@%s, tmp);
+        P(M=D);
+    }
+
+    write_load(w, src, snum, fname);
+
+    if (deref) {
+        PF(@%s, tmp);
+        P(A=M);
+        write_store(w, dst);
+    } else {
+        PF(@%s, seg);
+        P(M=D);
+    }
+
+    free(seg);
 }
 
-void write_label(FILE *fp, char *label) {
-    LF(%s, label);
+void write_label(Writer *w, char *label) {
+    char buf[LABEL_BUF];
+    const char *sym = symbol(w, label, buf);
+
+    LF(%s, sym);
+    write_counter(w, "loop", label, NULL);
 }
 
-void write_goto(FILE *fp, CommandType cmd, char *label) {
-    C(GOTO);
+void write_goto(Writer *w, CommandType cmd, char *label) {
+    char buf[LABEL_BUF];
+    label = (char*) symbol(w, label, buf);
+
     if (cmd == IF) {
+        C(IF-GOTO);
         P(@SP);
         P(AM=M-1);
         P(D=M);
@@ -342,16 +2337,49 @@ void write_goto(FILE *fp, CommandType cmd, char *label) {
         P(D; JNE);
 
     } else if (cmd == GOTO) {
+        C(GOTO);
         PF(@%s, label);
         P(0; JEQ);
     }
 }
 
-void write_fn(FILE *fp, char *name, int varc) {
+// With entry, write the `push argument 0; pop pointer 0` it starts with
+// before the locals, and that entry past it
+void write_fn(Writer *w, char *name, int varc, int entry) {
     CF(==== BEGIN FN $%s DEF ====, name);
 
     // Function label
-    LF(%s, name);
+    char buf[LABEL_BUF];
+    const char *sym = symbol(w, name, buf);
+    LF(%s, sym);
+
+    if (entry >= 0) {
+        C(THIS FROM ARGUMENT 0);
+        P(@ARG);
+        P(A=M);
+        P(D=M);
+        P(@THIS);
+        P(M=D);
+
+        LF(%s, gen_label(w, GEN_THIS_ENTRY, entry, buf));
+    }
+
+    // Save what a fast function changes above its return address
+    if (w->fast) {
+        if (w->fast->saves & CONV_THIS)
+            push_reg(w, "THIS");
+        if (w->fast->saves & CONV_THAT)
+            push_reg(w, "THAT");
+
+        if (w->fast->framed) {
+            push_reg(w, "LCL");
+
+            P(@SP);
+            P(D=M);
+            P(@LCL);
+            P(M=D);
+        }
+    }
 
     // Inc SP
     if (varc) {
@@ -360,9 +2388,17 @@ void write_fn(FILE *fp, char *name, int varc) {
         P(@SP);
         P(M=D+M);
     }
+
+    write_counter(w, "fn", name, NULL);
 }
 
-void write_ret(FILE *fp) {
+void write_ret(Writer *w) {
+
+    if (w->fast) {
+        write_fast_ret(w);
+        return;
+    }
+
     C(RETURN);
 
     // Prepare frame
@@ -406,14 +2442,21 @@ void write_ret(FILE *fp) {
     C(==== END FN DEF ====);
 }
 
-void write_call(FILE *fp, char *name, int argc) {
+// Call name at its label, or with entry past where it sets THIS
+void write_call(Writer *w, char *caller, char *name, int argc, int entry) {
 
-    static long CLLCOUNT = 0;
+    write_counter(w, "call", caller ? caller : "null", name);
 
     CF(CALL $%s, name);
 
+    char ret[LABEL_BUF], buf[LABEL_BUF];
+    const char *sym = entry >= 0 ? gen_label(w, GEN_THIS_ENTRY, entry, buf)
+                                 : symbol(w, name, buf);
+    gen_label(w, GEN_CALL_RETURN, w->ccount, ret);
+    ++w->ccount;
+
     // Save return addr
-    PF(@__CALL_COUNT_%ld__, CLLCOUNT);
+    PF(@%s, ret);
     P(D=A);
     P(@SP);
     P(A=M);
@@ -446,7 +2489,252 @@ void write_call(FILE *fp, char *name, int argc) {
     P(M=D);
 
     // GOTO
-    PF(@%s, name);
+    PF(@%s, sym);
+    P(0; JMP);
+    LF(%s, ret);
+}
+
+// Call with whichever convention the callee has. A fast call returns the
+// value in D, so a pop straight after takes it from there. Returns the
+// last instruction translated.
+TokenList *write_conv_call(Writer *w, TokenList *inst, char *fname, char *fn) {
+
+    const CmdArg *argv = inst->argv;
+    const char *why;
+    const Conv *c = find_conv(w->conv, argv[0].name, &why);
+    int entry = c ? -1 : self_call(w->selfs, inst);
+
+    if (entry >= 0 && w->remarks) {
+        Remark r = { "self-call", REMARK_APPLIED, fname, inst->line, fn, 0,
+                     -THIS_ENTRY_SAVES,
+                     fn ? prof_count(w->opt->profile, "fn", fn) : -1 };
+        remark(w->remarks, &r, NULL, "'%s' entered past setting THIS to the this passed",
+               argv[0].name);
+    }
+
+    if (!c && !why) {
+        write_call(w, fn, argv[0].name, argv[1].num, entry);
+        return inst;
+    }
+
+    // Whatever comes next has to be written before the labels move on
+    TokenList *next = inst->next;
+    int deref = 1;
+    char *seg = NULL;
+
+    if (c && next && next->cmd == POP && next->argv[0].mem != CONSTANT) {
+        seg = segment(w, next->argv[0].mem, next->argv[1].num, fname, &deref);
+        if (deref) {
+            free(seg);
+            seg = NULL;
+        }
+    }
+
+    if (w->remarks) {
+        Remark r = { "fast-call", c ? REMARK_APPLIED : REMARK_MISSED,
+                     fname, inst->line, fn, 0, 0,
+                     fn ? prof_count(w->opt->profile, "fn", fn) : -1 };
+
+        // As if it were frameless and saved nothing, when it isn't fast
+        Conv guess = { NULL, argv[1].num, 0, 0 };
+        const Conv *as = c ? c : &guess;
+        TokenList *pop = seg ? next : NULL;
+
+        char *name = argv[0].name;
+        if (as->argc <= CONV_ARGS) {
+            r.words  = call_words(w, as, name, pop, 0, fname)
+                     - call_words(w, NULL, name, pop, 0, fname);
+            r.cycles = call_words(w, as, name, pop, 1, fname)
+                     - call_words(w, NULL, name, pop, 1, fname);
+        }
+
+        if (c)
+            remark(w->remarks, &r, NULL, "'%s' called with the fast convention",
+                   argv[0].name);
+        else
+            remark(w->remarks, &r, why, "'%s' called with the standard convention",
+                   argv[0].name);
+    }
+
+    if (!c) {
+        write_call(w, fn, argv[0].name, argv[1].num, entry);
+        return inst;
+    }
+
+    write_fast_call(w, fn, argv[0].name, argv[1].num);
+
+    // The value is only in D, so a pop nothing reads needs no code
+    if (next && next->cmd == POP && dead_store(w->dead, next)) {
+        free(seg);
+        return next;
+    }
+
+    if (seg) {
+        N();
+        C(POP);
+        PF(@%s, seg);
+        P(M=D);
+
+        free(seg);
+        return next;
+    }
+
+    // Push the value
+    P(@SP);
+    P(AM=M+1);
+    P(A=A-1);
+    P(M=D);
+
+    return inst;
+}
+
+// Arguments go in R13 and R14 and the return address where the first
+// one was, or on top of the stack if there are none
+void write_fast_call(Writer *w, char *caller, char *name, int argc) {
+
+    write_counter(w, "call", caller ? caller : "null", name);
+
+    CF(CALL $%s, name);
+
+    char ret[LABEL_BUF], buf[LABEL_BUF];
+    const char *sym = symbol(w, name, buf);
+    gen_label(w, GEN_CALL_RETURN, w->ccount, ret);
+    ++w->ccount;
+
+    for (int i = argc - 1; i > 0; --i) {
+        P(@SP);
+        P(AM=M-1);
+        P(D=M);
+        PF(@R%d, 13 + i);
+        P(M=D);
+    }
+
+    if (argc) {
+        P(@SP);
+        P(A=M-1);
+        P(D=M);
+        P(@R13);
+        P(M=D);
+
+        PF(@%s, ret);
+        P(D=A);
+        P(@SP);
+        P(A=M-1);
+        P(M=D);
+    } else {
+        PF(@%s, ret);
+        P(D=A);
+        P(@SP);
+        P(AM=M+1);
+        P(A=A-1);
+        P(M=D);
+    }
+
+    PF(@%s, sym);
+    P(0; JMP);
+    LF(%s, ret);
+}
+
+// Return the value in D, popping what the function saved
+void write_fast_ret(Writer *w) {
+    C(RETURN);
+
+    const Conv *c = w->fast;
+
+    P(@SP);
+    P(AM=M-1);
+    P(D=M);
+
+    if (c->saves || c->framed) {
+        P(@R13);
+        P(M=D);
+
+        if (c->framed) {
+            P(@LCL);
+            P(D=M);
+            P(@SP);
+            P(M=D);
+
+            pop_reg(w, "LCL");
+        }
+
+        if (c->saves & CONV_THAT)
+            pop_reg(w, "THAT");
+        if (c->saves & CONV_THIS)
+            pop_reg(w, "THIS");
+
+        P(@R13);
+        P(D=M);
+    }
+
+    P(@SP);
+    P(AM=M-1);
+    P(A=M);
     P(0; JMP);
-    LF(__CALL_COUNT_%ld__, CLLCOUNT++);
+
+    C(==== END FN DEF ====);
+}
+
+// Words a call to name takes with convention c, NULL for the standard
+// one, and then the pop after if any. With ret, the callee's
+// return and prologue too, which is what a call costs in cycles.
+int call_words(const Writer *w, const Conv *c, char *name,
+               TokenList *pop, int ret, char *fname) {
+
+    Writer t = *w;
+    t.fp = NULL;
+    t.remarks = NULL;
+    t.counters = NULL;
+    t.pc = 0;
+    t.fast = NULL;
+
+    if (c) {
+        write_fast_call(&t, NULL, name, c->argc);
+        t.pc += pop ? 2 : 4;
+    } else {
+        write_call(&t, NULL, name, 0, -1);
+        if (pop)
+            write_stack(&t, POP, pop->argv[0].mem, pop->argv[1].num, fname);
+    }
+
+    if (ret) {
+        t.fast = c;
+        write_fn(&t, name, 0, -1);
+        write_ret(&t);
+    }
+
+    return t.pc;
+}
+
+void push_reg(Writer *w, const char *reg) {
+    PF(@%s, reg);
+    P(D=M);
+    P(@SP);
+    P(AM=M+1);
+    P(A=A-1);
+    P(M=D);
+}
+
+void pop_reg(Writer *w, const char *reg) {
+    P(@SP);
+    P(AM=M-1);
+    P(D=M);
+    PF(@%s, reg);
+    P(M=D);
+}
+
+void base36(char *buf, long n) {
+    static const char digit[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+    char tmp[LABEL_BUF];
+    int len = 0;
+
+    do {
+        tmp[len++] = digit[n % 36];
+        n /= 36;
+    } while (n);
+
+    for (int i = 0; i < len; ++i)
+        buf[i] = tmp[len - 1 - i];
+    buf[len] = '\0';
 }
@@ -1 +1,41 @@
-void write_file_list(FILE *fp, FileList *fl);
+typedef struct WriteOptions {
+    FILE *instrument;   // Counter map for --instrument, NULL when off
+    Profile *profile;   // Execution profile from --profile, may be NULL
+    FILE *remarks;      // JSON optimization remarks, NULL when off
+    int jobs;           // Threads translating functions
+    int short_labels;   // Emit labels as short base-36 ids
+    FILE *label_map;    // Short ids back to label names, may be NULL
+    int alloc_statics;  // Give statics numeric addresses from 16
+    FILE *static_map;   // Where each static went, may be NULL
+    int fast_calls;     // Call leaf functions with the fast convention
+    int unroll;         // ROM words a counted loop may grow by, 0 for off
+    int reduce_ivs;     // Step pointers into arrays loops walk by a counter
+    int inline_alloc;   // Allocate constant sizes from Memory's region inline
+    int alias;          // Keep what stores to other regions can't change
+    int dead_code;      // Drop stores nothing reads and code nothing reaches
+    int size;           // Favour fewer words over cycles
+    int self_calls;     // Enter methods past setting THIS from calls on this
+} WriteOptions;
+
+typedef struct WriteStream WriteStream;
+
+// Calling convention, from conv.h
+struct Conv;
+
+// Where a stream is up to. What the next piece of input translates to
+// depends only on this and the piece.
+typedef struct WriteMark {
+    int pc;
+    long jcount;
+    long ccount;
+    long icount;
+    const char *fn;     // Owned by the stream, copy it to keep it
+} WriteMark;
+
+void write_file_list(FILE *fp, FileList *fl, const WriteOptions *opt);
+WriteStream *write_begin(FILE *fp, const WriteOptions *opt);
+void write_tokens(WriteStream *s, FILE *fp, TokenList *tl, char *fname);
+void write_end(WriteStream *s);
+WriteMark write_mark(WriteStream *s);
+void write_seek(WriteStream *s, const WriteMark *m);
+int write_cost(TokenList *inst, int n, char *fname, const struct Conv *fast);
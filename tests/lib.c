@@ -0,0 +1,244 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jackvmc.h"
+
+/**
+ * Library test.
+ *
+ * Translates the VM files given through libjackvmc and compares the
+ * result with what the jackvmc binary writes for them. The same context
+ * then translates another program, inputs it has to reject and output a
+ * sink fails on, and the files again, which have to come out the same.
+ * Last, TEST_THREADS contexts translate them at once, one per thread.
+ *
+ * Usage: tests/lib JACKVMC FILE.vm...
+ *
+ */
+
+#define TEST_THREADS  4
+
+typedef struct Buf {
+    char *data;
+    size_t len;
+} Buf;
+
+// One thread's translation, compared with want
+typedef struct Run {
+    const JackvmcSource *src;
+    int n;
+    const Buf *want;
+    int ok;
+} Run;
+
+static const char other[] =
+    "function Sys.init 0\n"
+    "push constant 1\n"
+    "pop static 0\n"
+    "label END\n"
+    "goto END\n";
+
+static int sink(void *user, const char *data, size_t len);
+static int refuse(void *user, const char *data, size_t len);
+static char *slurp(FILE *fp, size_t *len);
+static int same(const Buf *x, const Buf *y);
+static void *run(void *arg);
+static int check(int ok, const char *name);
+
+
+int main(int argc, char **argv) {
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s JACKVMC FILE.vm...\n", argv[0]);
+        return 1;
+    }
+
+    int n = argc - 2;
+    JackvmcSource *src = malloc(n * sizeof(JackvmcSource));
+    size_t cmdlen = strlen(argv[1]) + 1;
+
+    if (!src) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < n; ++i) {
+        FILE *fp = fopen(argv[i + 2], "r");
+        if (!fp) {
+            fprintf(stderr, "Failed to load file '%s'\n", argv[i + 2]);
+            exit(1);
+        }
+
+        src[i].name = argv[i + 2];
+        src[i].data = slurp(fp, &src[i].len);
+        fclose(fp);
+
+        cmdlen += strlen(argv[i + 2]) + 3;
+    }
+
+    // What the binary writes
+    char *cmd = malloc(cmdlen + 1);
+    if (!cmd) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    strcpy(cmd, argv[1]);
+    for (int i = 0; i < n; ++i) {
+        strcat(cmd, " '");
+        strcat(cmd, argv[i + 2]);
+        strcat(cmd, "'");
+    }
+
+    FILE *pp = popen(cmd, "r");
+    if (!pp) {
+        fprintf(stderr, "Failed to run '%s'\n", cmd);
+        exit(1);
+    }
+
+    Buf want;
+    want.data = slurp(pp, &want.len);
+
+    if (pclose(pp) != 0) {
+        fprintf(stderr, "'%s' failed\n", cmd);
+        exit(1);
+    }
+
+    int fail = 0;
+    Jackvmc *ctx = jackvmc_new();
+    Buf got = { NULL, 0 };
+
+    fail |= check(jackvmc_translate(ctx, src, n, sink, &got) == 0
+                  && same(&got, &want), "translate");
+
+    // Another program, then ones that have to fail
+    JackvmcSource sys = { "Sys.vm", other, sizeof(other) - 1 };
+    JackvmcSource bad_name = { "Sys.txt", other, sizeof(other) - 1 };
+    JackvmcSource bad_code = { "Sys.vm", "push nowhere 1\n", 15 };
+    Buf out = { NULL, 0 };
+
+    fail |= check(jackvmc_translate(ctx, &sys, 1, sink, &out) == 0
+                  && out.len && !same(&out, &want), "reuse for another program");
+    fail |= check(jackvmc_translate(ctx, &bad_name, 1, sink, &out) != 0,
+                  "reject a name without .vm");
+    fail |= check(jackvmc_translate(ctx, &bad_code, 1, sink, &out) != 0,
+                  "reject code that doesn't lex");
+    fail |= check(jackvmc_translate(ctx, src, n, refuse, NULL) != 0,
+                  "fail with the sink");
+
+    fail |= check(jackvmc_translate(ctx, src, n, sink, &got) == 0
+                  && same(&got, &want), "translate again");
+
+    jackvmc_set_jobs(ctx, 4);
+    fail |= check(jackvmc_translate(ctx, src, n, sink, &got) == 0
+                  && same(&got, &want), "translate with 4 jobs");
+
+    jackvmc_free(ctx);
+
+    // Contexts are independent
+    pthread_t thread[TEST_THREADS];
+    Run r[TEST_THREADS];
+    int ok = 1;
+
+    for (int t = 0; t < TEST_THREADS; ++t) {
+        r[t] = (Run) { src, n, &want, 0 };
+
+        if (pthread_create(&thread[t], NULL, run, &r[t]) != 0) {
+            fprintf(stderr, "Failed to start thread\n");
+            exit(1);
+        }
+    }
+
+    for (int t = 0; t < TEST_THREADS; ++t) {
+        pthread_join(thread[t], NULL);
+        ok &= r[t].ok;
+    }
+
+    fail |= check(ok, "translate on threads at once");
+
+    for (int i = 0; i < n; ++i)
+        free((char*) src[i].data);
+    free(src);
+    free(cmd);
+    free(want.data);
+    free(got.data);
+    free(out.data);
+
+    return fail;
+}
+
+// Keep the output in the Buf user points to
+int sink(void *user, const char *data, size_t len) {
+
+    Buf *b = user;
+
+    free(b->data);
+    b->data = malloc(len + 1);
+    if (!b->data) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    memcpy(b->data, data, len);
+    b->len = len;
+
+    return 0;
+}
+
+int refuse(void *user, const char *data, size_t len) {
+    return 1;
+}
+
+// All of fp, in memory
+char *slurp(FILE *fp, size_t *len) {
+
+    size_t cap = 4096;
+    char *r = malloc(cap);
+    *len = 0;
+
+    for (;;) {
+        if (!r) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+
+        *len += fread(r + *len, 1, cap - *len, fp);
+        if (*len < cap)
+            return r;
+
+        cap *= 2;
+        r = realloc(r, cap);
+    }
+}
+
+int same(const Buf *x, const Buf *y) {
+    return x->len == y->len && memcmp(x->data, y->data, x->len) == 0;
+}
+
+void *run(void *arg) {
+
+    Run *r = arg;
+    Jackvmc *ctx = jackvmc_new();
+    Buf got = { NULL, 0 };
+
+    // Each a few times, to overlap
+    r->ok = 1;
+    for (int i = 0; i < 8; ++i)
+        r->ok &= jackvmc_translate(ctx, r->src, r->n, sink, &got) == 0
+               && same(&got, r->want);
+
+    jackvmc_free(ctx);
+    free(got.data);
+
+    return NULL;
+}
+
+// Report a check, returning 1 if it failed
+int check(int ok, const char *name) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+    fflush(stdout);
+
+    return !ok;
+}
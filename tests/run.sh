@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# Differential test: runs what each optimization writes.
+#
+# Translates every program under tests/run, one directory of VM files
+# each, with the options below, and runs the result on the emulator
+# with `hackprof -d`. RAM after the run has to match the program's
+# `ram` file: SP, the statics by name, the stack below SP and the heap,
+# one `WHERE VALUE` per nonzero word, sorted. Those are known values,
+# worked out by translating with none of the passes, so a bug in one
+# that is always on shows up as well.
+#
+# Usage: tests/run.sh [JACKVMC [HACKPROF]]
+
+JACKVMC=${1:-./jackvmc}
+HACKPROF=${2:-./hackprof}
+CYCLES=${RUN_CYCLES:-10000000}
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+fail=0
+
+# RAM of the program in $1 translated with the rest as options
+ram() {
+    prog=$1
+    shift
+
+    "$JACKVMC" --alloc-statics="$dir/statics" "$@" "$prog"/*.vm \
+            > "$dir/out.asm" 2> "$dir/err" \
+        && "$HACKPROF" -n "$CYCLES" -d "$dir/out.ram" "$dir/out.asm" > /dev/null \
+        && awk 'FILENAME != ARGV[2] { name[$2] = $1; next }
+                FNR == 1 && $1 == 0 { sp = $2 }
+                $1 in name { print name[$1], $2; next }
+                $1 == 0 || ($1 >= 256 && $1 < sp) || ($1 >= 2048 && $1 < 16384)' \
+                "$dir/statics" "$dir/out.ram" \
+        | LC_ALL=C sort
+}
+
+for prog in tests/run/*/; do
+    prog=${prog%/}
+    name=${prog##*/}
+
+    for opts in "" "-j4" "--short-labels" "--fast-calls" "--unroll" "--unroll=1024" \
+            "--strength-reduce" "--inline-alloc" "--alias" "--dead-code" \
+            "--size" "--self-calls" \
+            "--fast-calls --unroll --strength-reduce --inline-alloc --alias --dead-code --size --self-calls" \
+            "--unroll --strength-reduce --alias --dead-code --size --self-calls"; do
+
+        # Unquoted, to split into options
+        if ram "$prog" $opts > "$dir/got" && cmp -s "$prog/ram" "$dir/got"; then
+            echo "ok   $name $opts"
+        else
+            echo "FAIL $name $opts"
+            cat "$dir/err"
+            diff "$prog/ram" "$dir/got" | head -n 10
+            fail=1
+        fi
+    done
+done
+
+exit $fail
@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Stress test: very large inputs under a small stack.
+#
+# Translates one file of $STRESS_N instructions (default 1000000) with
+# long runs of comment and blank lines, and $STRESS_FILES small files
+# (default 2000), with the stack limited to $STRESS_STACK KiB (default
+# 256). Anything that recurses per instruction, line or file overflows.
+#
+# Usage: tests/stress.sh [JACKVMC]
+
+JACKVMC=${1:-./jackvmc}
+N=${STRESS_N:-1000000}
+FILES=${STRESS_FILES:-2000}
+STACK=${STRESS_STACK:-256}
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+fail=0
+
+run() {
+    name=$1
+    shift
+
+    if (ulimit -s "$STACK" && "$JACKVMC" "$@" > "$dir/out.asm"); then
+        if grep -q 'BEGIN FN $Sys.init' "$dir/out.asm"; then
+            echo "ok   $name"
+            return
+        fi
+    fi
+
+    echo "FAIL $name"
+    fail=1
+}
+
+awk -v n="$N" 'BEGIN {
+    print "function Sys.init 0"
+    for (i = 0; i < n / 2; ++i) {
+        print "push constant " i % 32768
+        print "pop static 0"
+
+        if (i % 100000 == 0)
+            for (j = 0; j < 100000; ++j)
+                print (j % 2) ? "// comment" : ""
+    }
+    print "label END"
+    print "goto END"
+}' > "$dir/Sys.vm"
+
+mkdir "$dir/many"
+awk -v n="$FILES" -v d="$dir/many" 'BEGIN {
+    for (i = 0; i < n; ++i) {
+        f = d "/F" i ".vm"
+        print "function F" i ".f 0" > f
+        print "push constant " i > f
+        print "return" > f
+        close(f)
+    }
+}'
+
+run "one file of $N instructions" -j1 "$dir/Sys.vm"
+run "one file of $N instructions, -j4" -j4 "$dir/Sys.vm"
+run "one file of $N instructions, --pipeline" --pipeline "$dir/Sys.vm"
+run "$FILES files" -j1 "$dir/Sys.vm" "$dir"/many/*.vm
+
+exit $fail